@@ -0,0 +1,414 @@
+// Compressed BMS history in the AVR EEPROM - by corbin dunn
+// www.corbinstreehouse.com
+
+#include "BmsHistory.h"
+#include "Canbus.h"
+
+#include <string.h>
+
+#if defined(ARDUINO)
+    #include <avr/eeprom.h>
+#endif
+
+#define FIELD_COUNT 5
+#define REPEAT_TAG 0x80
+#define NIBBLE_TAG 0x00
+#define WHOLE_TAG 0x20
+#define FIELD_MASK 0x1F
+#define END_TAG 0xFF
+#define MAX_REPEATS 127
+#define NO_SEQUENCE 0xFF
+
+static const uint8_t fieldSizes[FIELD_COUNT] = { 1, 2, 2, 1, 1 };
+
+static int32_t getField(const BmsHistorySample *sample, uint8_t field) {
+    switch (field) {
+        case 0: return sample->stateOfCharge;
+        case 1: return sample->packDecivolts;
+        case 2: return sample->packDeciamps;
+        case 3: return sample->minCell;
+        default: return sample->maxCell;
+    }
+}
+
+static void setField(BmsHistorySample *sample, uint8_t field, int32_t value) {
+    switch (field) {
+        case 0: sample->stateOfCharge = value; break;
+        case 1: sample->packDecivolts = value; break;
+        case 2: sample->packDeciamps = value; break;
+        case 3: sample->minCell = value; break;
+        default: sample->maxCell = value; break;
+    }
+}
+
+#if defined(ARDUINO)
+static uint8_t eepromRead(uint16_t address) {
+    return eeprom_read_byte((const uint8_t *)address);
+}
+
+static void eepromWrite(uint16_t address, uint8_t value) {
+    eeprom_update_byte((uint8_t *)address, value);
+}
+
+static const BmsHistoryStorage eepromStorage = {
+    eepromRead,
+    eepromWrite,
+};
+#endif
+
+BmsHistory::BmsHistory() {
+#if defined(ARDUINO)
+    _storage = &eepromStorage;
+#else
+    _storage = NULL;
+#endif
+    _interval = 60;
+    _hasPage = false;
+    _page = 0;
+    _sequence = NO_SEQUENCE - 1;
+    _offset = BMS_HISTORY_PAGE_SIZE;
+    memset(&_last, 0, sizeof(_last));
+    _pendingRepeats = 0;
+}
+
+// How many pages in a row, ending with this one, have consecutive sequence numbers
+uint8_t BmsHistory::chainLength(uint8_t page) {
+    uint8_t length = 0;
+    uint8_t sequence = pageSequence(page);
+    while (sequence != NO_SEQUENCE && length < BMS_HISTORY_PAGES) {
+        length++;
+        page = page == 0 ? BMS_HISTORY_PAGES - 1 : page - 1;
+        uint8_t previous = pageSequence(page);
+        if (previous != (sequence == 0 ? NO_SEQUENCE - 1 : sequence - 1)) {
+            break;
+        }
+        sequence = previous;
+    }
+    return length;
+}
+
+uint8_t BmsHistory::oldestPage() {
+    uint8_t length = chainLength(_page);
+    return (_page + BMS_HISTORY_PAGES + 1 - length) % BMS_HISTORY_PAGES;
+}
+
+void BmsHistory::begin(uint16_t intervalSeconds) {
+    _interval = intervalSeconds;
+    _hasPage = false;
+    _pendingRepeats = 0;
+    // The newest page ends the longest run of consecutive sequence numbers; anything else is
+    // left from an older trip around the ring, or a page start cut short by a power loss
+    uint8_t longest = 0;
+    for (uint8_t page = 0; page < BMS_HISTORY_PAGES; page++) {
+        uint8_t length = chainLength(page);
+        if (length > longest) {
+            longest = length;
+            _page = page;
+        }
+    }
+    if (longest == 0) {
+        _page = BMS_HISTORY_PAGES - 1; // so the first page is 0
+        _sequence = NO_SEQUENCE - 1;
+        return;
+    }
+    _hasPage = true;
+    _sequence = pageSequence(_page);
+    uint32_t count = 0;
+    _offset = walkPage(_page, &_last, 0, 0, NULL, &count);
+}
+
+void BmsHistory::startPage(const BmsHistorySample *sample) {
+    _page = (_page + 1) % BMS_HISTORY_PAGES;
+    _sequence = _sequence + 1 == NO_SEQUENCE ? 0 : _sequence + 1;
+    uint16_t address = pageAddress(_page);
+    // Invalidate the page first, so a power loss part way through leaves it out of the chain
+    _storage->write(address, NO_SEQUENCE);
+    uint8_t header[BMS_HISTORY_HEADER_SIZE];
+    header[1] = sample->time;
+    header[2] = sample->time >> 8;
+    header[3] = sample->time >> 16;
+    header[4] = sample->time >> 24;
+    uint8_t at = 5;
+    for (uint8_t field = 0; field < FIELD_COUNT; field++) {
+        int32_t value = getField(sample, field);
+        for (uint8_t i = 0; i < fieldSizes[field]; i++) {
+            header[at++] = value >> (8 * i);
+        }
+    }
+    for (uint8_t i = 1; i < BMS_HISTORY_HEADER_SIZE; i++) {
+        _storage->write(address + i, header[i]);
+    }
+    for (uint8_t i = BMS_HISTORY_HEADER_SIZE; i < BMS_HISTORY_PAGE_SIZE; i++) {
+        _storage->write(address + i, END_TAG);
+    }
+    _storage->write(address, _sequence);
+    _offset = BMS_HISTORY_HEADER_SIZE;
+    _last = *sample;
+    _hasPage = true;
+}
+
+bool BmsHistory::append(const uint8_t *bytes, uint8_t length) {
+    if (_offset + length > BMS_HISTORY_PAGE_SIZE) {
+        return false;
+    }
+    uint16_t address = pageAddress(_page) + _offset;
+    for (uint8_t i = 0; i < length; i++) {
+        _storage->write(address + i, bytes[i]);
+    }
+    _offset += length;
+    return true;
+}
+
+void BmsHistory::writeRepeats() {
+    if (_pendingRepeats == 0) {
+        return;
+    }
+    uint8_t record = REPEAT_TAG | (_pendingRepeats - 1);
+    if (!append(&record, 1)) {
+        // The first repeat becomes the new page's sample
+        BmsHistorySample first = _last;
+        first.time -= (uint32_t)(_pendingRepeats - 1) * _interval;
+        startPage(&first);
+        _last.time = first.time + (uint32_t)(_pendingRepeats - 1) * _interval;
+        if (_pendingRepeats > 1) {
+            record = REPEAT_TAG | (_pendingRepeats - 2);
+            append(&record, 1);
+        }
+    }
+    _pendingRepeats = 0;
+}
+
+void BmsHistory::add(const BmsHistorySample *sample) {
+    if (_storage == NULL) {
+        return;
+    }
+    uint32_t expected = _last.time + _interval;
+    int32_t drift = sample->time - expected;
+    if (!_hasPage || drift > (int32_t)(_interval / 2) || drift < -(int32_t)(_interval / 2)) {
+        writeRepeats();
+        startPage(sample);
+        return;
+    }
+    uint8_t record[1 + 7]; // the tag, and at most every field whole
+    uint8_t mask = 0;
+    bool small = true;
+    for (uint8_t field = 0; field < FIELD_COUNT; field++) {
+        int32_t delta = getField(sample, field) - getField(&_last, field);
+        if (delta != 0) {
+            mask |= 1 << field;
+            small = small && delta >= -8 && delta <= 7;
+        }
+    }
+    if (mask == 0) {
+        _last.time = expected;
+        if (++_pendingRepeats == MAX_REPEATS) {
+            writeRepeats();
+        }
+        return;
+    }
+    writeRepeats();
+
+    uint8_t length = 1;
+    if (small) {
+        record[0] = NIBBLE_TAG | mask;
+        uint8_t nibbles = 0;
+        for (uint8_t field = 0; field < FIELD_COUNT; field++) {
+            if (mask & (1 << field)) {
+                int8_t delta = getField(sample, field) - getField(&_last, field);
+                uint8_t zigzag = delta < 0 ? ((-delta) << 1) - 1 : delta << 1; // -8..7 -> 0..15
+                if ((nibbles & 1) == 0) {
+                    record[length] = zigzag << 4;
+                } else {
+                    record[length++] |= zigzag;
+                }
+                nibbles++;
+            }
+        }
+        if (nibbles & 1) {
+            length++;
+        }
+    } else {
+        record[0] = WHOLE_TAG | mask;
+        for (uint8_t field = 0; field < FIELD_COUNT; field++) {
+            if (mask & (1 << field)) {
+                int32_t value = getField(sample, field);
+                for (uint8_t i = 0; i < fieldSizes[field]; i++) {
+                    record[length++] = value >> (8 * i);
+                }
+            }
+        }
+    }
+    if (append(record, length)) {
+        _last = *sample;
+        _last.time = expected;
+    } else {
+        startPage(sample);
+    }
+}
+
+#if CANBUS_ENABLE_STATE_VALUES && CANBUS_ENABLE_PACK_VALUES && CANBUS_ENABLE_CURRENT_VALUES
+bool BmsHistory::sample(CanbusClass *canbus, uint32_t time) {
+    CanbusCellExtremes extremes = canbus->getCellExtremes();
+    if (extremes.status != CanbusReadFresh) {
+        return false;
+    }
+    BmsHistorySample sample;
+    sample.time = time;
+    sample.stateOfCharge = canbus->getStateOfCharge();
+    sample.packDecivolts = canbus->getPackDecivolts();
+    sample.packDeciamps = canbus->getPackDeciamps();
+    sample.minCell = (extremes.min.millivolts - 2000) / 10;
+    sample.maxCell = (extremes.max.millivolts - 2000) / 10;
+    add(&sample);
+    return true;
+}
+#endif
+
+void BmsHistory::flush() {
+    if (_storage) {
+        writeRepeats();
+    }
+}
+
+void BmsHistory::clear() {
+    if (_storage == NULL) {
+        return;
+    }
+    for (uint8_t page = 0; page < BMS_HISTORY_PAGES; page++) {
+        _storage->write(pageAddress(page), NO_SEQUENCE);
+    }
+    begin(_interval);
+}
+
+// Decodes a page from its header, calling back with each sample from from to to (if there is a
+// callback). Leaves the page's newest sample in *sample and returns where its records end.
+uint8_t BmsHistory::walkPage(uint8_t page, BmsHistorySample *sample, uint32_t from, uint32_t to, BmsHistoryCallback callback, uint32_t *count) {
+    uint16_t address = pageAddress(page);
+    uint8_t at = 1;
+    sample->time = 0;
+    for (uint8_t i = 0; i < 4; i++) {
+        sample->time |= (uint32_t)_storage->read(address + at++) << (8 * i);
+    }
+    for (uint8_t field = 0; field < FIELD_COUNT; field++) {
+        uint16_t value = 0;
+        for (uint8_t i = 0; i < fieldSizes[field]; i++) {
+            value |= (uint16_t)_storage->read(address + at++) << (8 * i);
+        }
+        setField(sample, field, field == 2 ? (int16_t)value : value);
+    }
+    uint8_t emit = 1;
+    while (true) {
+        for (; emit > 0; emit--) {
+            if (callback && sample->time >= from && sample->time <= to) {
+                callback(sample);
+                (*count)++;
+            }
+            if (emit > 1) {
+                sample->time += _interval;
+            }
+        }
+        if (at >= BMS_HISTORY_PAGE_SIZE) {
+            break;
+        }
+        uint8_t tag = _storage->read(address + at);
+        if (tag == END_TAG) {
+            break;
+        }
+        if (tag & REPEAT_TAG) {
+            emit = (tag & 0x7F) + 1;
+            sample->time += _interval;
+            at++;
+            continue;
+        }
+        uint8_t mask = tag & FIELD_MASK;
+        uint8_t length = 0;
+        for (uint8_t field = 0; field < FIELD_COUNT; field++) {
+            if (mask & (1 << field)) {
+                length += (tag & WHOLE_TAG) ? fieldSizes[field] : 1;
+            }
+        }
+        if ((tag & WHOLE_TAG) == 0) {
+            length = (length + 1) / 2; // nibbles
+        }
+        if (at + 1 + length > BMS_HISTORY_PAGE_SIZE) {
+            break; // cut short; the writer never does this
+        }
+        uint16_t byte = address + at + 1;
+        uint8_t nibble = 0;
+        for (uint8_t field = 0; field < FIELD_COUNT; field++) {
+            if ((mask & (1 << field)) == 0) {
+                continue;
+            }
+            if (tag & WHOLE_TAG) {
+                uint16_t value = 0;
+                for (uint8_t i = 0; i < fieldSizes[field]; i++) {
+                    value |= (uint16_t)_storage->read(byte++) << (8 * i);
+                }
+                setField(sample, field, field == 2 ? (int16_t)value : value);
+            } else {
+                uint8_t packed = _storage->read(byte);
+                uint8_t zigzag = (nibble & 1) ? packed & 0x0F : packed >> 4;
+                if (nibble & 1) {
+                    byte++;
+                }
+                nibble++;
+                int8_t delta = (zigzag & 1) ? -(int8_t)((zigzag + 1) >> 1) : zigzag >> 1;
+                setField(sample, field, getField(sample, field) + delta);
+            }
+        }
+        sample->time += _interval;
+        at += 1 + length;
+        emit = 1;
+    }
+    return at;
+}
+
+uint32_t BmsHistory::query(uint32_t from, uint32_t to, BmsHistoryCallback callback) {
+    uint32_t count = 0;
+    if (_storage == NULL || !_hasPage) {
+        return 0;
+    }
+    uint8_t length = chainLength(_page);
+    uint8_t page = oldestPage();
+    BmsHistorySample sample;
+    for (uint8_t i = 0; i < length; i++, page = (page + 1) % BMS_HISTORY_PAGES) {
+        uint16_t nextAddress = pageAddress((page + 1) % BMS_HISTORY_PAGES);
+        if (i + 1 < length) {
+            // Skip pages that end before from, going by when the next one starts
+            uint32_t nextTime = 0;
+            for (uint8_t b = 0; b < 4; b++) {
+                nextTime |= (uint32_t)_storage->read(nextAddress + 1 + b) << (8 * b);
+            }
+            if (nextTime <= from) {
+                continue;
+            }
+        }
+        walkPage(page, &sample, from, to, callback, &count);
+        if (sample.time >= to) {
+            break;
+        }
+    }
+    // Repeats still in RAM
+    sample = _last;
+    sample.time -= (uint32_t)_pendingRepeats * _interval;
+    for (uint8_t i = 0; i < _pendingRepeats; i++) {
+        sample.time += _interval;
+        if (sample.time >= from && sample.time <= to) {
+            callback(&sample);
+            count++;
+        }
+    }
+    return count;
+}
+
+bool BmsHistory::getOldestTime(uint32_t *time) {
+    if (_storage == NULL || !_hasPage) {
+        return false;
+    }
+    uint16_t address = pageAddress(oldestPage());
+    *time = 0;
+    for (uint8_t b = 0; b < 4; b++) {
+        *time |= (uint32_t)_storage->read(address + 1 + b) << (8 * b);
+    }
+    return true;
+}
@@ -0,0 +1,96 @@
+// Compressed BMS history in the AVR EEPROM - by corbin dunn
+// www.corbinstreehouse.com
+//
+// Keeps SOC, pack voltage, current and the min/max cell on the device for as far back as the
+// EEPROM region (BMS_HISTORY_EEPROM_START/SIZE in CanbusConfig.h) allows, for warranty claims.
+// In extras/host/history_benchmark's synthetic trace the default 896 bytes hold about 1000
+// samples: 0.7 days at a sample a minute, 1.7 days at one every 5 minutes and 4.3 days at one
+// every 15 minutes (a busier trace compresses less well).
+//
+// Samples are taken every interval seconds, so their times are implied. The region is split
+// into pages, used in a ring; each page starts with a whole sample and its time, and after that:
+//   0x80-0xFE   the previous sample again, (byte & 0x7F) + 1 times
+//   0x01-0x1F   the fields in the low 5 bits changed by -8 to 7; one nibble each, high first
+//   0x21-0x3F   the fields in the low 5 bits changed by more; their new values follow whole
+//   0xFF        nothing written yet (the rest of the page)
+// Fields, in bit order: SOC, pack voltage, current, min cell, max cell. A parked pack costs a
+// byte per 127 samples and a slowly moving one 2-3 bytes a sample, against 11 for a raw record.
+//
+// Wear: every byte is written about once each time the ring goes around (twice counting the
+// page being cleared first), and a run of repeats stays in RAM until it ends or reaches 127, so
+// no cell is rewritten in place. 100,000 writes a cell is decades at a sample a minute. A power
+// loss loses at most the repeats in RAM; the pages already written are consistent because a
+// page's sequence number is written last.
+
+#ifndef BMS_HISTORY_H
+#define BMS_HISTORY_H
+
+#include <stdint.h>
+
+#include "CanbusConfig.h"
+
+#define BMS_HISTORY_HEADER_SIZE 12
+#define BMS_HISTORY_PAGES (BMS_HISTORY_EEPROM_SIZE / BMS_HISTORY_PAGE_SIZE)
+
+typedef struct {
+    uint32_t time; // seconds, on whatever clock the sketch uses
+    uint8_t stateOfCharge; // percent
+    uint16_t packDecivolts;
+    int16_t packDeciamps;
+    uint8_t minCell; // encoded: 10mV steps above 2.0V, like CanbusClass::getEncodedVoltageForCell
+    uint8_t maxCell;
+} BmsHistorySample;
+
+typedef void (*BmsHistoryCallback)(const BmsHistorySample *sample);
+
+// Byte access to the history's storage. On the Arduino this defaults to the EEPROM; a host
+// build can point it at RAM.
+typedef struct {
+    uint8_t (*read)(uint16_t address);
+    void (*write)(uint16_t address, uint8_t value); // should skip writing an unchanged byte
+} BmsHistoryStorage;
+
+class CanbusClass;
+
+class BmsHistory
+{
+private:
+    const BmsHistoryStorage *_storage;
+    uint16_t _interval;
+    bool _hasPage;
+    uint8_t _page; // being written
+    uint8_t _sequence; // of _page; 0-254
+    uint8_t _offset; // next free byte in _page
+    BmsHistorySample _last; // the newest sample, with its implied time
+    uint8_t _pendingRepeats; // of _last, not yet written
+
+    uint16_t pageAddress(uint8_t page) { return BMS_HISTORY_EEPROM_START + (uint16_t)page * BMS_HISTORY_PAGE_SIZE; }
+    uint8_t pageSequence(uint8_t page) { return _storage->read(pageAddress(page)); }
+    uint8_t chainLength(uint8_t page);
+    uint8_t oldestPage();
+    void startPage(const BmsHistorySample *sample);
+    bool append(const uint8_t *bytes, uint8_t length);
+    void writeRepeats();
+    uint8_t walkPage(uint8_t page, BmsHistorySample *sample, uint32_t from, uint32_t to, BmsHistoryCallback callback, uint32_t *count);
+public:
+    BmsHistory();
+    void setStorage(const BmsHistoryStorage *storage) { _storage = storage; } // before begin()
+
+    // Picks up after whatever is already stored. Samples more than half an interval off the
+    // expected time (ie: after a reboot) start a new page, which costs the rest of the old one.
+    void begin(uint16_t intervalSeconds);
+    void add(const BmsHistorySample *sample);
+#if CANBUS_ENABLE_STATE_VALUES && CANBUS_ENABLE_PACK_VALUES && CANBUS_ENABLE_CURRENT_VALUES
+    // Reads the values from the BMS and adds them; false (and nothing added) if it didn't answer
+    bool sample(CanbusClass *canbus, uint32_t time);
+#endif
+    // Writes out a pending run of repeats, ie: before powering down
+    void flush();
+    void clear();
+
+    // Calls back with every sample from from to to (inclusive) in time order; returns how many
+    uint32_t query(uint32_t from, uint32_t to, BmsHistoryCallback callback);
+    bool getOldestTime(uint32_t *time);
+};
+
+#endif
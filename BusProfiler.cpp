@@ -0,0 +1,114 @@
+// Per ID statistics of the traffic on the bus - by corbin dunn
+// www.corbinstreehouse.com
+
+#include "BusProfiler.h"
+
+#include <string.h>
+
+#define COUNT_MAX ((BusProfilerCount)~(BusProfilerCount)0)
+#define MEAN_GAP_MAX 4095 // ms, so the difference in 1/8 ms fits an int16_t
+
+BusProfiler::BusProfiler() {
+    clear();
+}
+
+void BusProfiler::clear() {
+    for (uint8_t i = 0; i < BUS_PROFILER_SLOTS; i++) {
+        _entries[i].id = BUS_PROFILER_EMPTY;
+    }
+    _ids = 0;
+    _frames = 0;
+    _untrackedFrames = 0;
+}
+
+// The ID's slot, or the empty one where it would go
+BusProfilerEntry *BusProfiler::slotFor(uint16_t id) {
+    // Fibonacci hashing; the IDs on a bus come in runs (ie: 0x620-0x628), which the low bits
+    // alone would pile up on top of each other
+    uint8_t slot = (uint16_t)(id * 40503u) >> (16 - BUS_PROFILER_SLOT_BITS);
+    while (_entries[slot].id != id && _entries[slot].id != BUS_PROFILER_EMPTY) {
+        slot = (slot + 1) & (BUS_PROFILER_SLOTS - 1);
+    }
+    return &_entries[slot];
+}
+
+void BusProfiler::record(uint32_t timestamp, const tCAN *message) {
+    _frames++;
+    BusProfilerEntry *entry = slotFor(message->id);
+    if (entry->id == BUS_PROFILER_EMPTY) {
+        if (_ids >= BUS_PROFILER_MAX_IDS) {
+            _untrackedFrames++;
+            return;
+        }
+        _ids++;
+        entry->id = message->id;
+        entry->frames = 0;
+        entry->bytes = 0;
+        entry->minGap = 0xFFFF;
+        entry->maxGap = 0;
+    } else {
+        uint32_t gap = timestamp - entry->lastSeen;
+        uint16_t clipped = gap > 0xFFFF ? 0xFFFF : gap;
+        if (clipped < entry->minGap) {
+            entry->minGap = clipped;
+        }
+        if (clipped > entry->maxGap) {
+            entry->maxGap = clipped;
+        }
+        // An average of all the gaps would need the first time seen and a division per frame;
+        // this moves 1/8 of the way to each new gap instead, starting at the first one
+        int16_t eighths = (gap > MEAN_GAP_MAX ? MEAN_GAP_MAX : gap) * 8;
+        if (entry->frames == 1) {
+            entry->meanGap = eighths;
+        } else {
+            entry->meanGap += (eighths - (int16_t)entry->meanGap) / 8;
+        }
+    }
+    if (entry->frames < COUNT_MAX) {
+        entry->frames++;
+    }
+    entry->lastSeen = timestamp;
+    entry->rtr = message->header.rtr ? 1 : 0;
+    entry->length = message->header.length > 8 ? 8 : message->header.length;
+    if (!entry->rtr) {
+        entry->bytes = entry->bytes < COUNT_MAX - 8 ? entry->bytes + entry->length : COUNT_MAX;
+        memcpy(entry->data, message->data, entry->length);
+    }
+}
+
+const BusProfilerEntry *BusProfiler::find(uint16_t id) {
+    BusProfilerEntry *entry = slotFor(id);
+    return entry->id == BUS_PROFILER_EMPTY ? NULL : entry;
+}
+
+uint32_t BusProfiler::getMeanGap(const BusProfilerEntry *entry) {
+    return entry->frames < 2 ? 0 : (entry->meanGap + 4) / 8;
+}
+
+uint8_t BusProfiler::getTop(const BusProfilerEntry **top, uint8_t count, BusProfilerOrder order) {
+    // Insertion into the (short) list, busiest first
+    uint8_t found = 0;
+    for (uint8_t i = 0; i < BUS_PROFILER_SLOTS; i++) {
+        const BusProfilerEntry *entry = &_entries[i];
+        if (entry->id == BUS_PROFILER_EMPTY) {
+            continue;
+        }
+        uint32_t key = order == BusProfilerByBytes ? entry->bytes : entry->frames;
+        uint8_t position = found;
+        while (position > 0 && key > (order == BusProfilerByBytes ? top[position - 1]->bytes : top[position - 1]->frames)) {
+            position--;
+        }
+        if (position >= count) {
+            continue;
+        }
+        uint8_t last = found < count ? found : count - 1;
+        for (uint8_t j = last; j > position; j--) {
+            top[j] = top[j - 1];
+        }
+        top[position] = entry;
+        if (found < count) {
+            found++;
+        }
+    }
+    return found;
+}
@@ -0,0 +1,83 @@
+// Per ID statistics of the traffic on the bus - by corbin dunn
+// www.corbinstreehouse.com
+//
+// For finding out which IDs dominate a misbehaving bus and how regular their periods are, so
+// the schedule (CanbusClass::schedule()) and filters (CanbusClass::setIdFilter()) can be tuned
+// against real traffic. Attach one with CanbusClass::setProfiler(); every frame received is
+// counted in a small open addressed table keyed by ID. To see the whole bus rather than what
+// the ID filter lets through, call setIdFilter(NULL) first, and listen only mode
+// (CanbusClass::setMode()) keeps the profiling from adding any traffic of its own.
+//
+// Times are the driver's millis(), so gaps under a millisecond read as 0 or 1. A gap longer
+// than 65535 ms is counted as 65535 for the minimum and maximum. The mean is smoothed over about
+// the last 8 gaps, to within a ms, and counts gaps longer than 4095 ms as 4095. The per ID
+// frame and byte counts stop at 65535 (the totals don't), so clear() between looks at a busy bus.
+
+#ifndef BUS_PROFILER_H
+#define BUS_PROFILER_H
+
+#include <stdint.h>
+
+#include "mcp2515.h"
+
+#ifndef BUS_PROFILER_SLOT_BITS
+    #define BUS_PROFILER_SLOT_BITS 4 // 16 slots of 26 bytes
+#endif
+#ifndef BUS_PROFILER_COUNT_TYPE
+    #define BUS_PROFILER_COUNT_TYPE uint16_t // for the per ID counts; the host tools use uint32_t
+#endif
+#if BUS_PROFILER_SLOT_BITS > 7
+    #error "the slot indexes are uint8_t"
+#endif
+#define BUS_PROFILER_SLOTS (1 << BUS_PROFILER_SLOT_BITS)
+// New IDs are taken until the table is 7/8 full, so looking one up always ends at an empty slot
+#define BUS_PROFILER_MAX_IDS (BUS_PROFILER_SLOTS - BUS_PROFILER_SLOTS / 8)
+#define BUS_PROFILER_EMPTY 0xFFFF
+
+typedef BUS_PROFILER_COUNT_TYPE BusProfilerCount;
+
+typedef struct {
+    uint16_t id; // BUS_PROFILER_EMPTY for an unused slot
+    BusProfilerCount frames;
+    BusProfilerCount bytes; // data bytes
+    uint32_t lastSeen; // ms
+    uint16_t minGap; // ms between frames; only meaningful once there are two
+    uint16_t maxGap;
+    uint16_t meanGap; // in 1/8 ms; see getMeanGap()
+    uint8_t length; // of the last frame
+    uint8_t data[8]; // the last payload
+    uint8_t rtr;
+} BusProfilerEntry;
+
+typedef enum {
+    BusProfilerByFrames,
+    BusProfilerByBytes,
+} BusProfilerOrder;
+
+class BusProfiler
+{
+private:
+    BusProfilerEntry _entries[BUS_PROFILER_SLOTS];
+    uint8_t _ids; // slots in use
+    uint32_t _frames;
+    uint32_t _untrackedFrames; // of IDs that came after the table filled up
+
+    BusProfilerEntry *slotFor(uint16_t id);
+public:
+    BusProfiler();
+    void clear();
+
+    // CanbusClass calls this for every frame it receives
+    void record(uint32_t timestamp, const tCAN *message);
+
+    // Fills top with up to count entries, the busiest first; returns how many
+    uint8_t getTop(const BusProfilerEntry **top, uint8_t count, BusProfilerOrder order = BusProfilerByFrames);
+    const BusProfilerEntry *find(uint16_t id);
+    static uint32_t getMeanGap(const BusProfilerEntry *entry); // ms; 0 until there are two frames
+
+    uint8_t getIdCount() { return _ids; }
+    uint32_t getFrames() { return _frames; }
+    uint32_t getUntrackedFrames() { return _untrackedFrames; }
+};
+
+#endif
@@ -2,32 +2,51 @@
 // www.corbinstreehouse.com
 // Nov 16, 2012
 
-#if ARDUINO>=100
-    #include <Arduino.h> // Arduino 1.0
-#else
-    #include <Wprogram.h> // Arduino 0022
+#if defined(ARDUINO)
+    #if ARDUINO>=100
+        #include <Arduino.h> // Arduino 1.0
+    #else
+        #include <Wprogram.h> // Arduino 0022
+    #endif
 #endif
 
 #include "Canbus.h"
 
 #include <stdint.h>
-#include <avr/pgmspace.h>
-
 #include <stdio.h>
-#include <avr/io.h>
-#include <avr/interrupt.h>
-#include <util/delay.h>
-
-//#include "pins_arduino.h"
+#include <string.h>
 #include <inttypes.h>
-//#include "global.h"
-#include "mcp2515.h"
-//#include "defaults.h"
 
-#include <HardwareSerial.h>
+#if defined(ARDUINO)
+    #include <avr/pgmspace.h>
+    #include <avr/io.h>
+    #include <avr/interrupt.h>
+    #include <util/delay.h>
 
-#define DEBUG 0
-#define MOCK_DATA 0
+    //#include "pins_arduino.h"
+    //#include "global.h"
+    //#include "defaults.h"
+
+    #include <HardwareSerial.h>
+#else
+    // Host build (log replay, analysis); there is no Arduino core so the driver has to be set
+    #include <math.h>
+#endif
+
+#include "mcp2515.h"
+#include "elithion_defs.h"
+#if CANBUS_ENABLE_ID_FILTER
+    #include "id_filter.h"
+#endif
+#if CANBUS_ENABLE_LOGGER
+    #include "FrameLogger.h"
+#endif
+#if CANBUS_ENABLE_PROFILER
+    #include "BusProfiler.h"
+#endif
+
+#define DEBUG CANBUS_DEBUG
+#define MOCK_DATA CANBUS_MOCK_DATA
 
 #if MOCK_DATA
     #define TIMEOUT_DURATION 5 // makes testing faster when using mock data
@@ -35,40 +54,224 @@
     #define TIMEOUT_DURATION 20 // Long enough? X milliseconds
 #endif
 
-// http://lithiumate.elithion.com/php/menu_setup.php#Standard_output_messages
-// TODO: this are all configurable and would be nice to set for the class
-#define ELITHION_CAN_ID 0x620
+#if defined(ARDUINO)
+static const CanbusDriver mcp2515Driver = {
+    mcp2515_init,
+    mcp2515_check_message,
+    mcp2515_get_message,
+    mcp2515_send_message,
+    mcp2515_bit_modify,
+    millis,
+    mcp2515_read_register,
+#if CANBUS_ENABLE_ID_FILTER
+    mcp2515_set_id_filter,
+#endif
+};
+#endif
 
+CanbusClass::CanbusClass() {
+    // Initialize defaults
+    _initialized = false;
+    _canSpeed = CanSpeed500;
+    _mode = CanbusModeNormal;
+    _requestId = ELITHION_PID_REQUEST;
+    _responseId = ELITHION_PID_RESPONSE;
+    _borrowedFrames = 0;
+#if CANBUS_ENABLE_PACK_VALUES
+    _numberOfCells = 0;
+#endif
+#if CANBUS_ENABLE_SUBSCRIPTIONS
+    memset(_subscriptions, 0, sizeof(_subscriptions));
+#endif
+#if CANBUS_ENABLE_SCHEDULER
+    memset(_schedule, 0, sizeof(_schedule));
+    _pendingIndex = CANBUS_MAX_SCHEDULED_PIDS;
+    _pendingSince = 0;
+    _requestBudget = 0;
+    _budgetTokens = 0;
+    _lastBudgetUpdate = 0;
+#endif
+#if CANBUS_ENABLE_BUS_MONITOR
+    _busBits = 0;
+    _lastMonitorSample = 0;
+    _busUtilization = 0;
+    _transmitErrors = 0;
+    _receiveErrors = 0;
+    _errorFlags = 0;
+    _adaptivePolling = true;
+    _pollingScale = 8;
+#endif
+#if CANBUS_ENABLE_ERROR_RECOVERY
+    _errorState = CanbusErrorActive;
+    _recoveryCount = 0;
+    _fullResetCount = 0;
+    _lastRecoveryDuration = 0;
+    _recoveryStart = 0;
+    _recovering = false;
+#endif
+#if CANBUS_ENABLE_DISPATCH
+    _dispatch = NULL;
+    _unroutedFrames = 0;
+#endif
+#if CANBUS_ENABLE_ID_FILTER
+    _idFilter = NULL;
+#endif
+#if CANBUS_ENABLE_LOGGER
+    _logger = NULL;
+#endif
+#if CANBUS_ENABLE_PROFILER
+    _profiler = NULL;
+#endif
+#if CANBUS_ENABLE_LOW_POWER
+    _awakeDuration = 0;
+    _sleepDuration = 0;
+    _awakeSince = 0;
+#endif
+#if defined(ARDUINO)
+    _driver = &mcp2515Driver;
+#else
+    _driver = NULL;
+#endif
+}
+
+bool CanbusClass::init(CanSpeed canSpeed) {
+    _canSpeed = canSpeed;
+#if CANBUS_ENABLE_ERROR_RECOVERY
+    _errorState = CanbusErrorActive;
+    _recovering = false;
+#endif
+    _initialized = _driver != NULL && _driver->init(canSpeed);
+    if (_initialized && _mode != CanbusModeNormal) {
+        applyMode(); // init always leaves it in normal mode
+    }
+    return _initialized;
+}
 
-#define ELITHION_PID_REQUEST 0x0745
-#define ELITHION_PID_RESPONSE ELITHION_PID_REQUEST + 0x08 // 0x074D // The response ID is 08h more than the request ID
-//Data length is 8 data bytes regardless of whether sme or all bytes are actually used (unused bytes are set at 0)
-// PIDs: http://lithiumate.elithion.com/xls/Lithiumate_PIDs.xls
-// EEPROM data that can be controlled: http://lithiumate.elithion.com/xls/eeprom_data.xls
+#define MODE_MASK ((1<<REQOP2)|(1<<REQOP1)|(1<<REQOP0))
+#define CONFIG_MODE (1<<REQOP2)
+
+// Asks for mode and waits (briefly) for the MCP2515 to get there
+bool CanbusClass::requestMode(uint8_t mode) {
+    _driver->bitModify(CANCTRL, MODE_MASK, mode);
+    if (_driver->readRegister == NULL) {
+        return true;
+    }
+    for (uint8_t i = 0; i < 10; i++) {
+        if ((_driver->readRegister(CANSTAT) & MODE_MASK) == mode) {
+            return true;
+        }
+    }
+    return false;
+}
 
-// TODOO: maybe make these tables in memory instead of commands to save space? 
-// Pack messages
-#define ELITHION_PID_MODE_DEFAULT 0x10
+bool CanbusClass::applyMode() {
+    return requestMode(_mode);
+}
 
-#define ELITHION_PID_PACK_SOC 0x50
-#define ELITHION_PID_PACK_CAPACITY 0x51
-#define ELITHION_PID_PACK_DOD 0x52
-#define ELITHION_PID_PACK_POWER 0x53
-#define ELITHION_PID_PACK_ENERGY_IN 0x54
-#define ELITHION_PID_PACK_ENERGY_OUT 0x55
-#define ELITHION_PID_PACK_SOH 0x56
+// Written even when it is the same mode, so calling it again after a failed switch retries it
+bool CanbusClass::setMode(CanbusMode mode) {
+    _mode = mode;
+    return _driver == NULL || !_initialized || applyMode();
+}
 
-#define ELITHION_PID_FAULT 0x62
+void CanbusClass::setBmsIds(uint16_t requestId, uint16_t responseId) {
+    _requestId = requestId;
+    _responseId = responseId;
+    // What was learned from the old IDs may be another BMS's
+#if CANBUS_ENABLE_PACK_VALUES
+    _numberOfCells = 0;
+#endif
+#if CANBUS_ENABLE_SCHEDULER
+    _pendingIndex = CANBUS_MAX_SCHEDULED_PIDS; // its reply would come on the old ID
+    for (uint8_t i = 0; i < CANBUS_MAX_SCHEDULED_PIDS; i++) {
+        _schedule[i].valid = false;
+        _schedule[i].nextDue = _driver ? _driver->millis() : 0;
+    }
+#endif
+#if CANBUS_ENABLE_ID_FILTER
+    if (_idFilter) {
+        setIdFilter(_idFilter);
+    }
+#endif
+}
 
-#define ELITHION_PID_RESPONSE_MODE_DEFAULT 0x50
+#if CANBUS_ENABLE_ID_FILTER
+bool CanbusClass::setIdFilter(uint8_t *bitmap) {
+    _idFilter = bitmap;
+    if (bitmap) {
+        id_filter_add(bitmap, _responseId, _responseId);
+    }
+    if (_driver == NULL || _driver->setIdFilter == NULL) {
+        return true; // receiveMessage() checks it instead
+    }
+    return _initialized && _driver->setIdFilter(bitmap);
+}
+#endif
 
-CanbusClass::CanbusClass() {
-    // Initialize defaults
+// Listen only at canSpeed until a frame comes in (true), or a receive error or the window ends.
+// The bit timing can only be changed in config mode, and of CNF1..3 only CNF1 (the prescaler)
+// differs between the speeds, so that is all that gets rewritten.
+bool CanbusClass::listenForSpeed(CanSpeed canSpeed, uint16_t windowMs) {
+    if (!requestMode(CONFIG_MODE)) {
+        return false;
+    }
+    _driver->bitModify(CNF1, 0xFF, canSpeed);
+    _driver->bitModify(CANINTF, (1<<ERRIF)|(1<<MERRF), 0); // left over from the last speed
+    _driver->bitModify(CANCTRL, MODE_MASK, CanbusModeListenOnly);
+    tCAN *message = borrowFrame();
+    if (message == NULL) {
+        return false;
+    }
+    bool heard = false;
+    bool failed = false;
+    unsigned long start = _driver->millis();
+    while (!heard && !failed && (_driver->millis() - start) < windowMs) {
+        if (_driver->checkMessage()) {
+            if (_driver->getMessage(message)) {
+                heard = true;
+            } else if (_driver->readRegister) {
+                // INT went low for something else; at the wrong speed that is a message error
+                failed = (_driver->readRegister(CANINTF) & (1<<MERRF)) != 0;
+                _driver->bitModify(CANINTF, (1<<ERRIF)|(1<<MERRF), 0);
+            }
+        }
+    }
+    releaseFrame();
+    return heard;
 }
 
-bool CanbusClass::init(CanSpeed canSpeed) {
-    _initialized =  mcp2515_init(canSpeed);
-    return _initialized;
+bool CanbusClass::initAutoBaud(uint16_t windowMs) {
+    static const CanSpeed speeds[] = { CanSpeed500, CanSpeed250, CanSpeed125 };
+    _initialized = false;
+    if (_driver == NULL || !_driver->init(_canSpeed)) {
+        return false;
+    }
+    // One reset for the whole search. A wrong speed shows up as a message error, so that
+    // interrupt is needed whether or not error recovery is built in.
+    _driver->bitModify(CANINTE, (1<<MERRE), (1<<MERRE));
+    // The last speed used first; it is usually still right
+    bool found = listenForSpeed(_canSpeed, windowMs);
+    for (uint8_t i = 0; !found && i < sizeof(speeds) / sizeof(speeds[0]); i++) {
+        if (speeds[i] != _canSpeed && listenForSpeed(speeds[i], windowMs)) {
+            _canSpeed = speeds[i];
+            found = true;
+        }
+    }
+    if (found) {
+#if CANBUS_ENABLE_ERROR_RECOVERY
+        _errorState = CanbusErrorActive;
+#endif
+        // The frames heard while listening were only for finding the speed
+        _driver->bitModify(CANINTF, (1<<RX0IF)|(1<<RX1IF)|(1<<ERRIF)|(1<<MERRF), 0);
+#if !CANBUS_ENABLE_ERROR_RECOVERY
+        _driver->bitModify(CANINTE, (1<<MERRE), 0); // as init() left it; nothing else clears MERRF
+#endif
+        applyMode();
+        _initialized = true;
+    } else {
+        init(_canSpeed);
+    }
+    return found;
 }
 
 // Standard offsets for elithion
@@ -77,18 +280,24 @@ bool CanbusClass::init(CanSpeed canSpeed) {
 #define PID_HI_OFFSET 2
 #define PID_LO_OFFSET 3
 
-static bool sendAndReceiveMessage(tCAN *message, uint16_t pid_reply, uint8_t response_mode, uint8_t response_pid_hi, uint8_t response_pid_low) {
-	mcp2515_bit_modify(CANCTRL, (1<<REQOP2)|(1<<REQOP1)|(1<<REQOP0), 0);
-	if (mcp2515_send_message(message)) {
-        long startTime = millis();
-        bool timeout = false;
-        while (!timeout) {
-            if (mcp2515_check_message()) {
-                if (mcp2515_get_message(message)) {
+// Waits for the reply until the deadline (a _driver->millis() time)
+bool CanbusClass::sendAndReceiveMessage(tCAN *message, uint16_t pid_reply, uint8_t response_mode, uint8_t response_pid_hi, uint8_t response_pid_low, unsigned long deadline) {
+    if (_driver == NULL) {
+        return false;
+    }
+	if (transmitMessage(message)) {
+#if CANBUS_ENABLE_SCHEDULER
+        chargeRequest(_driver->millis());
+#endif
+        while ((long)(_driver->millis() - deadline) < 0) {
+            if (_driver->checkMessage()) {
+                if (receiveMessage(message)) {
                     // See if we got the right response; making sure we got enough bytes (at least 3 to read the high and low
                     if ((message->id == pid_reply) && (message->data[NUM_BYTES_OFFSET] >= 3) && (message->data[MODE_OFFSET] == response_mode) && (message->data[PID_HI_OFFSET] == response_pid_hi) && (message->data[PID_LO_OFFSET] == response_pid_low)) {
                         return true;
                     } else {
+                        // Maybe the reply to something poll() asked for
+                        processReceivedMessage(message);
 //#if DEBUG
 //                        Serial.print("reply id: 0x");
 //                        Serial.print(message->id, HEX);
@@ -118,22 +327,13 @@ static bool sendAndReceiveMessage(tCAN *message, uint16_t pid_reply, uint8_t res
 //#endif
                     }
                 } else {
+                    // INT is also pulled low for errors
+                    handleControllerErrors();
 #if DEBUG
                     Serial.println("couldn't get the message even though one was available");
 #endif
                 }
             }
-            
-            // See if we hit the timeout duration
-            long endTime = millis();
-            if (endTime < startTime) {
-                // roll over
-                timeout = true;
-            } else {
-                if ((endTime - startTime) > TIMEOUT_DURATION) {
-                    timeout = true;
-                }
-            }
         }
     } else {
 #if DEBUG
@@ -143,8 +343,8 @@ static bool sendAndReceiveMessage(tCAN *message, uint16_t pid_reply, uint8_t res
  	return false;
 }
 
-static void setupElithionCanMessage(tCAN *message, uint8_t mode, uint8_t pid_hi, uint8_t pid_low) {
-	message->id = ELITHION_PID_REQUEST;
+static void setupElithionCanMessage(tCAN *message, uint16_t requestId, uint8_t mode, uint8_t pid_hi, uint8_t pid_low) {
+	message->id = requestId;
 	message->header.rtr = 0; // not sure what this is for yet
 	message->header.length = 8; // 8 bytes in the data
 	message->data[NUM_BYTES_OFFSET] = 3; // additional bytes to follow (hardcoded for 3 -- everything except the settings use this)
@@ -158,46 +358,592 @@ static void setupElithionCanMessage(tCAN *message, uint8_t mode, uint8_t pid_hi,
 	message->data[7] = 0x00;
 }
 
-static bool readElithionDefaultMessageFromCanBus(tCAN *message, uint8_t pid_hi, uint8_t pid_low) {
+// Frames are received straight into these and matched and decoded where they sit, instead of
+// being copied around on the stack. They are borrowed and returned in LIFO order, which is how
+// the calls nest: a subscription callback can call a getter while its reply is still borrowed.
+tCAN *CanbusClass::borrowFrame() {
+    return _borrowedFrames < CANBUS_FRAME_SLOTS ? &_frames[_borrowedFrames++] : NULL;
+}
+
+void CanbusClass::releaseFrame() {
+    _borrowedFrames--;
+}
+
+// Reply bytes 4-7 for the PID, wherever they already are (a borrowed frame, or the schedule when
+// poll() got them recently). Call releaseFrame() once they are decoded; on NULL (the BMS didn't
+// answer) there is nothing to release.
+const uint8_t *CanbusClass::requestElithionValue(uint8_t pid_hi, uint8_t pid_low, unsigned long *received) {
+    tCAN *message = borrowFrame();
+    if (message == NULL) {
+        return NULL; // callbacks nested deeper than CANBUS_FRAME_SLOTS
+    }
+#if CANBUS_ENABLE_SCHEDULER
+    if (pid_low == 0) {
+        // Use what poll() got if it is still fresh
+        ScheduledPid *scheduled = findScheduledPid(pid_hi);
+        if (scheduled && scheduled->valid && (_mode == CanbusModeListenOnly || (_driver->millis() - scheduled->lastReply) <= effectivePeriod(scheduled))) {
+            if (received) {
+                *received = scheduled->lastReply;
+            }
+            return scheduled->data; // the frame goes unused, but keeps releaseFrame() the same
+        }
+    }
+#endif
+    if (_mode == CanbusModeListenOnly) {
+        releaseFrame();
+        return NULL; // can't ask
+    }
     // most messages have a standard mode and standard response so make this commonized
-    setupElithionCanMessage(message, ELITHION_PID_MODE_DEFAULT, pid_hi, pid_low);
-    return sendAndReceiveMessage(message, ELITHION_PID_RESPONSE, ELITHION_PID_RESPONSE_MODE_DEFAULT, pid_hi, pid_low);
+    setupElithionCanMessage(message, _requestId, ELITHION_PID_MODE_DEFAULT, pid_hi, pid_low);
+    if (sendAndReceiveMessage(message, _responseId, ELITHION_PID_RESPONSE_MODE_DEFAULT, pid_hi, pid_low, _driver->millis() + TIMEOUT_DURATION)) {
+        if (received) {
+            *received = _driver->millis();
+        }
+        handleReply(message);
+        return &message->data[4];
+    }
+    releaseFrame();
+    // No answer; make sure that isn't because we fell off the bus
+    handleControllerErrors();
+    return NULL;
+}
+
+uint8_t CanbusClass::read(CanbusRead *reads, uint8_t count, unsigned long deadline) {
+    uint8_t freshCount = 0;
+    bool outOfTime = !_initialized;
+    for (uint8_t i = 0; i < count; i++) {
+        CanbusRead *read = &reads[i];
+        bool fresh = false;
+#if CANBUS_ENABLE_SCHEDULER
+        ScheduledPid *scheduled = findScheduledPid(read->pid);
+        if (scheduled && scheduled->valid) {
+            // poll()'s copy counts as fresh while it is younger than its period
+            fresh = (_driver->millis() - scheduled->lastReply) <= effectivePeriod(scheduled);
+            if (fresh || read->status == CanbusReadMissing || (long)(scheduled->lastReply - read->updated) > 0) {
+                memcpy(read->data, scheduled->data, sizeof(read->data));
+                read->updated = scheduled->lastReply;
+                read->status = CanbusReadStale;
+            }
+        }
+#endif
+        if (!fresh && !outOfTime && _mode != CanbusModeListenOnly) {
+            unsigned long now = _driver->millis();
+            if ((long)(deadline - now) < CANBUS_MIN_READ_TIME) {
+                // Not enough left for an answer; the rest keep their last known values
+                outOfTime = true;
+            } else if (tCAN *message = borrowFrame()) {
+                unsigned long replyDeadline = now + TIMEOUT_DURATION;
+                if ((long)(deadline - replyDeadline) < 0) {
+                    replyDeadline = deadline;
+                }
+                setupElithionCanMessage(message, _requestId, ELITHION_PID_MODE_DEFAULT, read->pid, 0);
+                if (sendAndReceiveMessage(message, _responseId, ELITHION_PID_RESPONSE_MODE_DEFAULT, read->pid, 0, replyDeadline)) {
+                    handleReply(message);
+                    memcpy(read->data, &message->data[4], sizeof(read->data));
+                    read->updated = _driver->millis();
+                    fresh = true;
+                }
+                releaseFrame();
+            }
+        }
+        if (fresh) {
+            read->status = CanbusReadFresh;
+            freshCount++;
+        } else if (read->status == CanbusReadFresh) {
+            read->status = CanbusReadStale;
+        }
+    }
+    if (freshCount < count && _initialized) {
+        handleControllerErrors(); // only a few register reads; a recovery finishes in later polls
+    }
+    return freshCount;
+}
+
+#if CANBUS_ENABLE_SUBSCRIPTIONS
+// Where each CanbusEvent lives in a reply, in CanbusEvent order
+static const uint8_t eventPids[] = { ELITHION_PID_FAULT, ELITHION_PID_FAULT, 0x66, ELITHION_PID_PACK_SOC, 0x64, 0x65 };
+static const uint8_t eventOffsets[] = { 4, 6, 4, 4, 5, 5 };
+
+bool CanbusClass::subscribe(CanbusEvent event, uint8_t parameter, CanbusEventCallback callback) {
+    for (uint8_t i = 0; i < CANBUS_MAX_SUBSCRIPTIONS; i++) {
+        Subscription *subscription = &_subscriptions[i];
+        if (subscription->callback == NULL) {
+            subscription->event = event;
+            subscription->parameter = parameter;
+            subscription->lastValue = 0;
+            subscription->seeded = event != CanbusEventStateOfCharge;
+            subscription->callback = callback;
+            return true;
+        }
+    }
+    return false;
+}
+
+void CanbusClass::unsubscribe(CanbusEventCallback callback) {
+    for (uint8_t i = 0; i < CANBUS_MAX_SUBSCRIPTIONS; i++) {
+        if (_subscriptions[i].callback == callback) {
+            _subscriptions[i].callback = NULL;
+        }
+    }
+}
+#endif
+
+void CanbusClass::handleReply(const tCAN *message) {
+    if (message->data[PID_LO_OFFSET] != 0) {
+        return; // only cell readings use the low byte
+    }
+#if CANBUS_ENABLE_SCHEDULER
+    ScheduledPid *scheduled = findScheduledPid(message->data[PID_HI_OFFSET]);
+    if (scheduled) {
+        memcpy(scheduled->data, &message->data[4], sizeof(scheduled->data));
+        scheduled->valid = true;
+        scheduled->lastReply = _driver->millis();
+    }
+#endif
+#if CANBUS_ENABLE_SUBSCRIPTIONS
+    for (uint8_t i = 0; i < CANBUS_MAX_SUBSCRIPTIONS; i++) {
+        Subscription *subscription = &_subscriptions[i];
+        if (subscription->callback == NULL || eventPids[subscription->event] != message->data[PID_HI_OFFSET]) {
+            continue;
+        }
+        uint8_t value = message->data[eventOffsets[subscription->event]];
+        uint8_t oldValue = subscription->lastValue;
+        bool changed;
+        switch (subscription->event) {
+            case CanbusEventStateOfCharge:
+                changed = subscription->seeded && ((oldValue < subscription->parameter) != (value < subscription->parameter));
+                break;
+            case CanbusEventChargeLimitCause:
+            case CanbusEventDischargeLimitCause:
+                changed = oldValue != value;
+                break;
+            default:
+                changed = (oldValue ^ value) & subscription->parameter;
+                break;
+        }
+        subscription->lastValue = value;
+        subscription->seeded = true;
+        if (changed) {
+            subscription->callback((CanbusEvent)subscription->event, oldValue, value);
+        }
+    }
+#endif
+}
+
+#if CANBUS_ENABLE_SCHEDULER
+CanbusClass::ScheduledPid *CanbusClass::findScheduledPid(uint8_t pid) {
+    for (uint8_t i = 0; i < CANBUS_MAX_SCHEDULED_PIDS; i++) {
+        if (_schedule[i].pid == pid) {
+            return &_schedule[i];
+        }
+    }
+    return NULL;
+}
+
+bool CanbusClass::schedule(uint8_t pid, uint16_t periodMs, uint8_t priority) {
+    if (pid == 0) {
+        return false;
+    }
+    ScheduledPid *scheduled = findScheduledPid(pid);
+    if (scheduled == NULL) {
+        scheduled = findScheduledPid(0);
+        if (scheduled == NULL) {
+            return false;
+        }
+        memset(scheduled, 0, sizeof(ScheduledPid));
+        scheduled->nextDue = _driver ? _driver->millis() : 0;
+    }
+    scheduled->pid = pid;
+    scheduled->period = periodMs;
+    scheduled->priority = priority;
+    return true;
+}
+
+void CanbusClass::unschedule(uint8_t pid) {
+    ScheduledPid *scheduled = findScheduledPid(pid);
+    if (scheduled) {
+        if (_pendingIndex == scheduled - _schedule) {
+            _pendingIndex = CANBUS_MAX_SCHEDULED_PIDS;
+        }
+        scheduled->pid = 0;
+    }
+}
+
+uint16_t CanbusClass::getDeadlineMisses(uint8_t pid) {
+    ScheduledPid *scheduled = findScheduledPid(pid);
+    return scheduled ? scheduled->deadlineMisses : 0;
+}
+#endif
+
+// All frames in and out go through these two so the bus load can be estimated
+bool CanbusClass::receiveMessage(tCAN *message) {
+    while (_driver->getMessage(message)) {
+#if CANBUS_ENABLE_ID_FILTER
+        if (_idFilter && !id_filter_has(_idFilter, message->id)) {
+            continue; // a driver without a filter of its own; the MCP2515 never hands these over
+        }
+#endif
+#if CANBUS_ENABLE_BUS_MONITOR
+        countBusBits(message);
+#endif
+#if CANBUS_ENABLE_LOGGER
+        if (_logger) {
+            _logger->logFrame(_driver->millis(), message, false);
+        }
+#endif
+#if CANBUS_ENABLE_PROFILER
+        if (_profiler) {
+            _profiler->record(_driver->millis(), message);
+        }
+#endif
+        return true;
+    }
+    return false;
+}
+
+bool CanbusClass::transmitMessage(tCAN *message) {
+    if (_mode == CanbusModeListenOnly) {
+        return false; // it would sit in a TX buffer forever
+    }
+    if (_driver->sendMessage(message)) {
+#if CANBUS_ENABLE_BUS_MONITOR
+        countBusBits(message);
+#endif
+#if CANBUS_ENABLE_LOGGER
+        if (_logger) {
+            _logger->logFrame(_driver->millis(), message, true);
+        }
+#endif
+        return true;
+    }
+    return false;
+}
+
+#if CANBUS_ENABLE_BUS_MONITOR
+// A standard frame is 47 bits of overhead (including the interframe space) plus the data, plus
+// stuff bits; about one per five bits in the stuffed region is a fair average.
+void CanbusClass::countBusBits(const tCAN *message) {
+    uint8_t dataBits = message->header.rtr ? 0 : (message->header.length & 0x0f) * 8;
+    _busBits += 47 + dataBits + (34 + dataBits) / 5;
+}
+
+#define BUSY_UTILIZATION 50 // percent
+#define QUIET_UTILIZATION 30
+#define ERROR_WARNING_LEVEL 96 // the MCP2515 sets EWARN here
+#define QUIET_ERROR_LEVEL 32
+#define STALE_MONITOR_SAMPLE 60000UL // ms
+
+void CanbusClass::updateBusMonitor(unsigned long now) {
+    unsigned long elapsed = now - _lastMonitorSample;
+    if (elapsed < CANBUS_MONITOR_INTERVAL) {
+        return;
+    }
+    if (elapsed > STALE_MONITOR_SAMPLE) {
+        // Nobody polled for a long time (ie: sleep()), so the bits counted don't cover it; start a
+        // new sample. This also keeps elapsed * 1000 inside 32 bits.
+        _busBits = 0;
+        _lastMonitorSample = now;
+        return;
+    }
+    // CanSpeed is the baud rate prescaler; 1 is 500kbps, so bits per ms is 1000 / (speed + 1)
+    uint32_t capacity = elapsed * 1000 / (_canSpeed + 1);
+    uint32_t utilization = capacity ? _busBits * 100 / capacity : 100;
+    if (utilization > 100) {
+        utilization = 100;
+    }
+    _busUtilization = (_busUtilization * 3 + utilization + 2) / 4;
+    _busBits = 0;
+    _lastMonitorSample = now;
+    
+    if (_driver->readRegister) {
+        _transmitErrors = _driver->readRegister(TEC);
+        _receiveErrors = _driver->readRegister(REC);
+        _errorFlags = _driver->readRegister(EFLG);
+#if CANBUS_ENABLE_ERROR_RECOVERY
+        updateErrorState(_errorFlags);
+#endif
+    }
+    
+    if (!_adaptivePolling) {
+        return;
+    }
+    uint8_t errors = _transmitErrors > _receiveErrors ? _transmitErrors : _receiveErrors;
+    if (_busUtilization >= BUSY_UTILIZATION || errors >= ERROR_WARNING_LEVEL) {
+        // back off quickly
+        _pollingScale = _pollingScale > 2 ? _pollingScale / 2 : 1;
+    } else if (_busUtilization < QUIET_UTILIZATION && errors < QUIET_ERROR_LEVEL && _pollingScale < 8) {
+        // and come back slowly
+        _pollingScale++;
+    }
+}
+
+void CanbusClass::setAdaptivePolling(bool enabled) {
+    _adaptivePolling = enabled;
+    if (!enabled) {
+        _pollingScale = 8;
+    }
+}
+#endif
+
+#if CANBUS_ENABLE_ERROR_RECOVERY
+void CanbusClass::updateErrorState(uint8_t errorFlags) {
+    if (errorFlags & (1<<TXB0)) { // TXBO; the bus-off bit
+        _errorState = CanbusErrorBusOff;
+    } else if (errorFlags & ((1<<TXEP)|(1<<RXEP))) {
+        _errorState = CanbusErrorPassive;
+    } else if (errorFlags & (1<<EWARN)) {
+        _errorState = CanbusErrorWarning;
+    } else {
+        _errorState = CanbusErrorActive;
+    }
+}
+
+void CanbusClass::handleControllerErrors() {
+    if (_driver->readRegister == NULL) {
+        return;
+    }
+    if (_recovering) {
+        continueRecovery();
+        return;
+    }
+    uint8_t interrupts = _driver->readRegister(CANINTF);
+    if ((interrupts & ((1<<ERRIF)|(1<<MERRF))) == 0) {
+        return;
+    }
+    uint8_t errorFlags = _driver->readRegister(EFLG);
+    updateErrorState(errorFlags);
+    if (_errorState == CanbusErrorBusOff || (errorFlags & ((1<<RX0OVR)|(1<<RX1OVR)))) {
+        recover(errorFlags);
+    } else {
+        // Just a warning or error passive; it still works, so only acknowledge it
+        _driver->bitModify(CANINTF, (1<<ERRIF)|(1<<MERRF), 0);
+    }
+}
+
+// Gets back on the bus without the ~10 register writes (and lost configuration) of a full
+// init() when possible. The MCP2515 leaves bus-off on its own after 128 x 11 recessive bits
+// (under 3ms at 500kbps), so mostly this is about not leaving it stuck behind stale flags and
+// transmissions. Rather than wait for that here, the following poll() calls check on it.
+void CanbusClass::recover(uint8_t errorFlags) {
+    _recoveryStart = _driver->millis();
+    _recoveryCount++;
+    _recovering = true;
+    
+    _driver->bitModify(EFLG, (1<<RX1OVR)|(1<<RX0OVR), 0);
+    if (errorFlags & ((1<<TXB0)|(1<<TXEP))) {
+        // Only then can requests be stuck retrying, and they will be stale by the time they get out
+        _driver->bitModify(CANCTRL, (1<<ABAT), (1<<ABAT));
+    }
+    _driver->bitModify(CANCTRL, (1<<ABAT)|MODE_MASK, _mode);
+    _driver->bitModify(CANINTF, (1<<ERRIF)|(1<<MERRF), 0);
+    continueRecovery(); // a receive overflow is over right away
+}
+
+void CanbusClass::continueRecovery() {
+    unsigned long now = _driver->millis();
+    bool inMode = (_driver->readRegister(CANSTAT) & MODE_MASK) == _mode; // OPMOD is where REQOP is
+    if (!inMode || (_driver->readRegister(EFLG) & (1<<TXB0))) {
+        if (now - _recoveryStart <= CANBUS_RECOVERY_TIMEOUT) {
+            return; // not back yet; look again next poll()
+        }
+        _fullResetCount++;
+        init(_canSpeed); // and the mode, which the MCP2515 reset put back to normal
+    }
+    _recovering = false;
+    updateErrorState(_driver->readRegister(EFLG));
+    _lastRecoveryDuration = now - _recoveryStart;
+}
+#endif
+
+// Anything that came in that wasn't what a blocking request was waiting for
+void CanbusClass::processReceivedMessage(const tCAN *message) {
+    if (message->id != _responseId) {
+#if CANBUS_ENABLE_DISPATCH
+        if (_dispatch == NULL || !_dispatch(message)) {
+            _unroutedFrames++;
+        }
+#endif
+        return;
+    }
+    if (message->data[NUM_BYTES_OFFSET] < 3 || message->data[MODE_OFFSET] != ELITHION_PID_RESPONSE_MODE_DEFAULT) {
+        return;
+    }
+#if CANBUS_ENABLE_SCHEDULER
+    if (_pendingIndex < CANBUS_MAX_SCHEDULED_PIDS && _schedule[_pendingIndex].pid == message->data[PID_HI_OFFSET] && message->data[PID_LO_OFFSET] == 0) {
+        _pendingIndex = CANBUS_MAX_SCHEDULED_PIDS;
+    }
+#endif
+    handleReply(message);
+}
+
+void CanbusClass::poll() {
+    if (!_initialized) {
+        return;
+    }
+    tCAN *message = borrowFrame();
+    if (message == NULL) {
+        return; // called from a callback nested too deep; the outer calls will get to it
+    }
+    while (_driver->checkMessage()) {
+        if (!receiveMessage(message)) {
+            handleControllerErrors(); // INT is also pulled low for errors
+            break;
+        }
+        processReceivedMessage(message);
+    }
+    releaseFrame();
+#if CANBUS_ENABLE_ERROR_RECOVERY
+    if (_recovering) {
+        continueRecovery();
+    }
+#endif
+    
+#if CANBUS_ENABLE_BUS_MONITOR || CANBUS_ENABLE_SCHEDULER
+    unsigned long now = _driver->millis();
+#endif
+#if CANBUS_ENABLE_BUS_MONITOR
+    updateBusMonitor(now);
+#endif
+#if CANBUS_ENABLE_SCHEDULER
+    pollSchedule(now);
+#endif
 }
 
-static int readElithionTwoByteValue(uint8_t pid_hi) {
-	tCAN message;
-    if (readElithionDefaultMessageFromCanBus(&message, pid_hi, 0)) {
-        uint8_t msb = message.data[4];
-        uint8_t lsb = message.data[5];
-        int result = ((msb << 8) | lsb);
+#if CANBUS_ENABLE_SCHEDULER
+uint16_t CanbusClass::effectivePeriod(const ScheduledPid *scheduled) {
+#if CANBUS_ENABLE_BUS_MONITOR
+    uint32_t period = (uint32_t)scheduled->period * 8 / _pollingScale;
+    return period > 0xFFFF ? 0xFFFF : period;
+#else
+    return scheduled->period;
+#endif
+}
+
+// Token bucket; holds at most one second worth of requests
+// Tops the bucket up for the time since the last call
+void CanbusClass::refillBudget(unsigned long now) {
+    unsigned long elapsed = now - _lastBudgetUpdate;
+    _lastBudgetUpdate = now;
+    if (elapsed > 1000) {
+        elapsed = 1000; // fills the bucket anyway, and the product can't overflow
+    }
+    int32_t tokens = _budgetTokens + (int32_t)elapsed * _requestBudget;
+    int32_t maximum = _requestBudget < 65 ? (int32_t)_requestBudget * 1000 : 65000;
+    _budgetTokens = tokens > maximum ? maximum : tokens;
+}
+
+bool CanbusClass::hasBudgetForRequest(unsigned long now) {
+    if (_requestBudget == 0) {
+        return true;
+    }
+    refillBudget(now);
+    if (_budgetTokens >= 1000) {
+        _budgetTokens -= 1000;
+        return true;
+    }
+    return false;
+}
+
+// The getters' requests aren't held back, but they use up what the schedule would have sent;
+// past an empty bucket it is owed (up to 65 requests)
+void CanbusClass::chargeRequest(unsigned long now) {
+    if (_requestBudget == 0) {
+        return;
+    }
+    refillBudget(now);
+    _budgetTokens = _budgetTokens > -65000 ? _budgetTokens - 1000 : -65000;
+}
+
+void CanbusClass::pollSchedule(unsigned long now) {
+    if (_pendingIndex < CANBUS_MAX_SCHEDULED_PIDS) {
+        if ((now - _pendingSince) <= TIMEOUT_DURATION) {
+            return; // one request at a time, so replies can't be confused
+        }
+        _schedule[_pendingIndex].deadlineMisses++;
+        _pendingIndex = CANBUS_MAX_SCHEDULED_PIDS;
+    }
+    
+    if (_mode == CanbusModeListenOnly) {
+        return; // the values come from other nodes' requests; see setMode()
+    }
+    
+    // Most important due PID, oldest due time first
+    uint8_t next = CANBUS_MAX_SCHEDULED_PIDS;
+    for (uint8_t i = 0; i < CANBUS_MAX_SCHEDULED_PIDS; i++) {
+        ScheduledPid *scheduled = &_schedule[i];
+        if (scheduled->pid == 0 || (long)(now - scheduled->nextDue) < 0) {
+            continue;
+        }
+        if (next == CANBUS_MAX_SCHEDULED_PIDS || scheduled->priority < _schedule[next].priority ||
+            (scheduled->priority == _schedule[next].priority && (long)(scheduled->nextDue - _schedule[next].nextDue) < 0)) {
+            next = i;
+        }
+    }
+    if (next == CANBUS_MAX_SCHEDULED_PIDS || !hasBudgetForRequest(now)) {
+        return;
+    }
+    
+    ScheduledPid *scheduled = &_schedule[next];
+    tCAN *message = borrowFrame();
+    if (message == NULL) {
+        return;
+    }
+    setupElithionCanMessage(message, _requestId, ELITHION_PID_MODE_DEFAULT, scheduled->pid, 0);
+    // Only a request that went out moves the PID along; one that didn't stays due for the next
+    // poll(), and counts as a miss once it is a period late
+    if (transmitMessage(message)) {
+        uint16_t period = effectivePeriod(scheduled);
+        if ((now - scheduled->nextDue) > period) {
+            // A whole period late; don't try to catch up with a burst
+            scheduled->deadlineMisses++;
+            scheduled->nextDue = now + period;
+        } else {
+            scheduled->nextDue += period;
+        }
+        _pendingIndex = next;
+        _pendingSince = now;
+    }
+    releaseFrame();
+}
+#endif
+
+int CanbusClass::readElithionTwoByteValue(uint8_t pid_hi) {
+    const uint8_t *value = requestElithionValue(pid_hi, 0);
+    if (value) {
+        int16_t result = ((value[0] << 8) | value[1]); // 16 bits even where int is wider, so currents keep their sign
+        releaseFrame();
         return result;
     } else {
         return 0;
     }
 }
 
-static uint8_t readElithionSingleByteValue(uint8_t pid_hi) {
-	tCAN message;
-    if (readElithionDefaultMessageFromCanBus(&message, pid_hi, 0)) {
-        return message.data[4];
+// index 0 is reply byte 4
+uint8_t CanbusClass::readElithionSingleByteValue(uint8_t pid_hi, uint8_t index) {
+    const uint8_t *value = requestElithionValue(pid_hi, 0);
+    if (value) {
+        uint8_t result = value[index];
+        releaseFrame();
+        return result;
     } else {
         return 0;
     }
 }
 
+#if CANBUS_ENABLE_PACK_VALUES
 int CanbusClass::getNumberOfCells() {
 #if MOCK_DATA
     return 48;
 #else
-    tCAN message;
-    if (readElithionDefaultMessageFromCanBus(&message, 0x40, 0)) {
-        return message.data[5]; // second parameter is the number of cells (
-    } else {
-        return 0;
+    if (_numberOfCells == 0) {
+        // It only changes if the BMS is reconfigured, so it is asked for once
+        _numberOfCells = readElithionSingleByteValue(ELITHION_PID_CELL_COUNT, 1); // second parameter is the number of cells (
     }
+    return _numberOfCells;
 #endif
 }
 
+#if CANBUS_ENABLE_FLOAT
 // Is this smaller than a function call?
 //#define CONVERT_ENCODED_MVOLT_TO_VOLT(v) (2.0 + (v)*10.0/1000.0) // in 10mv increments, plus 2.0v
 // Function call is slightly smaller than the #define
@@ -206,18 +952,66 @@ static float CONVERT_ENCODED_MVOLT_TO_VOLT(float v) {
 }
 
 float CanbusClass::getVoltageForCell(int cell) {
+    uint8_t encodedVoltage;
+    if (getEncodedVoltageForCell(cell, &encodedVoltage)) {
+        return CONVERT_ENCODED_MVOLT_TO_VOLT(encodedVoltage);
+    } else {
+        return 2.0; // something better??
+    }
+}
+#endif
+
+bool CanbusClass::getEncodedVoltageForCell(int cell, uint8_t *encodedVoltage) {
 #if MOCK_DATA
-    return CONVERT_ENCODED_MVOLT_TO_VOLT(60 + cell);
+    *encodedVoltage = 60 + cell;
+    return true;
 #else
- 	tCAN message;
-    if (readElithionDefaultMessageFromCanBus(&message, 0x14, cell)) {
-        return CONVERT_ENCODED_MVOLT_TO_VOLT(message.data[4]);
+    const uint8_t *value = requestElithionValue(0x14, cell);
+    if (value) {
+        *encodedVoltage = value[0];
+        releaseFrame();
+        return true;
     } else {
-        return 2.0; // something better??
+        return false;
     }
 #endif
 }
 
+// The BMS sends min/avg/max cells in 10mV steps above 2.0V
+static uint16_t encodedCellToMillivolts(uint8_t v) {
+    return 2000 + (uint16_t)v * 10;
+}
+
+uint16_t CanbusClass::getPackDecivolts() {
+#if MOCK_DATA
+    return 1320;
+#endif
+    return readElithionTwoByteValue(0x46);
+}
+
+uint16_t CanbusClass::getMinCellMillivolts() {
+#if MOCK_DATA
+    return encodedCellToMillivolts(30);
+#endif
+    return encodedCellToMillivolts(readElithionSingleByteValue(0x43));
+}
+
+uint16_t CanbusClass::getAvgCellMillivolts() {
+#if MOCK_DATA
+    return encodedCellToMillivolts(50);
+#endif
+    return encodedCellToMillivolts(readElithionSingleByteValue(0x44));
+}
+
+uint16_t CanbusClass::getMaxCellMillivolts() {
+#if MOCK_DATA
+    return encodedCellToMillivolts(60);
+#endif
+    return encodedCellToMillivolts(readElithionSingleByteValue(0x45));
+}
+#endif
+
+#if CANBUS_ENABLE_STATE_VALUES
 uint8_t CanbusClass::getStateOfCharge() {
 #if MOCK_DATA
     return 69;
@@ -231,11 +1025,40 @@ uint16_t CanbusClass::getDepthOfDischarge() {
 #endif
     return readElithionTwoByteValue(ELITHION_PID_PACK_DOD);
 }
+#endif
 
+#if CANBUS_ENABLE_FLOAT && (CANBUS_ENABLE_PACK_VALUES || CANBUS_ENABLE_CURRENT_VALUES)
 static float milliValueToNormalValue(int v) {
     return v * 100.0 / 1000.0;
 }
+#endif
+
+#if CANBUS_ENABLE_CURRENT_VALUES
+// Positive is discharging
+int16_t CanbusClass::getPackDeciamps() {
+    return readElithionTwoByteValue(0x68);
+}
+
+int16_t CanbusClass::getAverageSourceDeciamps() {
+#if MOCK_DATA
+    return 300;
+#endif
+    return readElithionTwoByteValue(0x69);
+}
+
+int16_t CanbusClass::getAverageLoadDeciamps() {
+    return readElithionTwoByteValue(0x6A);
+}
+
+int16_t CanbusClass::getSourceDeciamps() {
+    return readElithionTwoByteValue(0x6B);
+}
 
+int16_t CanbusClass::getLoadDeciamps() {
+    return readElithionTwoByteValue(0x6C);
+}
+
+#if CANBUS_ENABLE_FLOAT
 float CanbusClass::getPackCurrent() {
     return milliValueToNormalValue(readElithionTwoByteValue(0x68)); // Units returned is 100mA. Multiply by 100 to get mA. Then divide by 1000 to get amps.
 }
@@ -258,7 +1081,10 @@ float CanbusClass::getSourceCurrent() {
 float CanbusClass::getLoadCurrent() {
     return milliValueToNormalValue(readElithionTwoByteValue(0x6C));
 }
+#endif
+#endif
 
+#if CANBUS_ENABLE_STATE_VALUES
 LimitCause CanbusClass::getChargeLimitCause() {
 #if MOCK_DATA
     static long lastTime = 0;
@@ -277,52 +1103,75 @@ LimitCause CanbusClass::getChargeLimitCause() {
         lastTime = millis();
     }
 #endif
- 	tCAN message;
-    if (readElithionDefaultMessageFromCanBus(&message, 0x64, 0)) {
-        return message.data[5];
-    } else {
-        return 0;
-    }
+    return readElithionSingleByteValue(0x64, 1);
 }
 
 LimitCause CanbusClass::getDischargeLimitCause() {
- 	tCAN message;
-    if (readElithionDefaultMessageFromCanBus(&message, 0x65, 0)) {
-        return message.data[5];
-    } else {
-        return 0;
-    }
+    return readElithionSingleByteValue(0x65, 1);
 }
 
-#define ROUND_255_AS_PERCENTAGE(v) round(100.0*(float)(v)/255.0)
+// round(100*v/255) without pulling in the float library; exact for 0-255
+#define ROUND_255_AS_PERCENTAGE(v) ((200*(uint16_t)(v) + 255) / 510)
 
 int8_t CanbusClass::getChargeLimitValue() {
 #if MOCK_DATA
     return 90;
 #endif
-	tCAN message;
-    if (readElithionDefaultMessageFromCanBus(&message, 0x64, 0)) {
+    const uint8_t *value = requestElithionValue(0x64, 0);
+    if (value) {
 #if 0 // DEBUG
         Serial.print("charg limit:");
-        Serial.println(message.data[4]);
+        Serial.println(value[0]);
         Serial.print("charg limit per:");
-        Serial.println(ROUND_255_AS_PERCENTAGE(message.data[4]));
+        Serial.println(ROUND_255_AS_PERCENTAGE(value[0]));
 #endif
-        return ROUND_255_AS_PERCENTAGE(message.data[4]);
+        int8_t result = ROUND_255_AS_PERCENTAGE(value[0]);
+        releaseFrame();
+        return result;
     } else {
         return ERROR_READING_LIMIT_VALUE;
     }
 }
 
 int8_t CanbusClass::getDischargeLimitValue() {
-	tCAN message;
-    if (readElithionDefaultMessageFromCanBus(&message, 0x65, 0)) {
-        return ROUND_255_AS_PERCENTAGE(message.data[4]);
+    const uint8_t *value = requestElithionValue(0x65, 0);
+    if (value) {
+        int8_t result = ROUND_255_AS_PERCENTAGE(value[0]);
+        releaseFrame();
+        return result;
     } else {
         return ERROR_READING_LIMIT_VALUE;
     }
 }
 
+CanbusLimit CanbusClass::readLimit(uint8_t pid) {
+    CanbusLimit limit;
+    const uint8_t *value = requestElithionValue(pid, 0, &limit.timestamp);
+    if (value) {
+        limit.status = CanbusReadFresh;
+        limit.percent = ROUND_255_AS_PERCENTAGE(value[0]);
+        limit.cause = value[1];
+        releaseFrame();
+    } else {
+        limit.status = CanbusReadMissing;
+        limit.timestamp = 0;
+        limit.percent = ERROR_READING_LIMIT_VALUE;
+        limit.cause = LimitCauseErrorReadingValue;
+    }
+    return limit;
+}
+
+CanbusLimit CanbusClass::getChargeLimit() {
+    return readLimit(0x64);
+}
+
+CanbusLimit CanbusClass::getDischargeLimit() {
+    return readLimit(0x65);
+}
+#endif
+
+#if CANBUS_ENABLE_PACK_VALUES
+#if CANBUS_ENABLE_FLOAT
 float CanbusClass::getPackVoltage() {
 #if MOCK_DATA
     static long lastTime = 0;
@@ -357,38 +1206,49 @@ float CanbusClass::getMaxVoltage() {
 #endif
     return CONVERT_ENCODED_MVOLT_TO_VOLT(readElithionSingleByteValue(0x45));
 }
+#endif
 
 uint8_t CanbusClass::getMinVoltageCellNumber() {
-    // this is racy...and min voltage + cell should be read at the same time
-	tCAN message;
-    if (readElithionDefaultMessageFromCanBus(&message, 0x43, 0)) {
-        return message.data[5];
-    } else {
-        return 0;
-    }
+    // this is racy with the voltage getters; getCellExtremes() reads both from one reply
+    return readElithionSingleByteValue(0x43, 1);
 }
 
 uint8_t CanbusClass::getAvgVoltageCellNumber() {
-    // this is racy...and min voltage + cell should be read at the same time
-	tCAN message;
-    if (readElithionDefaultMessageFromCanBus(&message, 0x44, 0)) {
-        return message.data[5];
-    } else {
-        return 0;
-    }
+    // this is racy with the voltage getters; getCellExtremes() reads both from one reply
+    return readElithionSingleByteValue(0x44, 1);
 }
 
 uint8_t CanbusClass::getMaxVoltageCellNumber() {
-    // this is racy...and min voltage + cell should be read at the same time
-	tCAN message;
-    if (readElithionDefaultMessageFromCanBus(&message, 0x45, 0)) {
-        return message.data[5];
-    } else {
-        return 0;
-    }
+    // this is racy with the voltage getters; getCellExtremes() reads both from one reply
+    return readElithionSingleByteValue(0x45, 1);
 }
 
+CanbusCellExtremes CanbusClass::getCellExtremes() {
+    static const uint8_t pids[] = { 0x43, 0x44, 0x45 }; // min, avg, max
+    CanbusCellExtremes extremes;
+    CanbusCellVoltage *voltages[] = { &extremes.min, &extremes.avg, &extremes.max };
+    memset(&extremes, 0, sizeof(extremes));
+    extremes.status = CanbusReadFresh;
+    for (uint8_t i = 0; i < 3; i++) {
+        unsigned long received;
+        const uint8_t *value = requestElithionValue(pids[i], 0, &received);
+        if (value == NULL) {
+            extremes.status = CanbusReadMissing;
+            break;
+        }
+        // The value and its cell number come from the same reply
+        voltages[i]->millivolts = encodedCellToMillivolts(value[0]);
+        voltages[i]->cell = value[1];
+        releaseFrame();
+        if (i == 0 || (long)(received - extremes.timestamp) < 0) {
+            extremes.timestamp = received;
+        }
+    }
+    return extremes;
+}
+#endif
 
+#if CANBUS_ENABLE_FAULT_VALUES
 IOFlags CanbusClass::getIOFlags() {
 #if MOCK_DATA
     return IOFlagPowerFromSource; // charging
@@ -397,25 +1257,49 @@ IOFlags CanbusClass::getIOFlags() {
 }
 
 void CanbusClass::clearStoredFault() {
-	tCAN message;
-    setupElithionCanMessage(&message, 0x14, ELITHION_PID_FAULT, 0);
-    // we ignore the result
-    bool result = sendAndReceiveMessage(&message, 0x54, ELITHION_PID_RESPONSE_MODE_DEFAULT, ELITHION_PID_FAULT, 0);
+    tCAN *message = borrowFrame();
+    if (message == NULL) {
+        return;
+    }
+    setupElithionCanMessage(message, _requestId, 0x14, ELITHION_PID_FAULT, 0);
+    // we ignore the result, other than for debugging
+    if (sendAndReceiveMessage(message, 0x54, ELITHION_PID_RESPONSE_MODE_DEFAULT, ELITHION_PID_FAULT, 0, _driver->millis() + TIMEOUT_DURATION)) {
 #if DEBUG
-    if (result) {
         Serial.println("faults should ahve been cleared");
     } else {
         Serial.println("failed to clear faults");
-    }
 #endif
+    }
+    releaseFrame();
+}
+
+CanbusFaultInfo CanbusClass::getFaultInfo() {
+    CanbusFaultInfo info;
+    const uint8_t *value = requestElithionValue(ELITHION_PID_FAULT, 0, &info.timestamp);
+    if (value) {
+        info.status = CanbusReadFresh;
+        info.presentFaults = value[0];
+        info.storedFault = value[1];
+        info.presentWarnings = value[2];
+        releaseFrame();
+    } else {
+        // Unlike getFaults(), a failed read isn't reported as a fault; check status
+        info.status = CanbusReadMissing;
+        info.timestamp = 0;
+        info.presentFaults = 0;
+        info.storedFault = StoredFaultKindNone;
+        info.presentWarnings = 0;
+    }
+    return info;
 }
 
 void CanbusClass::getFaults(FaultKindOptions *presentFaults, StoredFaultKind *storedFault, FaultKindOptions *presentWarnings) {
-	tCAN message;
-    if (readElithionDefaultMessageFromCanBus(&message, ELITHION_PID_FAULT, 0/*pid_low*/)) {
-        *presentFaults = message.data[4];
-        *storedFault = message.data[5];
-        *presentWarnings = message.data[6];
+    const uint8_t *value = requestElithionValue(ELITHION_PID_FAULT, 0/*pid_low*/);
+    if (value) {
+        *presentFaults = value[0];
+        *storedFault = value[1];
+        *presentWarnings = value[2];
+        releaseFrame();
     } else {
         // Indicate a fault, in that we couldn't read it!
         if (!_initialized) {
@@ -455,4 +1339,5 @@ void CanbusClass::getFaults(FaultKindOptions *presentFaults, StoredFaultKind *st
     Serial.println(*presentWarnings, 16);
 #endif
     
-}
\ No newline at end of file
+}
+#endif
@@ -13,6 +13,12 @@
 
 #include <stdint.h>
 
+#include "CanbusConfig.h"
+#include "mcp2515.h"
+
+class FrameLogger;
+class BusProfiler;
+
 typedef enum {
     CanSpeed500 = 1,
     CanSpeed250 = 3,
@@ -100,14 +106,329 @@ typedef int8_t LimitCause;
 
 #define ERROR_READING_LIMIT_VALUE -1
 
+typedef enum {
+    CanbusErrorActive = 0,
+    CanbusErrorWarning, // an error counter reached 96
+    CanbusErrorPassive, // an error counter reached 128; we can still talk but only passively flag errors
+    CanbusErrorBusOff, // TEC passed 255; the controller is off the bus
+} CanbusErrorState;
+
+#ifndef CANBUS_RECOVERY_TIMEOUT
+    #define CANBUS_RECOVERY_TIMEOUT 20 // ms to wait for an in place recovery before resetting the MCP2515
+#endif
+
+// Things that can be watched with CanbusClass::subscribe(). They are checked against the raw
+// bytes of every reply as it comes in, so a callback only runs when something actually changed.
+typedef enum {
+    CanbusEventFaults, // parameter: mask of FaultKindOptions (the low 8 bits) to watch being set or cleared
+    CanbusEventWarnings, // parameter: mask of FaultKindOptions
+    CanbusEventIOFlags, // parameter: mask of IOFlags
+    CanbusEventStateOfCharge, // parameter: percentage; fires when the SOC crosses it in either direction
+    CanbusEventChargeLimitCause, // parameter: unused; fires when the LimitCause changes
+    CanbusEventDischargeLimitCause, // parameter: unused
+} CanbusEvent;
+
+// oldValue and newValue are the raw bytes (ie: the whole FaultKindOptions byte, or the SOC)
+typedef void (*CanbusEventCallback)(CanbusEvent event, uint8_t oldValue, uint8_t newValue);
+
+#ifndef CANBUS_MAX_SUBSCRIPTIONS
+    #define CANBUS_MAX_SUBSCRIPTIONS 4
+#endif
+
+#ifndef CANBUS_MONITOR_INTERVAL
+    #define CANBUS_MONITOR_INTERVAL 250 // ms between bus load / error counter samples
+#endif
+
+#ifndef CANBUS_MAX_SCHEDULED_PIDS
+    #define CANBUS_MAX_SCHEDULED_PIDS 8 // 19 bytes of RAM each
+#endif
+
+#ifndef CANBUS_FRAME_SLOTS
+    #define CANBUS_FRAME_SLOTS 2 // frames in use at once: a request, plus one from a getter called by a subscription callback
+#endif
+
+#ifndef CANBUS_AUTOBAUD_WINDOW
+    #define CANBUS_AUTOBAUD_WINDOW 150 // ms CanbusClass::initAutoBaud() listens at each speed
+#endif
+
+#ifndef CANBUS_MIN_READ_TIME
+    #define CANBUS_MIN_READ_TIME 2 // ms; CanbusClass::read() won't send a request with less time than this left
+#endif
+
+typedef enum {
+    CanbusReadMissing = 0, // never read; data is meaningless
+    CanbusReadStale, // this call didn't get it in time; data is the last known value, from updated
+    CanbusReadFresh,
+} CanbusReadStatus;
+
+// One value for CanbusClass::read(). Set pid (the elithion PID high byte, ie: 0x62 for faults)
+// and zero the rest once, then keep passing the same entry so there is a last known value to
+// fall back on.
+typedef struct {
+    uint8_t pid;
+    CanbusReadStatus status;
+    uint8_t data[4]; // reply bytes 4-7; data[0] for single byte values, (data[0] << 8) | data[1] for two byte ones
+    unsigned long updated; // driver millis() when data was received
+} CanbusRead;
+
+// Values that come from the same reply, so they always describe the same moment. status is
+// CanbusReadFresh or CanbusReadMissing (the BMS didn't answer and the values are meaningless);
+// timestamp is the driver millis() the reply came in, or when poll() got it for a scheduled PID.
+typedef struct {
+    uint16_t millivolts;
+    uint8_t cell;
+} CanbusCellVoltage;
+
+typedef struct {
+    CanbusReadStatus status; // missing if any of the three weren't answered
+    unsigned long timestamp; // the oldest of the three replies
+    CanbusCellVoltage min;
+    CanbusCellVoltage avg;
+    CanbusCellVoltage max;
+} CanbusCellExtremes;
+
+typedef struct {
+    CanbusReadStatus status;
+    unsigned long timestamp;
+    int8_t percent; // 0-100
+    LimitCause cause;
+} CanbusLimit;
+
+typedef struct {
+    CanbusReadStatus status;
+    unsigned long timestamp;
+    FaultKindOptions presentFaults;
+    StoredFaultKind storedFault;
+    FaultKindOptions presentWarnings;
+} CanbusFaultInfo;
+
+// Gets every received frame that isn't a reply from the BMS; returns true if it took it, and the
+// rest are counted by getUnroutedFrameCount(). CanbusDispatch<>::dispatch from CanbusDispatch.h fits.
+typedef bool (*CanbusDispatchFunction)(const tCAN *message);
+
+// What the MCP2515 does on the bus; the values are its CANCTRL REQOP bits
+typedef enum {
+    CanbusModeNormal = 0x00,
+    CanbusModeLoopback = 0x40, // frames sent are received back, and nothing reaches the bus
+    CanbusModeListenOnly = 0x60, // receives everything, never transmits (not even an ACK)
+} CanbusMode;
+
+// The low level CAN access used by CanbusClass. On the Arduino this defaults to the MCP2515
+// functions; a host build can swap in something else (ie: extras/host/CanbusReplay.h to feed
+// recorded candump logs through the same request/response matching and decoding).
+typedef struct {
+    uint8_t (*init)(uint8_t speed);
+    uint8_t (*checkMessage)(void); // non zero if a message is waiting
+    uint8_t (*getMessage)(tCAN *message);
+    uint8_t (*sendMessage)(tCAN *message);
+    void (*bitModify)(uint8_t address, uint8_t mask, uint8_t data);
+    unsigned long (*millis)(void); // all timeouts are measured with this clock
+    uint8_t (*readRegister)(uint8_t address);
+    uint8_t (*setIdFilter)(const uint8_t *bitmap); // optional; non zero if it took
+} CanbusDriver;
+
 class CanbusClass
 {
 private:
     bool _initialized;
+    const CanbusDriver *_driver;
+    CanSpeed _canSpeed;
+    CanbusMode _mode;
+    uint16_t _requestId;
+    uint16_t _responseId;
+#if CANBUS_ENABLE_PACK_VALUES
+    uint8_t _numberOfCells; // 0 until the BMS is asked
+#endif
+    tCAN _frames[CANBUS_FRAME_SLOTS]; // see borrowFrame()
+    uint8_t _borrowedFrames;
+    
+#if CANBUS_ENABLE_SUBSCRIPTIONS
+    struct Subscription {
+        CanbusEventCallback callback; // NULL if unused
+        uint8_t event;
+        uint8_t parameter;
+        uint8_t lastValue;
+        bool seeded;
+    } _subscriptions[CANBUS_MAX_SUBSCRIPTIONS];
+#endif
+    
+    void handleReply(const tCAN *message);
+    
+#if CANBUS_ENABLE_SCHEDULER
+    // Polling schedule; see schedule()
+    struct ScheduledPid {
+        uint8_t pid; // 0 if unused
+        uint8_t priority;
+        uint16_t period;
+        unsigned long nextDue;
+        unsigned long lastReply;
+        uint8_t data[4]; // reply bytes 4-7
+        bool valid;
+        uint16_t deadlineMisses;
+    } _schedule[CANBUS_MAX_SCHEDULED_PIDS];
+    uint8_t _pendingIndex; // the request poll() is waiting on, or CANBUS_MAX_SCHEDULED_PIDS for none
+    unsigned long _pendingSince;
+    uint16_t _requestBudget; // requests per second, 0 for no limit
+    int32_t _budgetTokens; // 1000 per request, below 0 when the getters went over
+    unsigned long _lastBudgetUpdate;
+    
+    ScheduledPid *findScheduledPid(uint8_t pid);
+    void refillBudget(unsigned long now);
+    bool hasBudgetForRequest(unsigned long now);
+    void chargeRequest(unsigned long now);
+    uint16_t effectivePeriod(const ScheduledPid *scheduled);
+    void pollSchedule(unsigned long now);
+#endif
+    
+#if CANBUS_ENABLE_BUS_MONITOR
+    // Bus monitoring
+    uint32_t _busBits; // since the last sample
+    unsigned long _lastMonitorSample;
+    uint8_t _busUtilization; // percent, smoothed
+    uint8_t _transmitErrors;
+    uint8_t _receiveErrors;
+    uint8_t _errorFlags;
+    bool _adaptivePolling;
+    uint8_t _pollingScale; // in 1/8ths of the scheduled rates
+    
+    void countBusBits(const tCAN *message);
+    void updateBusMonitor(unsigned long now);
+#endif
+    
+#if CANBUS_ENABLE_ERROR_RECOVERY
+    // Error handling
+    CanbusErrorState _errorState;
+    uint16_t _recoveryCount;
+    uint16_t _fullResetCount;
+    uint16_t _lastRecoveryDuration;
+    unsigned long _recoveryStart;
+    bool _recovering; // waiting for the controller to come back; poll() checks on it
+    
+    void handleControllerErrors();
+    void updateErrorState(uint8_t errorFlags);
+    void recover(uint8_t errorFlags);
+    void continueRecovery();
+#else
+    void handleControllerErrors() { }
+#endif
+    
+#if CANBUS_ENABLE_LOW_POWER
+    // Low power duty cycle
+    uint16_t _awakeDuration;
+    uint16_t _sleepDuration;
+    unsigned long _awakeSince;
+#endif
+    
+#if CANBUS_ENABLE_DISPATCH
+    CanbusDispatchFunction _dispatch;
+    uint16_t _unroutedFrames;
+#endif
+    
+#if CANBUS_ENABLE_ID_FILTER
+    uint8_t *_idFilter;
+#endif
+    
+#if CANBUS_ENABLE_LOGGER
+    FrameLogger *_logger;
+#endif
+    
+#if CANBUS_ENABLE_PROFILER
+    BusProfiler *_profiler;
+#endif
+    
+    bool receiveMessage(tCAN *message);
+    bool transmitMessage(tCAN *message);
+    void processReceivedMessage(const tCAN *message);
+    bool sendAndReceiveMessage(tCAN *message, uint16_t pid_reply, uint8_t response_mode, uint8_t response_pid_hi, uint8_t response_pid_low, unsigned long deadline);
+    tCAN *borrowFrame();
+    void releaseFrame();
+    const uint8_t *requestElithionValue(uint8_t pid_hi, uint8_t pid_low, unsigned long *received = 0);
+    int readElithionTwoByteValue(uint8_t pid_hi);
+    uint8_t readElithionSingleByteValue(uint8_t pid_hi, uint8_t index = 0);
+#if CANBUS_ENABLE_STATE_VALUES
+    CanbusLimit readLimit(uint8_t pid);
+#endif
+    bool listenForSpeed(CanSpeed canSpeed, uint16_t windowMs);
+    bool requestMode(uint8_t mode);
+    bool applyMode();
+#if CANBUS_ENABLE_WARM_START
+    bool bmsAnswers();
+#endif
 public:
     CanbusClass();
     bool init(CanSpeed canSpeed);
+    // Finds the bus speed by listening, in listen only mode so nothing is sent while it is wrong,
+    // at each speed for up to windowMs, starting with the last one used. A speed is taken as soon
+    // as a frame comes in cleanly and dropped as soon as the MCP2515 flags a receive error, so on
+    // a busy bus (the elithion broadcasts are enough) it takes a few ms per wrong speed. Returns
+    // true in normal mode at the speed found. On a silent bus it returns false, initialized at
+    // the last speed used so requests can still be tried; call it again later.
+    bool initAutoBaud(uint16_t windowMs = CANBUS_AUTOBAUD_WINDOW);
+    CanSpeed getCanSpeed() { return _canSpeed; }
+    
+    // The mode is kept across init(), error recovery and sleep(). In listen only mode nothing is ever sent: scheduled PIDs (see schedule()) are
+    // filled in from the replies to whatever else on the bus asks the BMS, the getters return the
+    // newest of those however old it is, and everything else reads as if the BMS didn't answer.
+    // Returns false if the MCP2515 didn't switch (ie: it is still sending a frame); try again.
+    bool setMode(CanbusMode mode);
+    CanbusMode getMode() { return _mode; }
+    
+    // The IDs the BMS is configured to take requests and send replies on (0x745 and 0x74D by default).
+    // Changing them forgets the cell count and the scheduled values, which are asked for again.
+    void setBmsIds(uint16_t requestId, uint16_t responseId);
+    uint16_t getBmsRequestId() { return _requestId; }
+    uint16_t getBmsResponseId() { return _responseId; }
+    
+#if CANBUS_ENABLE_WARM_START
+    // Warm start (Arduino only; see CanbusWarmStart.cpp). initWarm() takes the speed, BMS IDs and
+    // cell count saved by saveConfig() from the EEPROM at CANBUS_CONFIG_EEPROM_ADDRESS, and checks
+    // them with a single request. If there is no valid record, or the BMS doesn't answer, it falls
+    // back to initAutoBaud() and the IDs set before the call, and saves what worked. Returns true
+    // if the BMS answered either way. In listen only mode nothing can be sent, so a valid record
+    // is taken as it is, and otherwise it is true if initAutoBaud() heard the speed.
+    bool initWarm(uint16_t windowMs = CANBUS_AUTOBAUD_WINDOW);
+    // Saves the current configuration (only the bytes that changed are written). initWarm() calls
+    // it; call it again after changing the IDs.
+    void saveConfig();
+#endif
+    
+    // Replaces the MCP2515 driver; call before init(). The driver must outlive the class.
+    void setDriver(const CanbusDriver *driver) { _driver = driver; }
+    const CanbusDriver *getDriver() { return _driver; }
+    
+#if CANBUS_ENABLE_DISPATCH
+    // Frames that aren't BMS replies go here as they are received, from poll() or from inside
+    // a getter waiting for its reply; NULL (the default) drops them.
+    void setDispatch(CanbusDispatchFunction dispatch) { _dispatch = dispatch; }
+    // Frames that weren't BMS replies and that the dispatch function didn't take (all of them
+    // when there is none); a route table that misses traffic it was meant to get shows up here.
+    uint16_t getUnroutedFrameCount() { return _unroutedFrames; }
+#endif
+    
+#if CANBUS_ENABLE_ID_FILTER
+    // Receives only the standard IDs in bitmap, an ID_FILTER_SIZE byte array from id_filter.h
+    // (fill it with id_filter_add()), plus the BMS replies, which are added to it here and by
+    // setBmsIds(). The MCP2515 is given the tightest masks that cover the bitmap and checks the
+    // rest as each ID comes in, so the frames left out never reach a handler or take up a
+    // buffer. Keep the bitmap around; NULL receives everything again. Call after init(): working
+    // out the masks takes up to a few hundred ms, and they are kept across later inits. Note that
+    // initAutoBaud() only hears frames that get through. Returns false if the MCP2515 couldn't be
+    // put in configuration mode to take the masks.
+    bool setIdFilter(uint8_t *bitmap);
+#endif
+    
+#if CANBUS_ENABLE_LOGGER
+    // Every frame sent and received is logged, stamped with the driver's millis(); NULL to stop.
+    // The sketch still has to call logger->service() from loop() to get the segments written.
+    void setLogger(FrameLogger *logger) { _logger = logger; }
+#endif
+    
+#if CANBUS_ENABLE_PROFILER
+    // Every frame received is counted by ID (see BusProfiler.h); NULL to stop
+    void setProfiler(BusProfiler *profiler) { _profiler = profiler; }
+#endif
   
+#if CANBUS_ENABLE_STATE_VALUES
     // Elithion BMS options
     uint8_t getStateOfCharge(); // Returns a value from 0 to 100
     uint16_t getDepthOfDischarge(); // [Ah]
@@ -117,31 +438,144 @@ public:
     
     int8_t getChargeLimitValue(); // 0-100 percent; returns ERROR_READING_LIMIT_VALUE on error
     int8_t getDischargeLimitValue(); // 0-100 percent; returns ERROR_READING_LIMIT_VALUE on error
+    // The value and cause from one request, instead of one each
+    CanbusLimit getChargeLimit();
+    CanbusLimit getDischargeLimit();
+#endif
     
+#if CANBUS_ENABLE_PACK_VALUES
     // Pack
+#if CANBUS_ENABLE_FLOAT
     float getPackVoltage(); // in volts
     float getMinVoltage(); // volts, indivdual cell voltage
     float getAvgVoltage();
     float getMaxVoltage();
+#endif
+    uint16_t getPackDecivolts(); // in 100mV
+    uint16_t getMinCellMillivolts();
+    uint16_t getAvgCellMillivolts();
+    uint16_t getMaxCellMillivolts();
     uint8_t getMinVoltageCellNumber();
     uint8_t getAvgVoltageCellNumber();
     uint8_t getMaxVoltageCellNumber();
+    // Each voltage with its cell number, 3 requests instead of 6
+    CanbusCellExtremes getCellExtremes();
     
     int getNumberOfCells();
+#if CANBUS_ENABLE_FLOAT
     float getVoltageForCell(int cell);
+#endif
+    // The raw reading in 10mV steps above 2.0V; false if the BMS didn't answer. Feed these to a
+    // CellStatistics to track the pack without float math.
+    bool getEncodedVoltageForCell(int cell, uint8_t *encodedVoltage);
+#endif
     
+#if CANBUS_ENABLE_CURRENT_VALUES
     // Current
+#if CANBUS_ENABLE_FLOAT
     float getPackCurrent();  // amps
     float getAverageSourceCurrent(); // amps
     float getAverageLoadCurrent();  // amps
     float getSourceCurrent(); // amps
     float getLoadCurrent(); // amps
+#endif
+    int16_t getPackDeciamps(); // in 100mA
+    int16_t getAverageSourceDeciamps();
+    int16_t getAverageLoadDeciamps();
+    int16_t getSourceDeciamps();
+    int16_t getLoadDeciamps();
+#endif
     
+#if CANBUS_ENABLE_FAULT_VALUES
     void getFaults(FaultKindOptions *presentFaults, StoredFaultKind *storedFault, FaultKindOptions *presentWarnings);
     void clearStoredFault();
+    CanbusFaultInfo getFaultInfo();
     
     IOFlags getIOFlags();
+#endif
     
+#if CANBUS_ENABLE_SUBSCRIPTIONS
+    // Change notifications; see CanbusEvent. Returns false if all CANBUS_MAX_SUBSCRIPTIONS are
+    // taken. Callbacks run from inside whichever call received the reply. Fault, warning, IO
+    // flag and limit cause subscriptions start from "nothing set", so conditions already present
+    // are reported on the first reply; SOC subscriptions just take the first reading as is.
+    bool subscribe(CanbusEvent event, uint8_t parameter, CanbusEventCallback callback);
+    void unsubscribe(CanbusEventCallback callback);
+#endif
+    
+    // Reads as many of the values as fit before deadline (a getDriver()->millis() time), in order,
+    // so put the important ones first. Never blocks past the deadline: values that didn't fit, or
+    // weren't answered in time, are marked CanbusReadStale and keep their last known data.
+    // Scheduled values poll() got recently are used without asking. Returns the number of fresh ones.
+    uint8_t read(CanbusRead *reads, uint8_t count, unsigned long deadline);
+    uint8_t readWithin(CanbusRead *reads, uint8_t count, uint16_t budgetMs) { return read(reads, count, _driver->millis() + budgetMs); }
+    
+    // Handles whatever came in (replies, errors) and runs the schedule and bus monitor; call every loop
+    void poll();
+    
+#if CANBUS_ENABLE_SCHEDULER
+    // Multi rate polling. Each scheduled PID (the elithion PID high byte, ie: 0x62 for faults) is
+    // requested every periodMs; when several are due the lowest priority number goes first.
+    // poll() never blocks: it handles replies that came in and sends at most one request, within
+    // the request budget. The getters' own requests count against the budget too: they are never
+    // held back, but the schedule then waits until there is room again. While a scheduled value
+    // is younger than its period the getters return it without touching the bus. Returns false if
+    // the schedule is full.
+    bool schedule(uint8_t pid, uint16_t periodMs, uint8_t priority);
+    void unschedule(uint8_t pid);
+    void setRequestBudget(uint16_t requestsPerSecond) { _requestBudget = requestsPerSecond; } // 0 for no limit
+    // How many times a PID was refreshed more than a period late, or its request went unanswered
+    uint16_t getDeadlineMisses(uint8_t pid);
+#endif
+    
+#if CANBUS_ENABLE_BUS_MONITOR
+    // Bus monitoring, sampled by poll() every CANBUS_MONITOR_INTERVAL. Utilization is estimated
+    // from the frames we send and receive (so it misses frames the MCP2515 dropped) and is smoothed.
+    uint8_t getBusUtilization() { return _busUtilization; } // percent
+    uint8_t getTransmitErrorCount() { return _transmitErrors; } // TEC
+    uint8_t getReceiveErrorCount() { return _receiveErrors; } // REC
+    uint8_t getErrorFlags() { return _errorFlags; } // EFLG
+    // When on (the default), scheduled polling slows down, to as little as 1/8th of the
+    // requested rates, while the bus is busy or the error counters climb, and speeds back up
+    // once things calm down.
+    void setAdaptivePolling(bool enabled);
+    uint8_t getPollingRatePercent() { return _pollingScale * 100 / 8; }
+#endif
+    
+#if CANBUS_ENABLE_ERROR_RECOVERY
+    // Controller error state, updated from the MCP2515 error interrupt (and whenever a request
+    // goes unanswered). On bus-off or a receive overflow the library recovers by itself: it clears
+    // the flags, aborts stale transmissions (when error passive or bus-off) and puts the controller
+    // back in normal mode. It doesn't wait for that; the following poll() calls check on it, and
+    // only fall back to a full reset (like init()) if it is still off the bus after
+    // CANBUS_RECOVERY_TIMEOUT.
+    CanbusErrorState getErrorState() { return _errorState; }
+    uint16_t getRecoveryCount() { return _recoveryCount; }
+    uint16_t getFullResetCount() { return _fullResetCount; } // recoveries that needed a reset
+    uint16_t getLastRecoveryDuration() { return _lastRecoveryDuration; } // ms
+#endif
+    
+#if CANBUS_ENABLE_LOW_POWER
+    // Low power (Arduino only; see CanbusPower.cpp). sleep() puts the MCP2515 to sleep with wake
+    // on CAN enabled and powers the AVR down until CAN traffic or maxMs, whichever comes first.
+    // Returns true if CAN traffic woke us up.
+    //
+    // Timing is kept by the watchdog, which is only good to about 10%; millis() is advanced by the
+    // time slept. It can't be read, so when CAN traffic wakes us part way through a watchdog
+    // period half of that period is counted: millis() can then be off by up to half the period,
+    // which is the largest of 8s, 4s, ... 16ms that fit in what was left of maxMs (so up to 4s for
+    // a long sleep; keep maxMs short where that matters). Wake up latency is the AVR's oscillator start up (16K clocks,
+    // 1ms at 16MHz with the usual Arduino fuses) plus a few SPI transactions to put the MCP2515
+    // back in normal mode. The frame that wakes the MCP2515 is always lost, so a fault broadcast
+    // gets us up and the next broadcast (or a request) is what we actually read.
+    //
+    // The CAN transceiver is not touched; put it in standby separately for the lowest current.
+    bool sleep(uint16_t maxMs);
+    // With a duty cycle set, pollLowPower() polls for awakeMs then sleeps for sleepMs, or only
+    // until the next scheduled PID is due if that is sooner (and not at all while one is due).
+    void setDutyCycle(uint16_t awakeMs, uint16_t sleepMs) { _awakeDuration = awakeMs; _sleepDuration = sleepMs; }
+    void pollLowPower(); // call every loop instead of poll()
+#endif
 
 };
 
@@ -0,0 +1,127 @@
+// Compile time configuration for the Canbus library - by corbin dunn
+// www.corbinstreehouse.com
+//
+// Arduino doesn't let a sketch pass defines to a library, so edit the defaults here (or add
+// -D flags in a makefile build). The value groups and the float getters are on by default, as
+// they were before these switches; the features below them are off until set to 1.
+//
+// The Arduino IDE already links with --gc-sections, so getters a sketch never calls don't cost
+// flash whether or not they are enabled here. What these switches buy is:
+//  - RAM: the tables behind the optional features are class members, and they go away;
+//  - flash for code on the shared request/receive path (subscription checks, bus monitoring,
+//    error recovery, the schedule cache) that every getter otherwise pulls in;
+//  - the float library: with CANBUS_ENABLE_FLOAT 0 only the integer getters exist, so calling a
+//    float getter is a compile error instead of a silent ~1KB+ of soft float code.
+//
+// SRAM per feature on the AVR (default sizes):
+//   core (state, mode, BMS IDs, frames)    12 bytes (13 with the pack values) plus 11 per frame slot (22), plus 14 for the MCP2515 driver table (16 with the ID filter), plus 4 in spi_bus.cpp (and the SPI library's own 4)
+//   CANBUS_ENABLE_SUBSCRIPTIONS            6 per subscription (24), plus 12 for the PID table
+//   CANBUS_ENABLE_SCHEDULER                19 per scheduled PID (152), plus 15
+//   CANBUS_ENABLE_BUS_MONITOR              14
+//   CANBUS_ENABLE_ERROR_RECOVERY           13
+//   CANBUS_ENABLE_LOW_POWER                8, plus 2 in CanbusPower.cpp
+//   CANBUS_ENABLE_WARM_START               0 (9 bytes of EEPROM)
+//   CANBUS_ENABLE_DISPATCH                 4 (the sketch's route table is 6 per route)
+//   CANBUS_ENABLE_ID_FILTER                2, plus 16 in mcp2515.c (the sketch's bitmap is another 256)
+//   CANBUS_ENABLE_LOGGER                   2 (a FrameLogger is another 1040)
+//   CANBUS_ENABLE_PROFILER                 2 (a BusProfiler is another 425)
+// With the defaults (every feature off) that is 53 bytes. This table is SRAM only, counted from
+// the members.
+//
+// Flash per feature on the ATmega328P, added to a sketch that calls init(), poll(),
+// getStateOfCharge(), getPackVoltage(), getPackCurrent() and getFaults() (3338 bytes with every
+// feature off), with the feature turned on and its own calls made (subscribe(), schedule(),
+// initWarm(), setIdFilter(), pollLowPower(), ...):
+//   CANBUS_ENABLE_SUBSCRIPTIONS            808
+//   CANBUS_ENABLE_SCHEDULER                2546
+//   CANBUS_ENABLE_BUS_MONITOR              874
+//   CANBUS_ENABLE_ERROR_RECOVERY           784
+//   CANBUS_ENABLE_LOW_POWER                770
+//   CANBUS_ENABLE_WARM_START               1378
+//   CANBUS_ENABLE_DISPATCH                 252
+//   CANBUS_ENABLE_ID_FILTER                1572 (with id_filter.c)
+//   CANBUS_ENABLE_LOGGER                   1304 (with FrameLogger's logFrame() and service())
+//   CANBUS_ENABLE_PROFILER                 850 (with BusProfiler::record())
+// These are clang's AVR code at -Os with unused functions dropped, without libgcc and avr-libc
+// (the soft float and EEPROM routines), so they are a guide and avr-gcc's will differ. For the
+// exact cost in a given sketch, compare the "Sketch uses" line (or avr-size on the .elf) with the
+// feature on and off.
+
+#ifndef CANBUS_CONFIG_H
+#define CANBUS_CONFIG_H
+
+// Value groups
+#ifndef CANBUS_ENABLE_STATE_VALUES
+    #define CANBUS_ENABLE_STATE_VALUES 1 // SOC, DOD, charge/discharge limits
+#endif
+#ifndef CANBUS_ENABLE_PACK_VALUES
+    #define CANBUS_ENABLE_PACK_VALUES 1 // pack voltage, min/avg/max cells, individual cells
+#endif
+#ifndef CANBUS_ENABLE_CURRENT_VALUES
+    #define CANBUS_ENABLE_CURRENT_VALUES 1
+#endif
+#ifndef CANBUS_ENABLE_FAULT_VALUES
+    #define CANBUS_ENABLE_FAULT_VALUES 1 // faults, stored faults, IO flags
+#endif
+
+// Conversions
+#ifndef CANBUS_ENABLE_FLOAT
+    #define CANBUS_ENABLE_FLOAT 1 // the float getters (volts, amps); the integer ones are always there
+#endif
+
+// Features; all off by default, so a sketch only pays for the ones it turns on
+#ifndef CANBUS_ENABLE_SUBSCRIPTIONS
+    #define CANBUS_ENABLE_SUBSCRIPTIONS 0
+#endif
+#ifndef CANBUS_ENABLE_SCHEDULER
+    #define CANBUS_ENABLE_SCHEDULER 0
+#endif
+#ifndef CANBUS_ENABLE_BUS_MONITOR
+    #define CANBUS_ENABLE_BUS_MONITOR 0 // bus load, TEC/REC/EFLG and adaptive polling
+#endif
+#ifndef CANBUS_ENABLE_ERROR_RECOVERY
+    #define CANBUS_ENABLE_ERROR_RECOVERY 0
+#endif
+#ifndef CANBUS_ENABLE_LOW_POWER
+    #define CANBUS_ENABLE_LOW_POWER 0 // defines ISR(WDT_vect); leave at 0 for a sketch that has its own
+#endif
+#ifndef CANBUS_ENABLE_WARM_START
+    #define CANBUS_ENABLE_WARM_START 0 // CanbusClass::initWarm(); keeps the bus configuration in the EEPROM
+#endif
+#ifndef CANBUS_ENABLE_DISPATCH
+    #define CANBUS_ENABLE_DISPATCH 0 // CanbusClass::setDispatch(), for frames other than BMS replies; see CanbusDispatch.h
+#endif
+#ifndef CANBUS_ENABLE_ID_FILTER
+    #define CANBUS_ENABLE_ID_FILTER 0 // CanbusClass::setIdFilter(); see id_filter.h
+#endif
+#ifndef CANBUS_ENABLE_LOGGER
+    #define CANBUS_ENABLE_LOGGER 0 // CanbusClass::setLogger(); the FrameLogger itself belongs to the sketch
+#endif
+#ifndef CANBUS_ENABLE_PROFILER
+    #define CANBUS_ENABLE_PROFILER 0 // CanbusClass::setProfiler(); the BusProfiler itself belongs to the sketch
+#endif
+
+// EEPROM layout: BmsHistory's region, then CanbusClass::saveConfig()'s 9 byte record, and the
+// rest of the top 128 bytes are left for the sketch
+#ifndef BMS_HISTORY_EEPROM_START
+    #define BMS_HISTORY_EEPROM_START 0
+#endif
+#ifndef BMS_HISTORY_EEPROM_SIZE
+    #define BMS_HISTORY_EEPROM_SIZE 896
+#endif
+#ifndef BMS_HISTORY_PAGE_SIZE
+    #define BMS_HISTORY_PAGE_SIZE 64 // up to 255
+#endif
+#ifndef CANBUS_CONFIG_EEPROM_ADDRESS
+    #define CANBUS_CONFIG_EEPROM_ADDRESS 0x380
+#endif
+
+// Diagnostics
+#ifndef CANBUS_DEBUG
+    #define CANBUS_DEBUG 0 // prints problems to Serial
+#endif
+#ifndef CANBUS_MOCK_DATA
+    #define CANBUS_MOCK_DATA 0 // made up values for working on a sketch without a BMS
+#endif
+
+#endif
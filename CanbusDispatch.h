@@ -0,0 +1,80 @@
+// Routing received frames by CAN ID - by corbin dunn
+// www.corbinstreehouse.com
+//
+// Frames that aren't replies to our BMS requests (broadcasts, the charger, a motor controller)
+// go to handlers picked by ID from a table fixed at compile time. The table is a constexpr array
+// of routes sorted by ID, each a single ID or an inclusive range; a static_assert rejects one
+// that is out of order or overlaps, so the lookup can be a binary search: a frame outside the
+// whole table is dropped after two compares, and one inside costs log2(routes) more.
+//
+//   static void onBroadcast(const tCAN *message) { ... }
+//   static void onCharger(const tCAN *message) { ... }
+//
+//   static constexpr CanbusRoute routes[] = {
+//       CANBUS_ROUTE(0x305, onCharger),
+//       CANBUS_ROUTE_RANGE(0x620, 0x628, onBroadcast),
+//   };
+//   typedef CanbusDispatch<routes, CANBUS_ROUTE_COUNT(routes)> Dispatch;
+//   ...
+//   Canbus.setDispatch(Dispatch::dispatch);
+//
+// Needs C++11 (the Arduino IDE has used -std=gnu++11 since 1.6.6). Each route is 6 bytes of RAM
+// on the AVR.
+
+#ifndef CANBUS_DISPATCH_H
+#define CANBUS_DISPATCH_H
+
+#include <stdint.h>
+
+#include "mcp2515.h"
+
+typedef void (*CanbusFrameHandler)(const tCAN *message);
+
+typedef struct {
+    uint16_t first;
+    uint16_t last; // inclusive
+    CanbusFrameHandler handler;
+} CanbusRoute;
+
+#define CANBUS_ROUTE(id, handler) { (id), (id), (handler) }
+#define CANBUS_ROUTE_RANGE(first, last, handler) { (first), (last), (handler) }
+#define CANBUS_ROUTE_COUNT(routes) (sizeof(routes) / sizeof((routes)[0]))
+
+// Single return statements, so it is constexpr in C++11
+constexpr bool canbusRoutesSorted(const CanbusRoute *routes, uint8_t count) {
+    return count == 0 || (routes[0].first <= routes[0].last && routes[0].last <= 0x7FF &&
+        (count == 1 || (routes[0].last < routes[1].first && canbusRoutesSorted(routes + 1, count - 1))));
+}
+
+template <const CanbusRoute *Routes, uint8_t Count>
+class CanbusDispatch
+{
+    static_assert(Count > 0, "a dispatch table needs at least one route");
+    static_assert(canbusRoutesSorted(Routes, Count), "routes must be 11 bit IDs, sorted, with first <= last, and must not overlap");
+public:
+    // Calls the handler for the frame's ID; false (and nothing called) if no route has it
+    static bool dispatch(const tCAN *message) {
+        uint16_t id = message->id;
+        if (id < Routes[0].first || id > Routes[Count - 1].last) {
+            return false;
+        }
+        // The first route that doesn't end before id
+        uint8_t low = 0;
+        uint8_t high = Count - 1;
+        while (low < high) {
+            uint8_t middle = (low + high) / 2;
+            if (Routes[middle].last < id) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        if (id < Routes[low].first) {
+            return false; // between two routes
+        }
+        Routes[low].handler(message);
+        return true;
+    }
+};
+
+#endif
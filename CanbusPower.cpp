@@ -0,0 +1,134 @@
+// Low power mode for the Canbus library - by corbin dunn
+// www.corbinstreehouse.com
+//
+// This defines ISR(WDT_vect) whenever CANBUS_ENABLE_LOW_POWER is on, whether or not the sketch
+// calls sleep(): the Arduino IDE links the library's objects whole and interrupt vectors are
+// never discarded. A sketch with its own watchdog interrupt gets a "multiple definition of
+// __vector_..." link error, so leave CANBUS_ENABLE_LOW_POWER at 0 (the default) for it.
+
+#include "CanbusConfig.h"
+
+#if defined(ARDUINO) && CANBUS_ENABLE_LOW_POWER
+
+#if ARDUINO>=100
+    #include <Arduino.h> // Arduino 1.0
+#else
+    #include <Wprogram.h> // Arduino 0022
+#endif
+
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+
+#include "Canbus.h"
+#include "mcp2515.h"
+
+#define MCP2515_INTERRUPT 0 // the MCP2515 INT pin is on INT0 (digital pin 2)
+
+// The Arduino core's millis() counter (wiring.c); timer 0 is stopped while we are powered down
+extern volatile unsigned long timer0_millis;
+
+static volatile bool canWokeUs;
+static volatile bool watchdogFired;
+
+ISR(WDT_vect) {
+    watchdogFired = true;
+}
+
+static void canWakeInterrupt() {
+    // It's a level interrupt, so it would keep firing
+    detachInterrupt(MCP2515_INTERRUPT);
+    canWokeUs = true;
+}
+
+// Nominal watchdog timeouts for prescaler values 9 down to 0
+static const uint16_t watchdogPeriods[] = { 8000, 4000, 2000, 1000, 500, 250, 125, 64, 32, 16 };
+
+bool CanbusClass::sleep(uint16_t maxMs) {
+    if (!_initialized) {
+        return false;
+    }
+    mcp2515_sleep();
+    canWokeUs = false;
+    
+    unsigned long slept = 0;
+    while (!canWokeUs) {
+        uint8_t i = 0;
+        while (i < sizeof(watchdogPeriods) / sizeof(watchdogPeriods[0]) && slept + watchdogPeriods[i] > maxMs) {
+            i++;
+        }
+        if (i == sizeof(watchdogPeriods) / sizeof(watchdogPeriods[0])) {
+            break; // less than the shortest watchdog time left
+        }
+        uint8_t prescaler = 9 - i;
+        
+        watchdogFired = false;
+        cli();
+        wdt_reset();
+        WDTCSR = (1<<WDCE) | (1<<WDE);
+        WDTCSR = (1<<WDIE) | ((prescaler & 8) ? (1<<WDP3) : 0) | (prescaler & 7);
+        // only a low level interrupt can wake the AVR from power down
+        attachInterrupt(MCP2515_INTERRUPT, canWakeInterrupt, LOW);
+        set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+        sleep_enable();
+        sei(); // the instruction after sei always runs first, so we can't miss the wake up
+        sleep_cpu();
+        sleep_disable();
+        wdt_disable();
+        
+        if (watchdogFired) {
+            slept += watchdogPeriods[i];
+        } else {
+            // CAN woke us part way through; the watchdog can't be read, so count half of it
+            slept += watchdogPeriods[i] / 2;
+        }
+    }
+    detachInterrupt(MCP2515_INTERRUPT);
+    
+    uint8_t oldSREG = SREG;
+    cli();
+    timer0_millis += slept;
+    SREG = oldSREG;
+    
+    mcp2515_wakeup();
+    if (_mode != CanbusModeNormal) {
+        applyMode(); // it wakes up in normal mode
+    }
+    return canWokeUs;
+}
+
+void CanbusClass::pollLowPower() {
+    poll();
+    if (_sleepDuration == 0) {
+        return;
+    }
+#if CANBUS_ENABLE_SCHEDULER
+    if (_pendingIndex < CANBUS_MAX_SCHEDULED_PIDS) {
+        return; // a reply is on the way
+    }
+#endif
+    if ((millis() - _awakeSince) < _awakeDuration) {
+        return;
+    }
+    uint16_t duration = _sleepDuration;
+#if CANBUS_ENABLE_SCHEDULER
+    // Not past the next scheduled request
+    unsigned long now = millis();
+    for (uint8_t i = 0; i < CANBUS_MAX_SCHEDULED_PIDS; i++) {
+        if (_schedule[i].pid == 0) {
+            continue;
+        }
+        long until = (long)(_schedule[i].nextDue - now);
+        if (until <= 0) {
+            return; // due (ie: waiting for the request budget); stay up to send it
+        }
+        if ((unsigned long)until < duration) {
+            duration = until;
+        }
+    }
+#endif
+    sleep(duration);
+    _awakeSince = millis();
+}
+
+#endif // ARDUINO && CANBUS_ENABLE_LOW_POWER
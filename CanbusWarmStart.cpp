@@ -0,0 +1,102 @@
+// Warm start for the Canbus library - by corbin dunn
+// www.corbinstreehouse.com
+//
+// Keeps what it took to reach the BMS (bus speed, request and response IDs, cell count) in the
+// EEPROM, so the next boot can go straight to reading the pack instead of listening for the speed.
+
+#include "CanbusConfig.h"
+
+#if defined(ARDUINO) && CANBUS_ENABLE_WARM_START
+
+#include <stddef.h>
+#include <avr/eeprom.h>
+#include <util/crc16.h>
+
+#include "Canbus.h"
+#include "elithion_defs.h"
+
+#define CONFIG_VERSION 1 // bump when the layout changes, so old records are ignored
+
+// The record, little endian:
+//   0 version
+//   1 CanSpeed
+//   2 request ID, uint16
+//   4 response ID, uint16
+//   6 number of cells, 0 if unknown
+//   7 CRC-16/XMODEM of bytes 0-6 from 0xFFFF, uint16
+#define CONFIG_SIZE 9
+#define CONFIG_CRC_OFFSET 7
+
+static uint16_t configCrc(const uint8_t *record) {
+    uint16_t crc = 0xFFFF;
+    for (uint8_t i = 0; i < CONFIG_CRC_OFFSET; i++) {
+        crc = _crc_xmodem_update(crc, record[i]);
+    }
+    return crc;
+}
+
+// One request, which also refreshes the cell count
+bool CanbusClass::bmsAnswers() {
+    const uint8_t *value = requestElithionValue(ELITHION_PID_CELL_COUNT, 0);
+    if (value == NULL) {
+        return false;
+    }
+#if CANBUS_ENABLE_PACK_VALUES
+    _numberOfCells = value[1];
+#endif
+    releaseFrame();
+    return true;
+}
+
+bool CanbusClass::initWarm(uint16_t windowMs) {
+    uint16_t requestId = _requestId;
+    uint16_t responseId = _responseId;
+    // Listen only can't send the check; a valid record, or a speed heard on the bus, has to do
+    bool listenOnly = _mode == CanbusModeListenOnly;
+    
+    uint8_t record[CONFIG_SIZE];
+    eeprom_read_block(record, (const void *)CANBUS_CONFIG_EEPROM_ADDRESS, CONFIG_SIZE);
+    uint16_t crc = record[CONFIG_CRC_OFFSET] | (record[CONFIG_CRC_OFFSET + 1] << 8);
+    CanSpeed canSpeed = (CanSpeed)record[1];
+    if (record[0] == CONFIG_VERSION && crc == configCrc(record) &&
+        (canSpeed == CanSpeed500 || canSpeed == CanSpeed250 || canSpeed == CanSpeed125)) {
+        setBmsIds(record[2] | (record[3] << 8), record[4] | (record[5] << 8));
+#if CANBUS_ENABLE_PACK_VALUES
+        _numberOfCells = record[6];
+#endif
+        if (init(canSpeed) && (listenOnly || bmsAnswers())) {
+            saveConfig(); // in case the cell count changed
+            return true;
+        }
+    }
+    
+    // Start over from what the sketch set up
+    setBmsIds(requestId, responseId); // which also forgets the saved cell count
+    bool heard = initAutoBaud(windowMs);
+    if (_initialized && (listenOnly ? heard : bmsAnswers())) {
+        saveConfig();
+        return true;
+    }
+    return false;
+}
+
+void CanbusClass::saveConfig() {
+    uint8_t record[CONFIG_SIZE];
+    record[0] = CONFIG_VERSION;
+    record[1] = _canSpeed;
+    record[2] = _requestId;
+    record[3] = _requestId >> 8;
+    record[4] = _responseId;
+    record[5] = _responseId >> 8;
+#if CANBUS_ENABLE_PACK_VALUES
+    record[6] = _numberOfCells;
+#else
+    record[6] = 0;
+#endif
+    uint16_t crc = configCrc(record);
+    record[CONFIG_CRC_OFFSET] = crc;
+    record[CONFIG_CRC_OFFSET + 1] = crc >> 8;
+    eeprom_update_block(record, (void *)CANBUS_CONFIG_EEPROM_ADDRESS, CONFIG_SIZE);
+}
+
+#endif
@@ -0,0 +1,165 @@
+// Incremental cell voltage statistics for the elithion BMS - by corbin dunn
+// www.corbinstreehouse.com
+
+#include "CellStatistics.h"
+
+#include <string.h>
+
+#define ENCODED_TO_MILLIVOLTS(v) (2000 + 10 * (uint16_t)(v))
+
+static uint16_t isqrt(uint32_t v) {
+    uint32_t result = 0;
+    uint32_t bit = 1UL << 30;
+    while (bit > v) {
+        bit >>= 2;
+    }
+    while (bit != 0) {
+        if (v >= result + bit) {
+            v -= result + bit;
+            result = (result >> 1) + bit;
+        } else {
+            result >>= 1;
+        }
+        bit >>= 2;
+    }
+    return result;
+}
+
+CellStatistics::CellStatistics() {
+    reset();
+}
+
+void CellStatistics::reset() {
+    memset(_seen, 0, sizeof(_seen));
+    _count = 0;
+    _sum = 0;
+    _sumOfSquares = 0;
+    _maxCell = CELL_STATISTICS_NO_CELL;
+    _weakCount = 0;
+}
+
+void CellStatistics::removeWeakCell(uint8_t cell) {
+    for (uint8_t i = 0; i < _weakCount; i++) {
+        if (_weakCells[i] == cell) {
+            _weakCount--;
+            memmove(&_weakCells[i], &_weakCells[i + 1], _weakCount - i);
+            return;
+        }
+    }
+}
+
+// Assumes the cell isn't already in the list
+void CellStatistics::insertWeakCell(uint8_t cell) {
+    uint8_t value = _values[cell];
+    uint8_t i = _weakCount;
+    // ties go to the lower cell number, same as a scan would
+    while (i > 0 && (_values[_weakCells[i - 1]] > value || (_values[_weakCells[i - 1]] == value && _weakCells[i - 1] > cell))) {
+        i--;
+    }
+    if (i >= CELL_STATISTICS_WEAK_CELLS) {
+        return; // not weak enough
+    }
+    uint8_t moving = _weakCount < CELL_STATISTICS_WEAK_CELLS ? _weakCount - i : CELL_STATISTICS_WEAK_CELLS - 1 - i;
+    memmove(&_weakCells[i + 1], &_weakCells[i], moving);
+    _weakCells[i] = cell;
+    if (_weakCount < CELL_STATISTICS_WEAK_CELLS) {
+        _weakCount++;
+    }
+}
+
+// A weak cell came back up, so something outside the list may belong in it now. This only
+// looks at the stored readings; nothing is re-read from the BMS.
+void CellStatistics::refillWeakCells() {
+    _weakCount = 0;
+    for (uint8_t cell = 0; cell < CELL_STATISTICS_MAX_CELLS; cell++) {
+        if (hasReading(cell)) {
+            insertWeakCell(cell);
+        }
+    }
+}
+
+void CellStatistics::findMaxCell() {
+    _maxCell = CELL_STATISTICS_NO_CELL;
+    for (uint8_t cell = 0; cell < CELL_STATISTICS_MAX_CELLS; cell++) {
+        if (hasReading(cell) && (_maxCell == CELL_STATISTICS_NO_CELL || _values[cell] > _values[_maxCell])) {
+            _maxCell = cell;
+        }
+    }
+}
+
+void CellStatistics::update(uint8_t cell, uint8_t encodedVoltage) {
+    if (cell >= CELL_STATISTICS_MAX_CELLS) {
+        return;
+    }
+    uint8_t oldValue = 0;
+    if (hasReading(cell)) {
+        oldValue = _values[cell];
+        if (oldValue == encodedVoltage) {
+            return; // the common case; nothing changed
+        }
+        _sum -= oldValue;
+        _sumOfSquares -= (uint16_t)oldValue * oldValue;
+    } else {
+        _seen[cell >> 3] |= 1 << (cell & 7);
+        _count++;
+    }
+    _values[cell] = encodedVoltage;
+    _sum += encodedVoltage;
+    _sumOfSquares += (uint16_t)encodedVoltage * encodedVoltage;
+    
+    // Weak cell list (and so the min)
+    uint8_t weakCountBefore = _weakCount;
+    removeWeakCell(cell);
+    bool wasWeak = _weakCount != weakCountBefore;
+    if (wasWeak && encodedVoltage > oldValue && _count > _weakCount + 1) {
+        refillWeakCells();
+    } else {
+        insertWeakCell(cell);
+    }
+    
+    // Max
+    if (_maxCell == CELL_STATISTICS_NO_CELL || encodedVoltage > _values[_maxCell] || (encodedVoltage == _values[_maxCell] && cell < _maxCell)) {
+        _maxCell = cell;
+    } else if (cell == _maxCell && encodedVoltage < oldValue) {
+        findMaxCell();
+    }
+}
+
+uint16_t CellStatistics::getMinMillivolts() {
+    return _weakCount ? ENCODED_TO_MILLIVOLTS(_values[_weakCells[0]]) : 0;
+}
+
+uint16_t CellStatistics::getMaxMillivolts() {
+    return _maxCell != CELL_STATISTICS_NO_CELL ? ENCODED_TO_MILLIVOLTS(_values[_maxCell]) : 0;
+}
+
+uint16_t CellStatistics::getMeanMillivolts() {
+    if (_count == 0) {
+        return 0;
+    }
+    return 2000 + ((uint32_t)_sum * 10 + _count / 2) / _count;
+}
+
+uint16_t CellStatistics::getStandardDeviationMillivolts() {
+    if (_count == 0) {
+        return 0;
+    }
+    // n * sum(x^2) - sum(x)^2 is n^2 times the variance, in encoded units (10mV) squared
+    uint32_t scaledVariance = (uint32_t)_count * _sumOfSquares - (uint32_t)_sum * _sum;
+    // Scaled before the second division, with the first one's remainder kept, or spreads of a
+    // cell or two come out as 0; scaledVariance * 100 itself can overflow 32 bits.
+    uint32_t variance = (scaledVariance / _count * 100 + scaledVariance % _count * 100 / _count) / _count; // mV^2
+    uint16_t root = isqrt(variance);
+    if ((uint32_t)root * root + root < variance) {
+        root++; // round to nearest
+    }
+    return root;
+}
+
+int16_t CellStatistics::getDeviationMillivolts(uint8_t cell) {
+    if (cell >= CELL_STATISTICS_MAX_CELLS || !hasReading(cell)) {
+        return 0;
+    }
+    int32_t difference = (int32_t)_values[cell] * _count - _sum; // n times the deviation, encoded
+    return difference * 10 / _count;
+}
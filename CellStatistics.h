@@ -0,0 +1,64 @@
+// Incremental cell voltage statistics for the elithion BMS - by corbin dunn
+// www.corbinstreehouse.com
+//
+// Feed it the raw encoded cell readings (10mV steps above 2.0V, see
+// CanbusClass::getEncodedVoltageForCell) as they come in; everything is kept up to date in
+// integer math so balancing decisions don't need floats or a fresh pass over the pack.
+
+#ifndef CELL_STATISTICS_H
+#define CELL_STATISTICS_H
+
+#include <stdint.h>
+
+#ifndef CELL_STATISTICS_MAX_CELLS
+    #define CELL_STATISTICS_MAX_CELLS 64 // one byte of RAM per cell
+#endif
+
+#ifndef CELL_STATISTICS_WEAK_CELLS
+    #define CELL_STATISTICS_WEAK_CELLS 4 // how many of the lowest cells to track
+#endif
+
+#define CELL_STATISTICS_NO_CELL 0xFF
+
+class CellStatistics
+{
+private:
+    uint8_t _values[CELL_STATISTICS_MAX_CELLS]; // encoded
+    uint8_t _seen[(CELL_STATISTICS_MAX_CELLS + 7) / 8];
+    uint8_t _count; // cells with a reading
+    uint16_t _sum;
+    uint32_t _sumOfSquares;
+    uint8_t _maxCell;
+    uint8_t _weakCells[CELL_STATISTICS_WEAK_CELLS]; // lowest first; _weakCells[0] is the min
+    uint8_t _weakCount;
+    
+    bool hasReading(uint8_t cell) { return _seen[cell >> 3] & (1 << (cell & 7)); }
+    void removeWeakCell(uint8_t cell);
+    void insertWeakCell(uint8_t cell);
+    void refillWeakCells();
+    void findMaxCell();
+public:
+    CellStatistics();
+    void reset();
+    
+    // cell is 0 based, like the elithion PID. Readings for cells past CELL_STATISTICS_MAX_CELLS are ignored.
+    void update(uint8_t cell, uint8_t encodedVoltage);
+    
+    uint8_t getCellCount() { return _count; }
+    
+    // All voltages are in millivolts; everything returns 0 / CELL_STATISTICS_NO_CELL until there is a reading
+    uint16_t getMinMillivolts();
+    uint16_t getMaxMillivolts();
+    uint8_t getMinCell() { return _weakCount ? _weakCells[0] : CELL_STATISTICS_NO_CELL; }
+    uint8_t getMaxCell() { return _maxCell; }
+    uint16_t getSpreadMillivolts() { return getMaxMillivolts() - getMinMillivolts(); }
+    uint16_t getMeanMillivolts();
+    uint16_t getStandardDeviationMillivolts();
+    int16_t getDeviationMillivolts(uint8_t cell); // this cell minus the pack mean
+    
+    // The lowest cells, lowest first; index < getWeakCellCount()
+    uint8_t getWeakCellCount() { return _weakCount; }
+    uint8_t getWeakCell(uint8_t index) { return _weakCells[index]; }
+};
+
+#endif
@@ -0,0 +1,254 @@
+// Binary log of CAN frames and values to a block device - by corbin dunn
+// www.corbinstreehouse.com
+
+#include "FrameLogger.h"
+
+#include <string.h>
+
+#if defined(__AVR__)
+    #include <util/crc16.h>
+    #define crcUpdate _crc_xmodem_update // the same polynomial, unreflected
+#else
+static uint16_t crcUpdate(uint16_t crc, uint8_t data) {
+    crc ^= (uint16_t)data << 8;
+    for (uint8_t i = 0; i < 8; i++) {
+        crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+#endif
+
+#define MAGIC_OFFSET 0
+#define SEQUENCE_OFFSET 4
+#define LENGTH_OFFSET 8
+#define VERSION_OFFSET 10
+#define COUNT_OFFSET 11
+#define CRC_OFFSET 12
+
+static const uint8_t magic[4] = { 'C', 'A', 'N', 'L' };
+
+static void put16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    put16(p, v);
+    put16(p + 2, v >> 16);
+}
+
+static uint16_t get16(const uint8_t *p) {
+    return p[0] | ((uint16_t)p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+// The CRC of the whole block, with its own two bytes counted as 0
+static uint16_t segmentCrc(const uint8_t *block) {
+    uint16_t crc = 0xFFFF;
+    for (uint16_t i = 0; i < FRAME_LOGGER_BLOCK_SIZE; i++) {
+        crc = crcUpdate(crc, (i == CRC_OFFSET || i == CRC_OFFSET + 1) ? 0 : block[i]);
+    }
+    return crc;
+}
+
+FrameLogger::FrameLogger() {
+    _device = NULL;
+    _firstBlock = 0;
+    _blockCount = 0;
+    _nextBlock = 0;
+    _sequence = 0;
+    _used = FRAME_LOGGER_HEADER_SIZE;
+    _recordCount = 0;
+    _active = 0;
+    _full = false;
+    _droppedRecords = 0;
+    _writeErrors = 0;
+}
+
+bool FrameLogger::readSequence(uint32_t block, uint8_t *data, uint32_t *sequence) {
+    uint16_t length;
+    return _device->readBlock(_firstBlock + block, data) && checkSegment(data, sequence, &length);
+}
+
+bool FrameLogger::begin(const FrameLoggerDevice *device, uint32_t firstBlock, uint32_t blockCount) {
+    _device = NULL;
+    if (device == NULL || blockCount < 2) {
+        return false;
+    }
+    _device = device;
+    _firstBlock = firstBlock;
+    _blockCount = blockCount;
+
+    // Segments are written in order and wrap, so the blocks from 0 up to the newest hold
+    // consecutive sequence numbers, and whatever follows (older segments, a torn block, or
+    // nothing) breaks the run. Binary search for the end of that run.
+    uint8_t *scratch = _buffers[0];
+    uint32_t first;
+    if (readSequence(0, scratch, &first)) {
+        uint32_t low = 0; // known to be in the run
+        uint32_t high = blockCount; // known not to be
+        while (high - low > 1) {
+            uint32_t middle = low + (high - low) / 2;
+            uint32_t sequence;
+            if (readSequence(middle, scratch, &sequence) && sequence == first + middle) {
+                low = middle;
+            } else {
+                high = middle;
+            }
+        }
+        _nextBlock = high == blockCount ? 0 : high;
+        _sequence = first + low + 1;
+    } else {
+        // Block 0 is empty or torn; if the log has wrapped the newest is at the end
+        uint32_t last;
+        _nextBlock = 0;
+        _sequence = readSequence(blockCount - 1, scratch, &last) ? last + 1 : 0;
+    }
+
+    memset(_buffers, 0, sizeof(_buffers));
+    _used = FRAME_LOGGER_HEADER_SIZE;
+    _recordCount = 0;
+    _active = 0;
+    _full = false;
+    return true;
+}
+
+// Room for a record in the active segment, or NULL if it has to be dropped
+uint8_t *FrameLogger::reserveRecord(uint8_t type, uint8_t length, uint32_t timestamp) {
+    if (_device == NULL) {
+        return NULL;
+    }
+    if (_used + length > FRAME_LOGGER_BLOCK_SIZE || _recordCount == 0xFF) {
+        if (_full) {
+            // The card hasn't kept up
+            _droppedRecords++;
+            return NULL;
+        }
+        sealActive();
+    }
+    uint8_t *record = &_buffers[_active][_used];
+    _used += length;
+    _recordCount++;
+    record[0] = type;
+    put32(record + 1, timestamp);
+    return record;
+}
+
+// Hands the active segment to service() and starts filling the other buffer
+void FrameLogger::sealActive() {
+    uint8_t *block = _buffers[_active];
+    memcpy(block + MAGIC_OFFSET, magic, sizeof(magic));
+    put32(block + SEQUENCE_OFFSET, _sequence);
+    put16(block + LENGTH_OFFSET, _used - FRAME_LOGGER_HEADER_SIZE);
+    block[VERSION_OFFSET] = FRAME_LOGGER_VERSION;
+    block[COUNT_OFFSET] = _recordCount;
+    _sequence++;
+    _full = true;
+    _active ^= 1;
+    _used = FRAME_LOGGER_HEADER_SIZE;
+    _recordCount = 0;
+}
+
+bool FrameLogger::logFrame(uint32_t timestamp, const tCAN *message, bool sent) {
+    uint8_t length = message->header.length > 8 ? 8 : message->header.length;
+    uint8_t *record = reserveRecord(((sent ? FrameLoggerSent : FrameLoggerReceived) << 4) | length, 7 + length, timestamp);
+    if (record == NULL) {
+        return false;
+    }
+    put16(record + 5, (message->id & 0x7FFF) | (message->header.rtr ? 0x8000 : 0));
+    memcpy(record + 7, message->data, length);
+    return true;
+}
+
+bool FrameLogger::logValue(uint32_t timestamp, uint8_t key, int32_t value) {
+    uint8_t *record = reserveRecord(FrameLoggerValue << 4, 10, timestamp);
+    if (record == NULL) {
+        return false;
+    }
+    record[5] = key;
+    put32(record + 6, value);
+    return true;
+}
+
+bool FrameLogger::writeFull() {
+    uint8_t *block = _buffers[_active ^ 1];
+    put16(block + CRC_OFFSET, segmentCrc(block));
+    if (!_device->writeBlock(_firstBlock + _nextBlock, block)) {
+        _writeErrors++;
+        return false; // try again next time; meanwhile the active buffer keeps filling
+    }
+    _nextBlock = _nextBlock + 1 == _blockCount ? 0 : _nextBlock + 1;
+    memset(block, 0, FRAME_LOGGER_BLOCK_SIZE); // so the unused end of the next segment is 0
+    _full = false;
+    return true;
+}
+
+void FrameLogger::service() {
+    if (_full) {
+        writeFull();
+    }
+}
+
+bool FrameLogger::flush() {
+    if (_device == NULL || (_full && !writeFull())) {
+        return false;
+    }
+    if (_recordCount == 0) {
+        return true;
+    }
+    sealActive();
+    return writeFull();
+}
+
+bool FrameLogger::checkSegment(const uint8_t *block, uint32_t *sequence, uint16_t *length) {
+    if (memcmp(block + MAGIC_OFFSET, magic, sizeof(magic)) != 0 || block[VERSION_OFFSET] != FRAME_LOGGER_VERSION) {
+        return false;
+    }
+    *length = get16(block + LENGTH_OFFSET);
+    if (*length > FRAME_LOGGER_BLOCK_SIZE - FRAME_LOGGER_HEADER_SIZE || get16(block + CRC_OFFSET) != segmentCrc(block)) {
+        return false;
+    }
+    *sequence = get32(block + SEQUENCE_OFFSET);
+    return true;
+}
+
+bool FrameLogger::readRecord(const uint8_t *block, uint16_t length, uint16_t *offset, FrameLoggerRecord *record) {
+    uint16_t end = FRAME_LOGGER_HEADER_SIZE + length;
+    uint16_t at = *offset;
+    if (at + 5 > end) {
+        return false;
+    }
+    const uint8_t *p = block + at;
+    record->type = (FrameLoggerRecordType)(p[0] >> 4);
+    record->timestamp = get32(p + 1);
+    switch (record->type) {
+        case FrameLoggerReceived:
+        case FrameLoggerSent: {
+            uint8_t dlc = p[0] & 0x0F;
+            if (dlc > 8 || at + 7 + dlc > end) {
+                return false;
+            }
+            uint16_t id = get16(p + 5);
+            memset(&record->message, 0, sizeof(record->message));
+            record->message.id = id & 0x7FFF;
+            record->message.header.rtr = (id & 0x8000) ? 1 : 0;
+            record->message.header.length = dlc;
+            memcpy(record->message.data, p + 7, dlc);
+            *offset = at + 7 + dlc;
+            return true;
+        }
+        case FrameLoggerValue:
+            if (at + 10 > end) {
+                return false;
+            }
+            record->key = p[5];
+            record->value = (int32_t)get32(p + 6);
+            *offset = at + 10;
+            return true;
+        default:
+            return false;
+    }
+}
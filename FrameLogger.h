@@ -0,0 +1,109 @@
+// Binary log of CAN frames and values to a block device - by corbin dunn
+// www.corbinstreehouse.com
+//
+// Records are packed into 512 byte segments, one per block. Each segment has a header with a
+// sequence number and a CRC, and records never span segments, so every block can be checked
+// and read on its own: a block torn by a power loss fails its CRC and costs only the records
+// in it. The log wraps around its region, overwriting the oldest segments.
+//
+// Logging only copies the record into the segment being filled. When it is full the other
+// buffer takes over and service() (from loop()) writes the full one, so receiving frames never
+// waits on the card. If the card falls so far behind that both buffers are full, records are
+// dropped and counted rather than blocking.
+//
+// Segment layout (multi byte fields are little endian):
+//   0  magic "CANL"
+//   4  sequence, uint32; one more than the segment written before it
+//   8  payload length, uint16
+//   10 FRAME_LOGGER_VERSION
+//   11 record count
+//   12 CRC-16/CCITT-FALSE of the whole block with these two bytes taken as 0, uint16
+//   14 reserved, 0
+//   16 records, then 0 to the end of the block
+// Records start with a byte holding the type in the high nibble, then a uint32 timestamp in ms:
+//   FrameLoggerReceived / FrameLoggerSent: the DLC in the low nibble, then the id as a uint16
+//   (with bit 15 set for a remote frame) and DLC data bytes; 7 to 15 bytes
+//   FrameLoggerValue: a key byte and an int32 value; 10 bytes
+
+#ifndef FRAME_LOGGER_H
+#define FRAME_LOGGER_H
+
+#include <stdint.h>
+
+#include "mcp2515.h"
+
+#define FRAME_LOGGER_BLOCK_SIZE 512
+#define FRAME_LOGGER_HEADER_SIZE 16
+#define FRAME_LOGGER_VERSION 1
+
+typedef enum {
+    FrameLoggerReceived = 1,
+    FrameLoggerSent = 2,
+    FrameLoggerValue = 3,
+} FrameLoggerRecordType;
+
+// Where the log goes. Blocks are FRAME_LOGGER_BLOCK_SIZE bytes; an SD card's raw blocks work
+// directly. The functions return non zero on success.
+typedef struct {
+    uint8_t (*readBlock)(uint32_t block, uint8_t *data);
+    uint8_t (*writeBlock)(uint32_t block, const uint8_t *data);
+} FrameLoggerDevice;
+
+// A decoded record, for readers
+typedef struct {
+    FrameLoggerRecordType type;
+    uint32_t timestamp;
+    tCAN message; // frames
+    uint8_t key; // values
+    int32_t value;
+} FrameLoggerRecord;
+
+class FrameLogger
+{
+private:
+    const FrameLoggerDevice *_device;
+    uint32_t _firstBlock;
+    uint32_t _blockCount;
+    uint32_t _nextBlock; // relative to _firstBlock
+    uint32_t _sequence; // of the segment being filled
+    uint8_t _buffers[2][FRAME_LOGGER_BLOCK_SIZE];
+    uint16_t _used; // bytes of the active buffer, header included
+    uint8_t _recordCount;
+    uint8_t _active; // the buffer being filled
+    bool _full; // the other buffer is waiting for service()
+    uint32_t _droppedRecords;
+    uint32_t _writeErrors;
+
+    uint8_t *reserveRecord(uint8_t type, uint8_t length, uint32_t timestamp);
+    void sealActive();
+    bool writeFull();
+    bool readSequence(uint32_t block, uint8_t *data, uint32_t *sequence);
+public:
+    FrameLogger();
+
+    // Logs to blocks firstBlock to firstBlock + blockCount - 1, carrying on after the newest
+    // valid segment already there (so a reboot or power loss appends instead of starting over).
+    // The device must outlive the logger. Returns false if the region is too small or unreadable.
+    bool begin(const FrameLoggerDevice *device, uint32_t firstBlock, uint32_t blockCount);
+
+    // Return false when the record was dropped
+    bool logFrame(uint32_t timestamp, const tCAN *message, bool sent);
+    bool logValue(uint32_t timestamp, uint8_t key, int32_t value);
+
+    // Writes the full segment if there is one; call every loop
+    void service();
+    // Writes everything, including the partly filled segment (which then takes a whole block);
+    // ie: before sleeping or on a shutdown warning
+    bool flush();
+
+    uint32_t getSequence() { return _sequence; }
+    uint32_t getDroppedRecords() { return _droppedRecords; }
+    uint32_t getWriteErrors() { return _writeErrors; }
+
+    // For readers. checkSegment() returns false unless the block holds an intact segment; if it
+    // does, readRecord() walks its records from *offset (start at FRAME_LOGGER_HEADER_SIZE).
+    static bool checkSegment(const uint8_t *block, uint32_t *sequence, uint16_t *length);
+    static bool readRecord(const uint8_t *block, uint16_t length, uint16_t *offset, FrameLoggerRecord *record);
+};
+
+#endif
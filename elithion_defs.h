@@ -0,0 +1,37 @@
+// IDs and PIDs of the elithion BMS, shared by the Canbus library's sources - by corbin dunn
+// www.corbinstreehouse.com
+
+#ifndef ELITHION_DEFS_H
+#define ELITHION_DEFS_H
+
+// http://lithiumate.elithion.com/php/menu_setup.php#Standard_output_messages
+// TODO: this are all configurable and would be nice to set for the class
+#define ELITHION_CAN_ID 0x620
+
+
+// The defaults; see CanbusClass::setBmsIds()
+#define ELITHION_PID_REQUEST 0x0745
+#define ELITHION_PID_RESPONSE (ELITHION_PID_REQUEST + 0x08) // 0x074D // The response ID is 08h more than the request ID
+//Data length is 8 data bytes regardless of whether sme or all bytes are actually used (unused bytes are set at 0)
+// PIDs: http://lithiumate.elithion.com/xls/Lithiumate_PIDs.xls
+// EEPROM data that can be controlled: http://lithiumate.elithion.com/xls/eeprom_data.xls
+
+// TODOO: maybe make these tables in memory instead of commands to save space? 
+// Pack messages
+#define ELITHION_PID_MODE_DEFAULT 0x10
+
+#define ELITHION_PID_PACK_SOC 0x50
+#define ELITHION_PID_PACK_CAPACITY 0x51
+#define ELITHION_PID_PACK_DOD 0x52
+#define ELITHION_PID_PACK_POWER 0x53
+#define ELITHION_PID_PACK_ENERGY_IN 0x54
+#define ELITHION_PID_PACK_ENERGY_OUT 0x55
+#define ELITHION_PID_PACK_SOH 0x56
+
+#define ELITHION_PID_FAULT 0x62
+
+#define ELITHION_PID_CELL_COUNT 0x40
+
+#define ELITHION_PID_RESPONSE_MODE_DEFAULT 0x50
+
+#endif // ELITHION_DEFS_H
@@ -0,0 +1,329 @@
+// Batch versions of the Elithion value conversions in Canbus.cpp, for host side analysis.
+// www.corbinstreehouse.com
+
+#include "CanbusBatch.h"
+
+#include <math.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #define CANBUS_BATCH_X86 1
+    #include <immintrin.h>
+#else
+    #define CANBUS_BATCH_X86 0
+#endif
+
+// The exact per value formulas from Canbus.cpp
+static inline float cellVoltage(uint8_t v) {
+    return 2.0 + ((float)v)*10.0/1000.0;
+}
+
+static inline float tenths(int16_t v) {
+    return v * 100.0 / 1000.0;
+}
+
+static inline int8_t percent255(uint8_t v) {
+    return round(100.0*(float)(v)/255.0);
+}
+
+// ----------------------------------------------------------------------------
+// Scalar
+
+static void decodeCellVoltagesScalar(const uint8_t *encoded, float *volts, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        volts[i] = cellVoltage(encoded[i]);
+    }
+}
+
+static void snapshotScalar(const uint8_t *encoded, float *volts, size_t count, uint8_t *minValue, uint8_t *maxValue, uint64_t *sum) {
+    uint8_t lo = *minValue, hi = *maxValue;
+    uint64_t s = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint8_t v = encoded[i];
+        if (v < lo) lo = v;
+        if (v > hi) hi = v;
+        s += v;
+        if (volts) volts[i] = cellVoltage(v);
+    }
+    *minValue = lo;
+    *maxValue = hi;
+    *sum += s;
+}
+
+static void decodeTenthsScalar(const int16_t *raw, float *values, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        values[i] = tenths(raw[i]);
+    }
+}
+
+static void decodePercent255Scalar(const uint8_t *raw, int8_t *percent, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        percent[i] = percent255(raw[i]);
+    }
+}
+
+#if CANBUS_BATCH_X86
+
+// ----------------------------------------------------------------------------
+// SSE2
+
+// 4 int32 to 4 floats of (offset + v * mul / div), done in double like the scalar code
+static inline __m128 scaleSSE2(__m128i v, double mul, double div, double offset) {
+    __m128d m = _mm_set1_pd(mul), d = _mm_set1_pd(div), o = _mm_set1_pd(offset);
+    __m128d lo = _mm_cvtepi32_pd(v);
+    __m128d hi = _mm_cvtepi32_pd(_mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    lo = _mm_add_pd(_mm_div_pd(_mm_mul_pd(lo, m), d), o);
+    hi = _mm_add_pd(_mm_div_pd(_mm_mul_pd(hi, m), d), o);
+    return _mm_movelh_ps(_mm_cvtpd_ps(lo), _mm_cvtpd_ps(hi));
+}
+
+static inline void cellVoltages16SSE2(__m128i bytes, float *volts) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i lo16 = _mm_unpacklo_epi8(bytes, zero);
+    __m128i hi16 = _mm_unpackhi_epi8(bytes, zero);
+    _mm_storeu_ps(volts + 0, scaleSSE2(_mm_unpacklo_epi16(lo16, zero), 10.0, 1000.0, 2.0));
+    _mm_storeu_ps(volts + 4, scaleSSE2(_mm_unpackhi_epi16(lo16, zero), 10.0, 1000.0, 2.0));
+    _mm_storeu_ps(volts + 8, scaleSSE2(_mm_unpacklo_epi16(hi16, zero), 10.0, 1000.0, 2.0));
+    _mm_storeu_ps(volts + 12, scaleSSE2(_mm_unpackhi_epi16(hi16, zero), 10.0, 1000.0, 2.0));
+}
+
+static void decodeCellVoltagesSSE2(const uint8_t *encoded, float *volts, size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        cellVoltages16SSE2(_mm_loadu_si128((const __m128i *)(encoded + i)), volts + i);
+    }
+    decodeCellVoltagesScalar(encoded + i, volts + i, count - i);
+}
+
+static uint8_t horizontalMinSSE2(__m128i v) {
+    v = _mm_min_epu8(v, _mm_srli_si128(v, 8));
+    v = _mm_min_epu8(v, _mm_srli_si128(v, 4));
+    v = _mm_min_epu8(v, _mm_srli_si128(v, 2));
+    v = _mm_min_epu8(v, _mm_srli_si128(v, 1));
+    return _mm_cvtsi128_si32(v) & 0xFF;
+}
+
+static uint8_t horizontalMaxSSE2(__m128i v) {
+    v = _mm_max_epu8(v, _mm_srli_si128(v, 8));
+    v = _mm_max_epu8(v, _mm_srli_si128(v, 4));
+    v = _mm_max_epu8(v, _mm_srli_si128(v, 2));
+    v = _mm_max_epu8(v, _mm_srli_si128(v, 1));
+    return _mm_cvtsi128_si32(v) & 0xFF;
+}
+
+static void snapshotSSE2(const uint8_t *encoded, float *volts, size_t count, uint8_t *minValue, uint8_t *maxValue, uint64_t *sum) {
+    __m128i lo = _mm_set1_epi8((char)*minValue);
+    __m128i hi = _mm_set1_epi8((char)*maxValue);
+    __m128i sums = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(encoded + i));
+        lo = _mm_min_epu8(lo, bytes);
+        hi = _mm_max_epu8(hi, bytes);
+        sums = _mm_add_epi64(sums, _mm_sad_epu8(bytes, _mm_setzero_si128()));
+        if (volts) cellVoltages16SSE2(bytes, volts + i);
+    }
+    *minValue = horizontalMinSSE2(lo);
+    *maxValue = horizontalMaxSSE2(hi);
+    *sum += (uint64_t)_mm_cvtsi128_si64(sums) + (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(sums, sums));
+    snapshotScalar(encoded + i, volts ? volts + i : NULL, count - i, minValue, maxValue, sum);
+}
+
+static void decodeTenthsSSE2(const int16_t *raw, float *values, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(raw + i));
+        // sign extend the 16 bit values to 32 bits
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+        _mm_storeu_ps(values + i, scaleSSE2(lo, 100.0, 1000.0, 0.0));
+        _mm_storeu_ps(values + i + 4, scaleSSE2(hi, 100.0, 1000.0, 0.0));
+    }
+    decodeTenthsScalar(raw + i, values + i, count - i);
+}
+
+// (200v + 255) / 510 for 8 uint16 lanes; the numerator fits in 16 bits and the division is
+// done as a multiply by the rounded up reciprocal, exact for numerators below 2^16
+static inline __m128i percent255x8SSE2(__m128i v) {
+    __m128i n = _mm_add_epi16(_mm_mullo_epi16(v, _mm_set1_epi16(200)), _mm_set1_epi16(255));
+    // n / 510 == (n >> 1) / 255 == ((n >> 1) * 0x8081) >> 23
+    __m128i half = _mm_srli_epi16(n, 1);
+    return _mm_srli_epi16(_mm_mulhi_epu16(half, _mm_set1_epi16((short)0x8081)), 7);
+}
+
+static void decodePercent255SSE2(const uint8_t *raw, int8_t *percent, size_t count) {
+    size_t i = 0;
+    __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= count; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(raw + i));
+        __m128i lo = percent255x8SSE2(_mm_unpacklo_epi8(bytes, zero));
+        __m128i hi = percent255x8SSE2(_mm_unpackhi_epi8(bytes, zero));
+        _mm_storeu_si128((__m128i *)(percent + i), _mm_packus_epi16(lo, hi));
+    }
+    decodePercent255Scalar(raw + i, percent + i, count - i);
+}
+
+// ----------------------------------------------------------------------------
+// AVX2
+
+__attribute__((target("avx2")))
+static inline __m256 scaleAVX2(__m256i v, double mul, double div, double offset) {
+    __m256d m = _mm256_set1_pd(mul), d = _mm256_set1_pd(div), o = _mm256_set1_pd(offset);
+    __m256d lo = _mm256_cvtepi32_pd(_mm256_castsi256_si128(v));
+    __m256d hi = _mm256_cvtepi32_pd(_mm256_extracti128_si256(v, 1));
+    lo = _mm256_add_pd(_mm256_div_pd(_mm256_mul_pd(lo, m), d), o);
+    hi = _mm256_add_pd(_mm256_div_pd(_mm256_mul_pd(hi, m), d), o);
+    return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm256_cvtpd_ps(lo)), _mm256_cvtpd_ps(hi), 1);
+}
+
+__attribute__((target("avx2")))
+static inline void cellVoltages16AVX2(__m128i bytes, float *volts) {
+    _mm256_storeu_ps(volts, scaleAVX2(_mm256_cvtepu8_epi32(bytes), 10.0, 1000.0, 2.0));
+    _mm256_storeu_ps(volts + 8, scaleAVX2(_mm256_cvtepu8_epi32(_mm_srli_si128(bytes, 8)), 10.0, 1000.0, 2.0));
+}
+
+__attribute__((target("avx2")))
+static void decodeCellVoltagesAVX2(const uint8_t *encoded, float *volts, size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        cellVoltages16AVX2(_mm_loadu_si128((const __m128i *)(encoded + i)), volts + i);
+    }
+    decodeCellVoltagesScalar(encoded + i, volts + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void snapshotAVX2(const uint8_t *encoded, float *volts, size_t count, uint8_t *minValue, uint8_t *maxValue, uint64_t *sum) {
+    __m256i lo = _mm256_set1_epi8((char)*minValue);
+    __m256i hi = _mm256_set1_epi8((char)*maxValue);
+    __m256i sums = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *)(encoded + i));
+        lo = _mm256_min_epu8(lo, bytes);
+        hi = _mm256_max_epu8(hi, bytes);
+        sums = _mm256_add_epi64(sums, _mm256_sad_epu8(bytes, _mm256_setzero_si256()));
+        if (volts) {
+            cellVoltages16AVX2(_mm256_castsi256_si128(bytes), volts + i);
+            cellVoltages16AVX2(_mm256_extracti128_si256(bytes, 1), volts + i + 16);
+        }
+    }
+    __m128i lo128 = _mm_min_epu8(_mm256_castsi256_si128(lo), _mm256_extracti128_si256(lo, 1));
+    __m128i hi128 = _mm_max_epu8(_mm256_castsi256_si128(hi), _mm256_extracti128_si256(hi, 1));
+    __m128i s = _mm_add_epi64(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+    // Finish a half vector here too; handing off to the SSE2 code would cost an AVX/SSE transition
+    if (i + 16 <= count) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(encoded + i));
+        lo128 = _mm_min_epu8(lo128, bytes);
+        hi128 = _mm_max_epu8(hi128, bytes);
+        s = _mm_add_epi64(s, _mm_sad_epu8(bytes, _mm_setzero_si128()));
+        if (volts) cellVoltages16AVX2(bytes, volts + i);
+        i += 16;
+    }
+    *minValue = horizontalMinSSE2(lo128);
+    *maxValue = horizontalMaxSSE2(hi128);
+    *sum += (uint64_t)_mm_cvtsi128_si64(s) + (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(s, s));
+    snapshotScalar(encoded + i, volts ? volts + i : NULL, count - i, minValue, maxValue, sum);
+}
+
+__attribute__((target("avx2")))
+static void decodeTenthsAVX2(const int16_t *raw, float *values, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i v = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(raw + i)));
+        _mm256_storeu_ps(values + i, scaleAVX2(v, 100.0, 1000.0, 0.0));
+    }
+    decodeTenthsScalar(raw + i, values + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void decodePercent255AVX2(const uint8_t *raw, int8_t *percent, size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256i v = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(raw + i)));
+        __m256i n = _mm256_add_epi16(_mm256_mullo_epi16(v, _mm256_set1_epi16(200)), _mm256_set1_epi16(255));
+        __m256i p = _mm256_srli_epi16(_mm256_mulhi_epu16(_mm256_srli_epi16(n, 1), _mm256_set1_epi16((short)0x8081)), 7);
+        __m128i packed = _mm_packus_epi16(_mm256_castsi256_si128(p), _mm256_extracti128_si256(p, 1));
+        _mm_storeu_si128((__m128i *)(percent + i), packed);
+    }
+    decodePercent255Scalar(raw + i, percent + i, count - i);
+}
+
+#endif // CANBUS_BATCH_X86
+
+// ----------------------------------------------------------------------------
+// Dispatch
+
+static CanbusBatchImplementation bestImplementation() {
+#if CANBUS_BATCH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return CanbusBatchAVX2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return CanbusBatchSSE2;
+    }
+#endif
+    return CanbusBatchScalar;
+}
+
+static CanbusBatchImplementation implementation = bestImplementation();
+
+CanbusBatchImplementation canbusBatchImplementation() {
+    return implementation;
+}
+
+void canbusBatchSetImplementation(CanbusBatchImplementation newImplementation) {
+    CanbusBatchImplementation best = bestImplementation();
+    implementation = newImplementation > best ? best : newImplementation;
+}
+
+void canbusDecodeCellVoltages(const uint8_t *encoded, float *volts, size_t count) {
+    switch (implementation) {
+#if CANBUS_BATCH_X86
+        case CanbusBatchAVX2: decodeCellVoltagesAVX2(encoded, volts, count); break;
+        case CanbusBatchSSE2: decodeCellVoltagesSSE2(encoded, volts, count); break;
+#endif
+        default: decodeCellVoltagesScalar(encoded, volts, count); break;
+    }
+}
+
+CellSnapshotStats canbusDecodeCellSnapshot(const uint8_t *encoded, float *volts, size_t count) {
+    uint8_t minValue = 0xFF, maxValue = 0;
+    uint64_t sum = 0;
+    switch (implementation) {
+#if CANBUS_BATCH_X86
+        case CanbusBatchAVX2: snapshotAVX2(encoded, volts, count, &minValue, &maxValue, &sum); break;
+        case CanbusBatchSSE2: snapshotSSE2(encoded, volts, count, &minValue, &maxValue, &sum); break;
+#endif
+        default: snapshotScalar(encoded, volts, count, &minValue, &maxValue, &sum); break;
+    }
+    CellSnapshotStats stats;
+    stats.minVoltage = cellVoltage(minValue);
+    stats.maxVoltage = cellVoltage(maxValue);
+    stats.meanVoltage = 2.0 + ((double)sum / count) * 10.0 / 1000.0;
+    stats.spread = stats.maxVoltage - stats.minVoltage;
+    // memchr is vectorized too, and only walks up to the first hit
+    stats.minCell = (const uint8_t *)memchr(encoded, minValue, count) - encoded;
+    stats.maxCell = (const uint8_t *)memchr(encoded, maxValue, count) - encoded;
+    return stats;
+}
+
+void canbusDecodeTenths(const int16_t *raw, float *values, size_t count) {
+    switch (implementation) {
+#if CANBUS_BATCH_X86
+        case CanbusBatchAVX2: decodeTenthsAVX2(raw, values, count); break;
+        case CanbusBatchSSE2: decodeTenthsSSE2(raw, values, count); break;
+#endif
+        default: decodeTenthsScalar(raw, values, count); break;
+    }
+}
+
+void canbusDecodePercent255(const uint8_t *raw, int8_t *percent, size_t count) {
+    switch (implementation) {
+#if CANBUS_BATCH_X86
+        case CanbusBatchAVX2: decodePercent255AVX2(raw, percent, count); break;
+        case CanbusBatchSSE2: decodePercent255SSE2(raw, percent, count); break;
+#endif
+        default: decodePercent255Scalar(raw, percent, count); break;
+    }
+}
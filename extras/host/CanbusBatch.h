@@ -0,0 +1,47 @@
+// Batch versions of the Elithion value conversions in Canbus.cpp, for host side analysis.
+// www.corbinstreehouse.com
+//
+// Each function gives bit for bit the same result as the per value conversion in Canbus.cpp
+// (the formulas are evaluated in double and rounded to float the same way). SSE2 and AVX2
+// kernels are picked at runtime; anything else uses the scalar loop.
+
+#ifndef CANBUS_BATCH_H
+#define CANBUS_BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+    CanbusBatchScalar = 0,
+    CanbusBatchSSE2,
+    CanbusBatchAVX2,
+} CanbusBatchImplementation;
+
+typedef struct {
+    float minVoltage;
+    float maxVoltage;
+    float meanVoltage;
+    float spread; // max - min, in volts
+    size_t minCell; // index into the array; the first one wins on ties
+    size_t maxCell;
+} CellSnapshotStats;
+
+// The fastest implementation this CPU supports, unless overridden (ie: for benchmarking).
+// Setting one the CPU can't run falls back to the best one it can.
+CanbusBatchImplementation canbusBatchImplementation();
+void canbusBatchSetImplementation(CanbusBatchImplementation implementation);
+
+// 2.0V + 10mV * n, like CanbusClass::getVoltageForCell()
+void canbusDecodeCellVoltages(const uint8_t *encoded, float *volts, size_t count);
+
+// Decodes a pack snapshot and computes its statistics in the same pass. volts can be NULL if
+// only the statistics are wanted. count must be at least 1.
+CellSnapshotStats canbusDecodeCellSnapshot(const uint8_t *encoded, float *volts, size_t count);
+
+// Values in 100mA / 100mV units, like getPackCurrent() and getPackVoltage()
+void canbusDecodeTenths(const int16_t *raw, float *values, size_t count);
+
+// 0-255 to a rounded 0-100 percent, like getChargeLimitValue()
+void canbusDecodePercent255(const uint8_t *raw, int8_t *percent, size_t count);
+
+#endif
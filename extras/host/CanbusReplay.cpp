@@ -0,0 +1,288 @@
+// Replays candump logs through CanbusClass on a Linux host.
+// www.corbinstreehouse.com
+
+#include "CanbusReplay.h"
+#include "elithion_defs.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static CanbusReplay *activeReplay = NULL;
+
+static uint64_t wallMicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int hexDigit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Parses "(sec.usec)" and returns a pointer past it, or NULL
+static const char *parseTimestamp(const char *p, uint64_t *timestamp) {
+    while (*p == ' ' || *p == '\t') p++;
+    if (*p != '(') return NULL;
+    char *end;
+    unsigned long long seconds = strtoull(p + 1, &end, 10);
+    if (*end != '.') return NULL;
+    const char *fraction = end + 1;
+    unsigned long long micros = strtoull(fraction, &end, 10);
+    if (*end != ')') return NULL;
+    // candump always prints 6 digits but be forgiving
+    for (long digits = end - fraction; digits < 6; digits++) micros *= 10;
+    for (long digits = end - fraction; digits > 6; digits--) micros /= 10;
+    *timestamp = seconds * 1000000 + micros;
+    return end + 1;
+}
+
+// "74D#0350500045000000" or "123#R"
+static bool parseCompactFrame(const char *p, tCAN *message) {
+    const char *hash = strchr(p, '#');
+    if (hash == NULL || hash - p != 3) return false; // only standard 11 bit ids
+    uint16_t id = 0;
+    for (const char *c = p; c < hash; c++) {
+        int v = hexDigit(*c);
+        if (v < 0) return false;
+        id = (id << 4) | v;
+    }
+    message->id = id;
+    p = hash + 1;
+    if (*p == 'R') {
+        message->header.rtr = 1;
+        message->header.length = 0;
+        return true;
+    }
+    message->header.rtr = 0;
+    uint8_t length = 0;
+    while (hexDigit(p[0]) >= 0 && hexDigit(p[1]) >= 0) {
+        if (length == 8) return false;
+        message->data[length++] = (hexDigit(p[0]) << 4) | hexDigit(p[1]);
+        p += 2;
+    }
+    message->header.length = length;
+    return true;
+}
+
+// "74D   [8]  03 50 50 00 45 00 00 00"
+static bool parseSpacedFrame(const char *p, tCAN *message) {
+    char *end;
+    unsigned long id = strtoul(p, &end, 16);
+    if (end - p != 3) return false;
+    p = end;
+    while (*p == ' ') p++;
+    if (*p != '[') return false;
+    unsigned long length = strtoul(p + 1, &end, 10);
+    if (*end != ']' || length > 8) return false;
+    p = end + 1;
+    message->id = id;
+    message->header.length = length;
+    message->header.rtr = 0;
+    while (*p == ' ') p++;
+    if (strncmp(p, "remote", 6) == 0) {
+        message->header.rtr = 1;
+        return true;
+    }
+    for (unsigned long i = 0; i < length; i++) {
+        unsigned long v = strtoul(p, &end, 16);
+        if (end == p || v > 0xFF) return false;
+        message->data[i] = v;
+        p = end;
+    }
+    return true;
+}
+
+CanbusReplay::CanbusReplay() {
+    _next = 0;
+    _now = 0;
+    _wallStart = 0;
+    _speed = 0;
+    _requestsSent = 0;
+    _malformedLines = 0;
+    _responseId = ELITHION_PID_RESPONSE;
+}
+
+size_t CanbusReplay::load(FILE *file) {
+    char line[256];
+    uint64_t firstTimestamp = 0;
+    size_t loaded = 0;
+    while (fgets(line, sizeof(line), file)) {
+        uint64_t timestamp;
+        const char *p = parseTimestamp(line, &timestamp);
+        if (p == NULL) {
+            _malformedLines++;
+            continue;
+        }
+        // skip the interface name
+        while (*p == ' ' || *p == '\t') p++;
+        while (*p && *p != ' ' && *p != '\t') p++;
+        while (*p == ' ' || *p == '\t') p++;
+        
+        tCAN message;
+        memset(&message, 0, sizeof(message));
+        if (!parseCompactFrame(p, &message) && !parseSpacedFrame(p, &message)) {
+            _malformedLines++;
+            continue;
+        }
+        if (_frames.empty()) {
+            firstTimestamp = timestamp;
+        } else if (loaded == 0) {
+            // appending another log; keep it after what is already loaded
+            firstTimestamp = timestamp - _frames.back().timestamp;
+        }
+        addFrame(timestamp - firstTimestamp, message);
+        loaded++;
+    }
+    return loaded;
+}
+
+size_t CanbusReplay::load(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return 0;
+    }
+    size_t loaded = load(file);
+    fclose(file);
+    return loaded;
+}
+
+void CanbusReplay::addFrame(uint64_t timestampMicros, const tCAN &message) {
+    Frame frame;
+    frame.timestamp = timestampMicros;
+    frame.logged = message;
+    frame.message = message;
+    frame.claimed = false;
+    _frames.push_back(frame);
+}
+
+void CanbusReplay::rewind() {
+    for (size_t i = 0; i < _frames.size(); i++) {
+        _frames[i].message = _frames[i].logged;
+        _frames[i].claimed = false;
+    }
+    _next = 0;
+    _now = 0;
+    _wallStart = 0;
+    _requestsSent = 0;
+}
+
+void CanbusReplay::advanceClock() {
+    if (_speed > 0) {
+        uint64_t wall = wallMicros();
+        if (_wallStart == 0) {
+            _wallStart = wall;
+        }
+        _now = (uint64_t)((wall - _wallStart) * _speed);
+    }
+}
+
+bool CanbusReplay::isUnclaimedReply(const Frame &frame) const {
+    return !frame.claimed && frame.message.id == _responseId && frame.message.header.length >= 4 &&
+        frame.message.data[1] == ELITHION_PID_RESPONSE_MODE_DEFAULT;
+}
+
+// Gives the request the next reply to its PID that hasn't been handed out or claimed yet. It
+// takes the place (and time) of the first such reply of any PID, and the ones in between move
+// back a reply each; what isn't a reply keeps its place.
+void CanbusReplay::claimReply(const tCAN *request) {
+    size_t first = _frames.size();
+    for (size_t i = _next; i < _frames.size(); i++) {
+        if (!isUnclaimedReply(_frames[i])) {
+            continue;
+        }
+        if (first == _frames.size()) {
+            first = i;
+        }
+        const tCAN &reply = _frames[i].message;
+        if (reply.data[2] != request->data[2] || reply.data[3] != request->data[3]) {
+            continue;
+        }
+        tCAN wanted = reply;
+        size_t to = i;
+        for (size_t k = i; k-- > first; ) {
+            if (isUnclaimedReply(_frames[k])) {
+                _frames[to].message = _frames[k].message;
+                to = k;
+            }
+        }
+        _frames[first].message = wanted;
+        _frames[first].claimed = true;
+        return;
+    }
+}
+
+const CanbusDriver *CanbusReplay::driver() {
+    static const CanbusDriver replayDriver = {
+        driverInit,
+        driverCheckMessage,
+        driverGetMessage,
+        driverSendMessage,
+        driverBitModify,
+        driverMillis,
+        driverReadRegister,
+        NULL, // no hardware filter; CanbusClass checks the bitmap itself
+    };
+    activeReplay = this;
+    return &replayDriver;
+}
+
+uint8_t CanbusReplay::driverInit(uint8_t /* speed */) {
+    return activeReplay != NULL;
+}
+
+uint8_t CanbusReplay::driverCheckMessage(void) {
+    CanbusReplay *r = activeReplay;
+    r->advanceClock();
+    if (r->_next < r->_frames.size() && r->_frames[r->_next].timestamp <= r->_now) {
+        return true;
+    }
+    if (r->_speed > 0) {
+        // don't spin the CPU while waiting for the wall clock to catch up
+        usleep(100);
+    } else if (r->_next < r->_frames.size()) {
+        // Virtual time: jump straight to the next frame. The caller sees the same gap the
+        // device saw and times out if it was longer than its timeout.
+        r->_now = r->_frames[r->_next].timestamp;
+    } else {
+        // Out of frames; keep time moving so callers eventually time out
+        r->_now += 1000;
+    }
+    return false;
+}
+
+uint8_t CanbusReplay::driverGetMessage(tCAN *message) {
+    CanbusReplay *r = activeReplay;
+    if (r->_next >= r->_frames.size() || r->_frames[r->_next].timestamp > r->_now) {
+        return 0;
+    }
+    *message = r->_frames[r->_next].message;
+    r->_next++;
+    return 1;
+}
+
+uint8_t CanbusReplay::driverSendMessage(tCAN *message) {
+    activeReplay->_requestsSent++;
+    if (message->header.length >= 4) {
+        activeReplay->claimReply(message);
+    }
+    return 1; // the "buffer" it went into
+}
+
+void CanbusReplay::driverBitModify(uint8_t /* address */, uint8_t /* mask */, uint8_t /* data */) {
+    // nothing to configure
+}
+
+unsigned long CanbusReplay::driverMillis(void) {
+    CanbusReplay *r = activeReplay;
+    r->advanceClock();
+    return r->_now / 1000;
+}
+
+uint8_t CanbusReplay::driverReadRegister(uint8_t /* address */) {
+    return 0; // no error counters or flags in a log
+}
@@ -0,0 +1,81 @@
+// Replays candump logs through CanbusClass on a Linux host.
+// www.corbinstreehouse.com
+//
+// Build the library sources for the host along with this file, ie:
+//   g++ -O2 -I. -Iextras/host Canbus.cpp FrameLogger.cpp BusProfiler.cpp extras/host/CanbusReplay.cpp yourtool.cpp
+//
+// Frames from the log are handed out through the CanbusDriver receive functions in the order
+// they were recorded. Requests sent by the library are swallowed (and counted), and each one
+// picks its reply by PID: the next logged reply for that PID moves up to the time of the next
+// reply still to come, so a sketch that asks in a different order than the logged one still
+// gets its answers. The getters then match and decode them exactly as they would on the Arduino.
+//
+// Timing: with a speed of 0 (the default) the clock is virtual and only moves forward to the
+// timestamp of the next frame, so a replay runs as fast as the CPU allows and still times out
+// wherever the recorded gap is longer than the library's timeout. A speed of 1.0 paces frames
+// in real time, 10.0 ten times faster, etc.
+
+#ifndef CANBUS_REPLAY_H
+#define CANBUS_REPLAY_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+#include "Canbus.h"
+
+class CanbusReplay
+{
+private:
+    struct Frame {
+        uint64_t timestamp; // microseconds since the first frame in the log
+        tCAN logged;
+        tCAN message; // what is handed out; replies get reordered by claimReply()
+        bool claimed; // a request was sent for it
+    };
+    std::vector<Frame> _frames;
+    size_t _next;
+    uint64_t _now; // microseconds since the first frame
+    uint64_t _wallStart;
+    float _speed;
+    unsigned long _requestsSent;
+    unsigned long _malformedLines;
+    uint16_t _responseId;
+    
+    void advanceClock();
+    bool isUnclaimedReply(const Frame &frame) const;
+    void claimReply(const tCAN *request);
+    
+    // CanbusDriver entry points; they forward to the active replay
+    static uint8_t driverInit(uint8_t speed);
+    static uint8_t driverCheckMessage(void);
+    static uint8_t driverGetMessage(tCAN *message);
+    static uint8_t driverSendMessage(tCAN *message);
+    static void driverBitModify(uint8_t address, uint8_t mask, uint8_t data);
+    static unsigned long driverMillis(void);
+    static uint8_t driverReadRegister(uint8_t address);
+public:
+    CanbusReplay();
+    
+    // Reads a log written by "candump -l" or printed by "candump -ta"; extended and malformed
+    // lines are skipped. Returns the number of frames loaded.
+    size_t load(FILE *file);
+    size_t load(const char *path);
+    // Adds a single frame, ie: for building a replay from some other log format
+    void addFrame(uint64_t timestampMicros, const tCAN &message);
+    
+    void setSpeed(float speed) { _speed = speed; } // 0 = as fast as possible, 1.0 = original timing
+    // The ID the logged BMS replies are on, if the sketch calls CanbusClass::setBmsIds()
+    void setResponseId(uint16_t responseId) { _responseId = responseId; }
+    void rewind();
+    
+    // The driver to pass to CanbusClass::setDriver(); only one replay can be active at a time
+    const CanbusDriver *driver();
+    
+    size_t frameCount() const { return _frames.size(); }
+    size_t framesRemaining() const { return _frames.size() - _next; }
+    unsigned long requestsSent() const { return _requestsSent; }
+    unsigned long malformedLines() const { return _malformedLines; }
+};
+
+#endif
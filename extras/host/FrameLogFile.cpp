@@ -0,0 +1,82 @@
+// A FrameLoggerDevice backed by a plain file, for running FrameLogger on a Linux host.
+// www.corbinstreehouse.com
+
+#include "FrameLogFile.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static FrameLogFile *activeFile = NULL;
+
+FrameLogFile::FrameLogFile() {
+    _fd = -1;
+    _sync = false;
+    _blocksWritten = 0;
+}
+
+FrameLogFile::~FrameLogFile() {
+    close();
+}
+
+bool FrameLogFile::open(const char *path, bool readOnly) {
+    close();
+    _fd = ::open(path, readOnly ? O_RDONLY : O_RDWR | O_CREAT, 0644);
+    return _fd >= 0;
+}
+
+void FrameLogFile::close() {
+    if (_fd >= 0) {
+        ::close(_fd);
+        _fd = -1;
+    }
+    if (activeFile == this) {
+        activeFile = NULL;
+    }
+}
+
+const FrameLoggerDevice *FrameLogFile::device() {
+    static const FrameLoggerDevice fileDevice = {
+        deviceReadBlock,
+        deviceWriteBlock,
+    };
+    activeFile = this;
+    return &fileDevice;
+}
+
+uint32_t FrameLogFile::blockCount() {
+    struct stat st;
+    if (_fd < 0 || fstat(_fd, &st) != 0) {
+        return 0;
+    }
+    return st.st_size / FRAME_LOGGER_BLOCK_SIZE;
+}
+
+uint8_t FrameLogFile::deviceReadBlock(uint32_t block, uint8_t *data) {
+    FrameLogFile *f = activeFile;
+    if (f == NULL || f->_fd < 0) {
+        return 0;
+    }
+    ssize_t result = pread(f->_fd, data, FRAME_LOGGER_BLOCK_SIZE, (off_t)block * FRAME_LOGGER_BLOCK_SIZE);
+    if (result < 0) {
+        return 0;
+    }
+    memset(data + result, 0, FRAME_LOGGER_BLOCK_SIZE - result);
+    return 1;
+}
+
+uint8_t FrameLogFile::deviceWriteBlock(uint32_t block, const uint8_t *data) {
+    FrameLogFile *f = activeFile;
+    if (f == NULL || f->_fd < 0) {
+        return 0;
+    }
+    if (pwrite(f->_fd, data, FRAME_LOGGER_BLOCK_SIZE, (off_t)block * FRAME_LOGGER_BLOCK_SIZE) != FRAME_LOGGER_BLOCK_SIZE) {
+        return 0;
+    }
+    if (f->_sync && fdatasync(f->_fd) != 0) {
+        return 0;
+    }
+    f->_blocksWritten++;
+    return 1;
+}
@@ -0,0 +1,45 @@
+// A FrameLoggerDevice backed by a plain file, for running FrameLogger on a Linux host.
+// www.corbinstreehouse.com
+//
+// Build it with the library sources, ie:
+//   g++ -O2 -I. -Iextras/host FrameLogger.cpp extras/host/FrameLogFile.cpp yourtool.cpp
+//
+// Block n is at byte n * FRAME_LOGGER_BLOCK_SIZE. Reads past the end of the file come back as
+// zeros, like a blank card. An image pulled off a card with dd works the same way.
+
+#ifndef FRAME_LOG_FILE_H
+#define FRAME_LOG_FILE_H
+
+#include <stdint.h>
+
+#include "FrameLogger.h"
+
+class FrameLogFile
+{
+private:
+    int _fd;
+    bool _sync;
+    unsigned long _blocksWritten;
+
+    // FrameLoggerDevice entry points; they forward to the active file
+    static uint8_t deviceReadBlock(uint32_t block, uint8_t *data);
+    static uint8_t deviceWriteBlock(uint32_t block, const uint8_t *data);
+public:
+    FrameLogFile();
+    ~FrameLogFile();
+
+    // Opens (creating if needed) for reading and writing, or read only
+    bool open(const char *path, bool readOnly = false);
+    void close();
+
+    // fdatasync() after every block, to measure what a power loss safe write really costs
+    void setSync(bool sync) { _sync = sync; }
+
+    // The device to pass to FrameLogger::begin(); only one file can be active at a time
+    const FrameLoggerDevice *device();
+
+    uint32_t blockCount(); // whole blocks in the file now
+    unsigned long blocksWritten() const { return _blocksWritten; }
+};
+
+#endif
@@ -0,0 +1,164 @@
+// Compares the batch conversions in CanbusBatch.cpp against the one value at a time
+// conversions Canbus.cpp uses, for correctness and speed.
+//
+//   g++ -O2 -Iextras/host extras/host/CanbusBatch.cpp extras/host/batch_benchmark.cpp -o batch_benchmark
+//   ./batch_benchmark [values]
+
+#include "CanbusBatch.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// The per value path, as written in Canbus.cpp; kept out of line like the library's helpers
+__attribute__((noinline)) static float CONVERT_ENCODED_MVOLT_TO_VOLT(float v) {
+    return 2.0 + (v)*10.0/1000.0;
+}
+
+__attribute__((noinline)) static float milliValueToNormalValue(int v) {
+    return v * 100.0 / 1000.0;
+}
+
+#define ROUND_255_AS_PERCENTAGE(v) round(100.0*(float)(v)/255.0)
+
+__attribute__((noinline)) static int8_t limitPercentage(uint8_t v) {
+    return ROUND_255_AS_PERCENTAGE(v);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char *implementationName(CanbusBatchImplementation implementation) {
+    switch (implementation) {
+        case CanbusBatchAVX2: return "avx2";
+        case CanbusBatchSSE2: return "sse2";
+        default: return "scalar";
+    }
+}
+
+static void report(const char *what, const char *how, double seconds, size_t count, int repeats, bool matches) {
+    double perSecond = (double)count * repeats / seconds;
+    printf("%-14s %-10s %10.1f M values/s %s\n", what, how, perSecond / 1e6, matches ? "" : "MISMATCH");
+}
+
+int main(int argc, char **argv) {
+    size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    const int repeats = 20;
+    
+    uint8_t *cells = (uint8_t *)malloc(count);
+    int16_t *raw = (int16_t *)malloc(count * sizeof(int16_t));
+    float *expected = (float *)malloc(count * sizeof(float));
+    float *actual = (float *)malloc(count * sizeof(float));
+    int8_t *expectedPercent = (int8_t *)malloc(count);
+    int8_t *actualPercent = (int8_t *)malloc(count);
+    
+    srand(1);
+    for (size_t i = 0; i < count; i++) {
+        cells[i] = rand() & 0xFF;
+        raw[i] = (int16_t)(rand() & 0xFFFF);
+    }
+    // make sure every byte value gets checked
+    for (size_t i = 0; i < count && i < 256; i++) {
+        cells[i] = i;
+    }
+    
+    CanbusBatchImplementation implementations[] = { CanbusBatchScalar, CanbusBatchSSE2, CanbusBatchAVX2 };
+    CanbusBatchImplementation best = canbusBatchImplementation();
+    printf("%zu values, best implementation: %s\n\n", count, implementationName(best));
+    
+    // Cell voltages
+    double start = now();
+    for (int r = 0; r < repeats; r++) {
+        for (size_t i = 0; i < count; i++) expected[i] = CONVERT_ENCODED_MVOLT_TO_VOLT(cells[i]);
+    }
+    report("cell voltage", "per value", now() - start, count, repeats, true);
+    for (size_t k = 0; k < sizeof(implementations) / sizeof(implementations[0]) && implementations[k] <= best; k++) {
+        canbusBatchSetImplementation(implementations[k]);
+        start = now();
+        for (int r = 0; r < repeats; r++) canbusDecodeCellVoltages(cells, actual, count);
+        double elapsed = now() - start;
+        report("cell voltage", implementationName(implementations[k]), elapsed, count, repeats, memcmp(expected, actual, count * sizeof(float)) == 0);
+    }
+    
+    // Snapshots of a 48 cell pack; the per value path does the statistics in a second loop
+    const size_t packSize = 48;
+    size_t snapshots = count / packSize;
+    start = now();
+    double checksum = 0;
+    for (int r = 0; r < repeats; r++) {
+        for (size_t s = 0; s < snapshots; s++) {
+            const uint8_t *pack = cells + s * packSize;
+            float *volts = expected + s * packSize;
+            for (size_t i = 0; i < packSize; i++) volts[i] = CONVERT_ENCODED_MVOLT_TO_VOLT(pack[i]);
+            float lo = volts[0], hi = volts[0], sum = 0;
+            for (size_t i = 0; i < packSize; i++) {
+                if (volts[i] < lo) lo = volts[i];
+                if (volts[i] > hi) hi = volts[i];
+                sum += volts[i];
+            }
+            checksum += hi - lo + sum / packSize;
+        }
+    }
+    report("48 cell stats", "per value", now() - start, snapshots * packSize, repeats, checksum != 0);
+    for (size_t k = 0; k < sizeof(implementations) / sizeof(implementations[0]) && implementations[k] <= best; k++) {
+        canbusBatchSetImplementation(implementations[k]);
+        start = now();
+        bool matches = true;
+        for (int r = 0; r < repeats; r++) {
+            for (size_t s = 0; s < snapshots; s++) {
+                CellSnapshotStats stats = canbusDecodeCellSnapshot(cells + s * packSize, actual + s * packSize, packSize);
+                if (r == 0) {
+                    const float *volts = expected + s * packSize;
+                    for (size_t i = 0; i < packSize; i++) {
+                        matches &= volts[i] >= stats.minVoltage && volts[i] <= stats.maxVoltage;
+                    }
+                    matches &= volts[stats.minCell] == stats.minVoltage && volts[stats.maxCell] == stats.maxVoltage;
+                }
+            }
+        }
+        double elapsed = now() - start;
+        matches &= memcmp(expected, actual, snapshots * packSize * sizeof(float)) == 0;
+        report("48 cell stats", implementationName(implementations[k]), elapsed, snapshots * packSize, repeats, matches);
+    }
+    
+    // Pack current / voltage
+    start = now();
+    for (int r = 0; r < repeats; r++) {
+        for (size_t i = 0; i < count; i++) expected[i] = milliValueToNormalValue(raw[i]);
+    }
+    report("current", "per value", now() - start, count, repeats, true);
+    for (size_t k = 0; k < sizeof(implementations) / sizeof(implementations[0]) && implementations[k] <= best; k++) {
+        canbusBatchSetImplementation(implementations[k]);
+        start = now();
+        for (int r = 0; r < repeats; r++) canbusDecodeTenths(raw, actual, count);
+        double elapsed = now() - start;
+        report("current", implementationName(implementations[k]), elapsed, count, repeats, memcmp(expected, actual, count * sizeof(float)) == 0);
+    }
+    
+    // Limit percentages
+    start = now();
+    for (int r = 0; r < repeats; r++) {
+        for (size_t i = 0; i < count; i++) expectedPercent[i] = limitPercentage(cells[i]);
+    }
+    report("limit percent", "per value", now() - start, count, repeats, true);
+    for (size_t k = 0; k < sizeof(implementations) / sizeof(implementations[0]) && implementations[k] <= best; k++) {
+        canbusBatchSetImplementation(implementations[k]);
+        start = now();
+        for (int r = 0; r < repeats; r++) canbusDecodePercent255(cells, actualPercent, count);
+        double elapsed = now() - start;
+        report("limit percent", implementationName(implementations[k]), elapsed, count, repeats, memcmp(expectedPercent, actualPercent, count) == 0);
+    }
+    
+    free(cells);
+    free(raw);
+    free(expected);
+    free(actual);
+    free(expectedPercent);
+    free(actualPercent);
+    return 0;
+}
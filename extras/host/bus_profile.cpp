@@ -0,0 +1,70 @@
+// Runs a candump log through CanbusClass with a BusProfiler attached and prints the busiest IDs,
+// the same report a sketch gets from BusProfiler::getTop() on the device.
+//
+//   g++ -O2 -DCANBUS_ENABLE_PROFILER=1 -DBUS_PROFILER_SLOT_BITS=7 -DBUS_PROFILER_COUNT_TYPE=uint32_t -I. -Iextras/host Canbus.cpp FrameLogger.cpp BusProfiler.cpp extras/host/CanbusReplay.cpp extras/host/bus_profile.cpp -o bus_profile
+//   ./bus_profile candump.log [top] [bytes]
+//
+// With "bytes" the IDs are ranked by data bytes instead of frames. Logs from frame_log_reader
+// work too.
+
+#include "BusProfiler.h"
+#include "CanbusReplay.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s candump.log [top] [bytes]\n", argv[0]);
+        return 2;
+    }
+    int count = argc > 2 ? atoi(argv[2]) : 10;
+    if (count < 1 || count > BUS_PROFILER_MAX_IDS) {
+        count = BUS_PROFILER_MAX_IDS;
+    }
+    BusProfilerOrder order = argc > 3 && strcmp(argv[3], "bytes") == 0 ? BusProfilerByBytes : BusProfilerByFrames;
+
+    CanbusReplay replay;
+    if (replay.load(argv[1]) == 0) {
+        fprintf(stderr, "%s: no frames\n", argv[1]);
+        return 1;
+    }
+    CanbusClass canbus;
+    canbus.setDriver(replay.driver());
+    canbus.init(CanSpeed500);
+    canbus.setMode(CanbusModeListenOnly); // only watching
+    BusProfiler *profiler = new BusProfiler();
+    canbus.setProfiler(profiler);
+    while (replay.framesRemaining() > 0) {
+        canbus.poll();
+    }
+
+    const BusProfilerEntry *top[BUS_PROFILER_SLOTS];
+    uint8_t found = profiler->getTop(top, count, order);
+    uint32_t frames = profiler->getFrames();
+    printf("%lu frames, %u IDs", (unsigned long)frames, profiler->getIdCount());
+    if (profiler->getUntrackedFrames()) {
+        printf(", %lu frames of IDs past the first %u not tracked", (unsigned long)profiler->getUntrackedFrames(), BUS_PROFILER_MAX_IDS);
+    }
+    printf("\n\n%3s  %9s %6s %9s  %7s %7s %7s  %s\n", "id", "frames", "share", "bytes", "min ms", "mean ms", "max ms", "last payload");
+    for (uint8_t i = 0; i < found; i++) {
+        const BusProfilerEntry *entry = top[i];
+        printf("%03X  %9lu %5.1f%% %9lu  ", entry->id, (unsigned long)entry->frames,
+               100.0 * entry->frames / frames, (unsigned long)entry->bytes);
+        if (entry->frames > 1) {
+            printf("%7u %7lu %7u  ", entry->minGap, (unsigned long)BusProfiler::getMeanGap(entry), entry->maxGap);
+        } else {
+            printf("%7s %7s %7s  ", "-", "-", "-");
+        }
+        if (entry->rtr) {
+            printf("R%u", entry->length);
+        }
+        for (uint8_t j = 0; !entry->rtr && j < entry->length; j++) {
+            printf("%02X", entry->data[j]);
+        }
+        printf("\n");
+    }
+    delete profiler;
+    return 0;
+}
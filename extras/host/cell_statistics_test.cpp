@@ -0,0 +1,102 @@
+// Checks CellStatistics against a brute force recomputation over the whole pack after every
+// update, plus a few spreads small enough to expose rounding.
+//
+//   g++ -O2 -I. CellStatistics.cpp extras/host/cell_statistics_test.cpp -o cell_statistics_test
+//   ./cell_statistics_test [rounds]
+//
+// Exits non zero on any mismatch.
+
+#include "CellStatistics.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static int failures = 0;
+
+#define CHECK(expression) do { \
+    if (!(expression)) { \
+        fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, #expression); \
+        failures++; \
+    } \
+} while (0)
+
+// The population standard deviation in mV, from two passes over the readings: the variance
+// floored to whole mV^2, its root rounded to nearest
+static uint16_t referenceStandardDeviation(const int *values, int count) {
+    int64_t sum = 0;
+    for (int i = 0; i < count; i++) {
+        sum += values[i];
+    }
+    // sum((n * x - sum)^2) is n^2 * n times the variance in encoded units squared
+    int64_t scaled = 0;
+    for (int i = 0; i < count; i++) {
+        int64_t difference = (int64_t)values[i] * count - sum;
+        scaled += difference * difference;
+    }
+    int64_t variance = scaled * 100 / ((int64_t)count * count * count);
+    return (uint16_t)llround(sqrt((double)variance));
+}
+
+static void checkPack(const int *values, int count) {
+    CellStatistics statistics;
+    for (int i = 0; i < count; i++) {
+        statistics.update(i, values[i]);
+    }
+    CHECK(statistics.getStandardDeviationMillivolts() == referenceStandardDeviation(values, count));
+}
+
+int main(int argc, char **argv) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 100000;
+
+    // Two cells 10 mV apart: 5 mV
+    int pair[2] = { 100, 101 };
+    CellStatistics statistics;
+    statistics.update(0, pair[0]);
+    statistics.update(1, pair[1]);
+    CHECK(statistics.getStandardDeviationMillivolts() == 5);
+
+    // 48 cells with one 10 mV high: sqrt(100 * 47) / 48 = 1.43 mV
+    int pack[48];
+    for (int i = 0; i < 48; i++) {
+        pack[i] = 120;
+    }
+    pack[17] = 121;
+    statistics.reset();
+    for (int i = 0; i < 48; i++) {
+        statistics.update(i, pack[i]);
+    }
+    CHECK(statistics.getStandardDeviationMillivolts() == 1);
+    checkPack(pack, 48);
+
+    // Random packs, mostly tightly grouped like a balanced one, with updates in place
+    srand(1);
+    int values[CELL_STATISTICS_MAX_CELLS];
+    for (int round = 0; round < rounds && failures < 10; round++) {
+        int count = 1 + rand() % CELL_STATISTICS_MAX_CELLS;
+        int center = rand() % 256;
+        int width = 1 + rand() % (round % 4 == 0 ? 256 : 4);
+        statistics.reset();
+        for (int i = 0; i < count; i++) {
+            values[i] = (center + rand() % width) & 0xFF;
+            statistics.update(i, values[i]);
+        }
+        for (int change = 0; change < 4; change++) {
+            int cell = rand() % count;
+            values[cell] = (center + rand() % width) & 0xFF;
+            statistics.update(cell, values[cell]);
+            uint16_t expected = referenceStandardDeviation(values, count);
+            if (statistics.getStandardDeviationMillivolts() != expected) {
+                fprintf(stderr, "%d cells around %d: %u, expected %u\n", count, center, statistics.getStandardDeviationMillivolts(), expected);
+                failures++;
+            }
+        }
+    }
+
+    if (failures) {
+        fprintf(stderr, "%d failed\n", failures);
+        return 1;
+    }
+    printf("cell_statistics_test: all passed\n");
+    return 0;
+}
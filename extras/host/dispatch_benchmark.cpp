@@ -0,0 +1,107 @@
+// Checks CanbusDispatch.h's binary search against a plain scan of the same routes for every 11
+// bit ID, and compares their speed on a mix of routed and unrouted IDs. With 10 routes on an
+// x86 host the scan is as fast or faster (about 15-16 ns against 17-19 ns a frame), as the
+// branch predictor learns it; what the table gains on the AVR has not been measured.
+//
+//   g++ -O2 -std=c++11 -I. extras/host/dispatch_benchmark.cpp -o dispatch_benchmark
+//   ./dispatch_benchmark [frames]
+//
+// Add -DCHECK_UNSORTED to see the static_assert reject a table that is out of order.
+
+#include "CanbusDispatch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static uint32_t handled[16];
+
+template <int N> static void handler(const tCAN *message) {
+    handled[N] += message->id;
+}
+
+static constexpr CanbusRoute routes[] = {
+    CANBUS_ROUTE(0x0FF, handler<0>),
+    CANBUS_ROUTE_RANGE(0x100, 0x10F, handler<1>),
+    CANBUS_ROUTE(0x305, handler<2>), // charger
+    CANBUS_ROUTE(0x306, handler<3>),
+    CANBUS_ROUTE_RANGE(0x400, 0x40F, handler<4>), // motor controller
+    CANBUS_ROUTE(0x4F0, handler<5>), // DC-DC
+    CANBUS_ROUTE_RANGE(0x620, 0x628, handler<6>), // elithion broadcasts
+    CANBUS_ROUTE(0x6B0, handler<7>),
+    CANBUS_ROUTE(0x6B1, handler<8>),
+    CANBUS_ROUTE_RANGE(0x700, 0x73F, handler<9>),
+};
+typedef CanbusDispatch<routes, CANBUS_ROUTE_COUNT(routes)> Dispatch;
+
+#ifdef CHECK_UNSORTED
+static constexpr CanbusRoute unsorted[] = {
+    CANBUS_ROUTE(0x620, handler<0>),
+    CANBUS_ROUTE(0x305, handler<1>),
+};
+typedef CanbusDispatch<unsorted, CANBUS_ROUTE_COUNT(unsorted)> Unsorted;
+static bool (*unsortedDispatch)(const tCAN *) = Unsorted::dispatch;
+#endif
+
+// What a hand written handler chain does
+__attribute__((noinline)) static bool linearDispatch(const tCAN *message) {
+    for (uint8_t i = 0; i < CANBUS_ROUTE_COUNT(routes); i++) {
+        if (message->id >= routes[i].first && message->id <= routes[i].last) {
+            routes[i].handler(message);
+            return true;
+        }
+    }
+    return false;
+}
+
+__attribute__((noinline)) static bool tableDispatch(const tCAN *message) {
+    return Dispatch::dispatch(message);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    uint32_t frames = argc > 1 ? strtoul(argv[1], NULL, 0) : 20000000;
+    bool ok = true;
+
+    // Every ID goes to the same handler (or none) both ways
+    tCAN message = {};
+    uint32_t routed = 0;
+    for (uint16_t id = 0; id <= 0x7FF; id++) {
+        message.id = id;
+        for (int i = 0; i < 16; i++) handled[i] = 0;
+        bool linear = linearDispatch(&message);
+        uint32_t linearHandled[16];
+        for (int i = 0; i < 16; i++) { linearHandled[i] = handled[i]; handled[i] = 0; }
+        bool table = tableDispatch(&message);
+        for (int i = 0; i < 16; i++) ok &= handled[i] == linearHandled[i];
+        ok &= linear == table;
+        routed += table;
+    }
+    printf("all 2048 IDs: %u routed, %s\n", (unsigned)routed, ok ? "same as a linear scan" : "MISMATCH");
+
+    // Mostly broadcasts, some traffic for other nodes that should be dropped
+    static uint16_t ids[4096];
+    srand(1);
+    for (int i = 0; i < 4096; i++) {
+        int r = rand() % 10;
+        ids[i] = r < 5 ? 0x620 + rand() % 9 : r < 7 ? 0x400 + rand() % 16 : r < 8 ? 0x305 : rand() % 0x800;
+    }
+    double results[2];
+    for (int pass = 0; pass < 2; pass++) {
+        bool (*dispatch)(const tCAN *) = pass == 0 ? linearDispatch : tableDispatch;
+        double start = now();
+        for (uint32_t i = 0; i < frames; i++) {
+            message.id = ids[i & 4095];
+            dispatch(&message);
+        }
+        results[pass] = (now() - start) / frames * 1e9;
+    }
+    printf("%u frames, %u routes: linear %.2f ns/frame, table %.2f ns/frame\n",
+           (unsigned)frames, (unsigned)CANBUS_ROUTE_COUNT(routes), results[0], results[1]);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,107 @@
+// Prints a FrameLogger log (a file written with FrameLogFile, or an image of the card's log
+// region) oldest first.
+//
+//   g++ -O2 -I. -Iextras/host FrameLogger.cpp extras/host/FrameLogFile.cpp extras/host/frame_log_reader.cpp -o frame_log_reader
+//   ./frame_log_reader log.bin > log.txt
+//
+// Frames come out in "candump -l" format, so the output can be fed to CanbusReplay:
+//   (12.345000) can0 74D#0350500045000000
+// Values are printed as comment lines ("# 12.345000 value 3 1234"), which the replay skips. A
+// summary, including any torn or missing segments, goes to stderr.
+
+#include "FrameLogFile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+
+struct Segment {
+    uint32_t sequence;
+    uint32_t block;
+    bool operator<(const Segment &other) const { return sequence < other.sequence; }
+};
+
+static void printRecord(const FrameLoggerRecord *record) {
+    unsigned long seconds = record->timestamp / 1000;
+    unsigned long micros = (record->timestamp % 1000) * 1000;
+    if (record->type == FrameLoggerValue) {
+        printf("# %lu.%06lu value %u %ld\n", seconds, micros, record->key, (long)record->value);
+        return;
+    }
+    printf("(%lu.%06lu) can0 %03X#", seconds, micros, record->message.id);
+    if (record->message.header.rtr) {
+        printf("R");
+    } else {
+        for (uint8_t i = 0; i < record->message.header.length; i++) {
+            printf("%02X", record->message.data[i]);
+        }
+    }
+    printf("\n");
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s log.bin\n", argv[0]);
+        return 2;
+    }
+    FrameLogFile file;
+    if (!file.open(argv[1], true)) {
+        perror(argv[1]);
+        return 1;
+    }
+    const FrameLoggerDevice *device = file.device();
+    uint32_t blocks = file.blockCount();
+    uint8_t data[FRAME_LOGGER_BLOCK_SIZE];
+
+    std::vector<Segment> segments;
+    unsigned long bad = 0;
+    for (uint32_t block = 0; block < blocks; block++) {
+        Segment segment;
+        uint16_t length;
+        if (!device->readBlock(block, data)) {
+            bad++;
+        } else if (FrameLogger::checkSegment(data, &segment.sequence, &length)) {
+            segment.block = block;
+            segments.push_back(segment);
+        } else {
+            bool blank = true;
+            for (uint16_t i = 0; i < FRAME_LOGGER_BLOCK_SIZE && blank; i++) {
+                blank = data[i] == 0;
+            }
+            if (!blank) {
+                bad++; // torn by a power loss, or corrupted
+            }
+        }
+    }
+    std::sort(segments.begin(), segments.end());
+
+    unsigned long frames = 0, values = 0, malformed = 0, gaps = 0;
+    for (size_t i = 0; i < segments.size(); i++) {
+        if (i > 0 && segments[i].sequence != segments[i - 1].sequence + 1) {
+            gaps++;
+            printf("# gap: segments %lu to %lu are missing\n", (unsigned long)segments[i - 1].sequence + 1, (unsigned long)segments[i].sequence - 1);
+        }
+        uint32_t sequence;
+        uint16_t length;
+        device->readBlock(segments[i].block, data);
+        FrameLogger::checkSegment(data, &sequence, &length);
+        uint16_t offset = FRAME_LOGGER_HEADER_SIZE;
+        FrameLoggerRecord record;
+        while (FrameLogger::readRecord(data, length, &offset, &record)) {
+            printRecord(&record);
+            if (record.type == FrameLoggerValue) {
+                values++;
+            } else {
+                frames++;
+            }
+        }
+        if (offset != FRAME_LOGGER_HEADER_SIZE + length) {
+            malformed++;
+        }
+    }
+    fprintf(stderr, "%lu segments (%lu to %lu), %lu frames, %lu values; %lu bad blocks, %lu gaps, %lu malformed segments\n",
+            (unsigned long)segments.size(), segments.empty() ? 0UL : (unsigned long)segments.front().sequence,
+            segments.empty() ? 0UL : (unsigned long)segments.back().sequence, frames, values, bad, gaps, malformed);
+    return 0;
+}
@@ -0,0 +1,197 @@
+// Checks FrameLogger's round trip and power loss recovery, and measures its write throughput
+// against a fully loaded 500 kbps bus.
+//
+//   g++ -O2 -I. -Iextras/host FrameLogger.cpp extras/host/FrameLogFile.cpp extras/host/frame_logger_benchmark.cpp -o frame_logger_benchmark
+//   ./frame_logger_benchmark [-s] [frames] [scratch file]
+//
+// -s fdatasync()s every block, which is the honest comparison for a card that has to survive a
+// power loss. A 500 kbps bus full of 8 byte standard frames carries at most about 4,500 frames
+// a second (111 bits each before stuffing), so anything above that keeps up.
+
+#include "FrameLogFile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FULL_BUS_FRAMES_PER_SECOND 4505 // 500000 / 111
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void makeFrame(tCAN *message, uint32_t i) {
+    memset(message, 0, sizeof(tCAN));
+    message->id = 0x700 + (i % 0x100);
+    message->header.length = 8;
+    for (uint8_t b = 0; b < 8; b++) {
+        message->data[b] = i >> (b * 3);
+    }
+}
+
+// Every record in the region in sequence order, checked against what was logged
+static bool verify(FrameLogFile *file, uint32_t blockCount, uint32_t firstRecord, uint32_t records, uint32_t *seen) {
+    const FrameLoggerDevice *device = file->device();
+    uint8_t data[FRAME_LOGGER_BLOCK_SIZE];
+    uint32_t lowest = 0xFFFFFFFF;
+    uint32_t lowestBlock = 0;
+    for (uint32_t block = 0; block < blockCount; block++) {
+        uint32_t sequence;
+        uint16_t length;
+        if (device->readBlock(block, data) && FrameLogger::checkSegment(data, &sequence, &length) && sequence < lowest) {
+            lowest = sequence;
+            lowestBlock = block;
+        }
+    }
+    *seen = 0;
+    uint32_t expected = firstRecord;
+    for (uint32_t i = 0; i < blockCount; i++) {
+        uint32_t sequence;
+        uint16_t length;
+        if (!device->readBlock((lowestBlock + i) % blockCount, data) || !FrameLogger::checkSegment(data, &sequence, &length)) {
+            break;
+        }
+        uint16_t offset = FRAME_LOGGER_HEADER_SIZE;
+        FrameLoggerRecord record;
+        while (FrameLogger::readRecord(data, length, &offset, &record)) {
+            tCAN message;
+            makeFrame(&message, record.timestamp);
+            if (record.type != FrameLoggerReceived || memcmp(&message, &record.message, sizeof(tCAN)) != 0) {
+                return false;
+            }
+            if (expected != 0xFFFFFFFF && record.timestamp != expected) {
+                return false; // lost or repeated a record
+            }
+            expected = record.timestamp + 1;
+            (*seen)++;
+        }
+    }
+    return *seen == records || records == 0;
+}
+
+static bool checkRecovery(const char *path) {
+    FrameLogFile file;
+    bool ok = true;
+    uint8_t block[FRAME_LOGGER_BLOCK_SIZE];
+    uint32_t seen;
+
+    // Round trip, then a power loss that tears the newest segment
+    unlink(path);
+    file.open(path);
+    {
+        FrameLogger logger;
+        ok &= logger.begin(file.device(), 0, 64);
+        tCAN message;
+        for (uint32_t i = 0; i < 1000; i++) {
+            makeFrame(&message, i);
+            logger.logFrame(i, &message, false);
+            logger.service();
+        }
+        ok &= logger.flush() && logger.getDroppedRecords() == 0;
+        ok &= verify(&file, 64, 0, 1000, &seen);
+        printf("round trip: %u of 1000 records, %s\n", (unsigned)seen, ok ? "ok" : "FAIL");
+    }
+    uint32_t segments = file.blocksWritten();
+    file.device()->readBlock(segments - 1, block);
+    block[100] ^= 0xFF; // half written
+    file.device()->writeBlock(segments - 1, block);
+    {
+        FrameLogger logger;
+        ok &= logger.begin(file.device(), 0, 64);
+        // It should carry on in the torn block, with the torn segment's sequence number
+        uint32_t resumed = logger.getSequence();
+        ok &= resumed == segments - 1;
+        tCAN message;
+        makeFrame(&message, 5000);
+        logger.logFrame(5000, &message, false);
+        ok &= logger.flush() && file.blocksWritten() == segments + 2;
+        printf("torn segment %u: resumed at %u, %s\n", (unsigned)segments - 1, (unsigned)resumed, ok ? "ok" : "FAIL");
+    }
+
+    // Wrapping around a small region, then a reboot, then block 0 torn after the wrap
+    unlink(path);
+    file.open(path);
+    uint32_t sequenceAfterWrap;
+    {
+        FrameLogger logger;
+        ok &= logger.begin(file.device(), 0, 8);
+        tCAN message;
+        for (uint32_t i = 0; i < 20 * 30; i++) {
+            makeFrame(&message, i);
+            logger.logFrame(i, &message, false);
+            logger.service();
+        }
+        logger.flush();
+        sequenceAfterWrap = logger.getSequence();
+    }
+    {
+        FrameLogger logger;
+        ok &= logger.begin(file.device(), 0, 8) && logger.getSequence() == sequenceAfterWrap;
+        ok &= verify(&file, 8, 0xFFFFFFFF, 0, &seen) && seen > 0;
+        printf("wrapped: resumed at %u of %u, %u records kept, %s\n", (unsigned)logger.getSequence(), (unsigned)sequenceAfterWrap, (unsigned)seen, ok ? "ok" : "FAIL");
+        // Fill up to the end of the region, so the next segment goes in block 0
+        tCAN message;
+        while (logger.getSequence() % 8 != 0) {
+            makeFrame(&message, 0);
+            logger.logFrame(0, &message, false);
+            logger.flush();
+        }
+        sequenceAfterWrap = logger.getSequence();
+    }
+    // ...and the power goes out while writing it
+    memset(block, 0x55, sizeof(block));
+    file.device()->writeBlock(0, block);
+    {
+        FrameLogger logger;
+        ok &= logger.begin(file.device(), 0, 8) && logger.getSequence() == sequenceAfterWrap;
+        printf("torn block 0 after wrapping: resumed at %u, %s\n", (unsigned)logger.getSequence(), ok ? "ok" : "FAIL");
+    }
+    file.close();
+    unlink(path);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    bool sync = false;
+    int arg = 1;
+    if (arg < argc && strcmp(argv[arg], "-s") == 0) {
+        sync = true;
+        arg++;
+    }
+    uint32_t frames = arg < argc ? strtoul(argv[arg++], NULL, 0) : 1000000;
+    const char *path = arg < argc ? argv[arg++] : "/tmp/frame_logger_benchmark.bin";
+
+    bool ok = checkRecovery(path);
+
+    FrameLogFile file;
+    unlink(path);
+    if (!file.open(path)) {
+        perror(path);
+        return 1;
+    }
+    file.setSync(sync);
+    FrameLogger logger;
+    uint32_t blocks = frames / 20 + 16;
+    logger.begin(file.device(), 0, blocks);
+    tCAN message;
+    double start = now();
+    for (uint32_t i = 0; i < frames; i++) {
+        makeFrame(&message, i);
+        logger.logFrame(i, &message, false);
+        logger.service();
+    }
+    logger.flush();
+    double elapsed = now() - start;
+    double rate = frames / elapsed;
+    printf("%u frames in %.3fs%s: %.0f frames/s, %.2f MB/s, %.1fx a full 500 kbps bus; %u dropped, %u write errors\n",
+           (unsigned)frames, elapsed, sync ? " (synced)" : "", rate, file.blocksWritten() * (double)FRAME_LOGGER_BLOCK_SIZE / elapsed / 1e6,
+           rate / FULL_BUS_FRAMES_PER_SECOND, (unsigned)logger.getDroppedRecords(), (unsigned)logger.getWriteErrors());
+    ok &= rate > FULL_BUS_FRAMES_PER_SECOND && logger.getDroppedRecords() == 0;
+    file.close();
+    unlink(path);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,164 @@
+// Runs BmsHistory over a synthetic trace of parked, driving and charging days in a RAM copy of
+// the EEPROM region, and reports how much history fits, how evenly it wears, and whether every
+// sample still in the region comes back exactly.
+//
+//   g++ -O2 -I. BmsHistory.cpp Canbus.cpp extras/host/history_benchmark.cpp -o history_benchmark
+//   ./history_benchmark [days] [interval seconds]
+//
+// Canbus.cpp is only there for BmsHistory::sample(), which the benchmark doesn't call.
+
+#include "BmsHistory.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#define RAW_SAMPLE_SIZE 11 // time, SOC, pack, current, min and max cell, unpacked
+
+static uint8_t eeprom[BMS_HISTORY_EEPROM_START + BMS_HISTORY_EEPROM_SIZE];
+static uint32_t writes[sizeof(eeprom)];
+
+static uint8_t ramRead(uint16_t address) {
+    return eeprom[address];
+}
+
+static void ramWrite(uint16_t address, uint8_t value) {
+    if (eeprom[address] != value) { // like eeprom_update_byte
+        eeprom[address] = value;
+        writes[address]++;
+    }
+}
+
+static const BmsHistoryStorage ramStorage = { ramRead, ramWrite };
+
+static std::vector<BmsHistorySample> returned;
+
+static void collect(const BmsHistorySample *sample) {
+    returned.push_back(*sample);
+}
+
+static bool sameSample(const BmsHistorySample &a, const BmsHistorySample &b) {
+    return a.time == b.time && a.stateOfCharge == b.stateOfCharge && a.packDecivolts == b.packDecivolts &&
+        a.packDeciamps == b.packDeciamps && a.minCell == b.minCell && a.maxCell == b.maxCell;
+}
+
+// A day is parked overnight, an hour's drive each way, and a charge in the evening
+static BmsHistorySample makeSample(uint32_t time, uint32_t interval, double *soc) {
+    uint32_t minute = (time / 60) % (24 * 60);
+    double amps = 0;
+    if ((minute >= 7 * 60 && minute < 8 * 60) || (minute >= 17 * 60 && minute < 18 * 60)) {
+        amps = 60 + 40 * ((rand() % 100) / 100.0); // driving, noisy
+    } else if (minute >= 19 * 60 && minute < 23 * 60 && *soc < 95) {
+        amps = -20; // charging
+    }
+    *soc -= amps * interval / 3600.0; // percent of a 100Ah pack
+    if (*soc > 100) *soc = 100;
+    if (*soc < 5) *soc = 5;
+    BmsHistorySample sample;
+    sample.time = time;
+    sample.stateOfCharge = (uint8_t)*soc;
+    double cell = 3.2 + 0.008 * *soc - amps * 0.0005;
+    sample.packDecivolts = (uint16_t)(cell * 10 * 96);
+    sample.packDeciamps = (int16_t)(amps * 10);
+    sample.minCell = (uint8_t)((cell - 0.01 - 2.0) * 100);
+    sample.maxCell = (uint8_t)((cell + 0.01 - 2.0) * 100);
+    return sample;
+}
+
+int main(int argc, char **argv) {
+    uint32_t days = argc > 1 ? strtoul(argv[1], NULL, 0) : 60;
+    uint16_t interval = argc > 2 ? strtoul(argv[2], NULL, 0) : 60;
+    memset(eeprom, 0xFF, sizeof(eeprom));
+    srand(1);
+
+    std::vector<BmsHistorySample> added;
+    BmsHistory *history = new BmsHistory();
+    history->setStorage(&ramStorage);
+    history->begin(interval);
+    double soc = 90;
+    uint32_t time = 1000000;
+    uint32_t end = time + days * 24 * 3600;
+    uint32_t reboots = 0;
+    bool ok = true;
+    for (; time < end; time += interval) {
+        if ((time / interval) % 10007 == 0) {
+            // A reboot: a fresh object has to pick up where the old one left off, and the samples
+            // it didn't see while down leave a gap
+            history->flush();
+            delete history;
+            history = new BmsHistory();
+            history->setStorage(&ramStorage);
+            history->begin(interval);
+            time += 5 * interval;
+            reboots++;
+        }
+        BmsHistorySample sample = makeSample(time, interval, &soc);
+        history->add(&sample);
+        added.push_back(sample);
+    }
+
+    // Everything from the oldest sample still stored on must come back exactly
+    uint32_t oldest = 0;
+    ok &= history->getOldestTime(&oldest);
+    returned.clear();
+    uint32_t count = history->query(0, 0xFFFFFFFF, collect);
+    size_t first = 0;
+    while (first < added.size() && added[first].time < oldest) {
+        first++;
+    }
+    ok &= count == returned.size() && returned.size() == added.size() - first;
+    for (size_t i = 0; ok && i < returned.size(); i++) {
+        ok &= sameSample(returned[i], added[first + i]);
+    }
+    printf("full query: %u samples back, %s\n", (unsigned)returned.size(), ok ? "lossless" : "MISMATCH");
+
+    // A range in the middle
+    uint32_t from = added[first + returned.size() / 3].time;
+    uint32_t to = added[first + returned.size() / 2].time;
+    returned.clear();
+    history->query(from, to, collect);
+    size_t expected = 0;
+    for (size_t i = first; i < added.size(); i++) {
+        expected += added[i].time >= from && added[i].time <= to;
+    }
+    bool rangeOk = returned.size() == expected && !returned.empty() && returned.front().time == from && returned.back().time == to;
+    printf("range query: %u samples, %s\n", (unsigned)returned.size(), rangeOk ? "ok" : "FAIL");
+    ok &= rangeOk;
+
+    // A reboot at the end finds the same history
+    history->flush();
+    delete history;
+    history = new BmsHistory();
+    history->setStorage(&ramStorage);
+    history->begin(interval);
+    uint32_t oldestAfter = 0;
+    history->getOldestTime(&oldestAfter);
+    returned.clear();
+    history->query(0, 0xFFFFFFFF, collect);
+    bool rebootOk = oldestAfter == oldest && returned.size() == added.size() - first && sameSample(returned.back(), added.back());
+    printf("after a reboot: %u samples, %s\n", (unsigned)returned.size(), rebootOk ? "ok" : "FAIL");
+    ok &= rebootOk;
+
+    size_t kept = added.size() - first;
+    double bytesPerSample = (double)BMS_HISTORY_EEPROM_SIZE / kept;
+    double keptDays = kept * (double)interval / 86400;
+    double rawDays = BMS_HISTORY_EEPROM_SIZE / RAW_SAMPLE_SIZE * (double)interval / 86400;
+    uint32_t maxWrites = 0;
+    uint64_t totalWrites = 0;
+    for (uint16_t i = BMS_HISTORY_EEPROM_START; i < sizeof(eeprom); i++) {
+        if (writes[i] > maxWrites) {
+            maxWrites = writes[i];
+        }
+        totalWrites += writes[i];
+    }
+    double writesPerDay = maxWrites / (double)days;
+    printf("%u samples over %u days (%u reboots), %u bytes of EEPROM in %u pages\n",
+           (unsigned)added.size(), (unsigned)days, (unsigned)reboots, BMS_HISTORY_EEPROM_SIZE, (unsigned)BMS_HISTORY_PAGES);
+    printf("%.2f bytes a sample against %u raw: %.1fx; %.1f days kept against %.1f raw\n",
+           bytesPerSample, RAW_SAMPLE_SIZE, RAW_SAMPLE_SIZE / bytesPerSample, keptDays, rawDays);
+    printf("wear: at most %u writes to a byte (average %.1f), %.2f a day: %.0f years to 100,000\n",
+           (unsigned)maxWrites, totalWrites / (double)BMS_HISTORY_EEPROM_SIZE, writesPerDay, 100000 / writesPerDay / 365);
+    delete history;
+    return ok ? 0 : 1;
+}
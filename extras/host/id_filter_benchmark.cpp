@@ -0,0 +1,158 @@
+// Checks that id_filter_cover() lets every wanted ID through the MCP2515's masks, and compares
+// how much of a busy bus still reaches the AVR with it, with a single mask over the common bits
+// of the wanted IDs, and with the hardware filters off.
+//
+//   g++ -O2 -I. id_filter.c extras/host/id_filter_benchmark.cpp -o id_filter_benchmark
+//   ./id_filter_benchmark [frames]
+
+#include "id_filter.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// SPI bytes for a frame, as mcp2515_get_message() reads it: RX status, the read up to the ID,
+// then the rest of an 8 byte frame, then clearing RXnIF
+#define SPI_REJECTED (2 + 3 + 4)
+#define SPI_ACCEPTED (2 + 3 + 4 + 11)
+
+static bool hardwareAccepts(const IdFilterCover *cover, uint16_t id) {
+    for (uint8_t i = 0; i < ID_FILTER_HARDWARE_FILTERS; i++) {
+        if ((id & cover->mask) == (cover->filters[i] & cover->mask)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void printCover(const char *name, const IdFilterCover *cover) {
+    printf("%-14s mask %03X filters", name, cover->mask);
+    for (uint8_t i = 0; i < ID_FILTER_HARDWARE_FILTERS; i++) {
+        printf(" %03X", cover->filters[i]);
+    }
+    printf(": %u IDs through\n", cover->accepted);
+}
+
+// What a hand set single filter does: the bits every wanted ID agrees on
+static void commonBits(const uint8_t *bitmap, IdFilterCover *cover) {
+    uint16_t ones = 0x7FF;
+    uint16_t zeros = 0x7FF;
+    for (uint16_t id = 0; id <= 0x7FF; id++) {
+        if (id_filter_has(bitmap, id)) {
+            ones &= id;
+            zeros &= ~id;
+        }
+    }
+    cover->mask = ones | zeros;
+    for (uint8_t i = 0; i < ID_FILTER_HARDWARE_FILTERS; i++) {
+        cover->filters[i] = ones;
+    }
+    cover->accepted = 0;
+    for (uint16_t id = 0; id <= 0x7FF; id++) {
+        cover->accepted += hardwareAccepts(cover, id);
+    }
+}
+
+static bool checkCover(const uint8_t *bitmap, const IdFilterCover *cover) {
+    uint16_t accepted = 0;
+    bool ok = true;
+    for (uint16_t id = 0; id <= 0x7FF; id++) {
+        bool through = hardwareAccepts(cover, id);
+        ok &= through || !id_filter_has(bitmap, id);
+        accepted += through;
+    }
+    return ok && accepted == cover->accepted;
+}
+
+int main(int argc, char **argv) {
+    uint32_t frames = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000000;
+    bool ok = true;
+
+    // The BMS broadcasts and replies, a charger, a motor controller and a DC-DC converter
+    uint8_t bitmap[ID_FILTER_SIZE];
+    memset(bitmap, 0, sizeof(bitmap));
+    id_filter_add(bitmap, 0x620, 0x628);
+    id_filter_add(bitmap, 0x74D, 0x74D);
+    id_filter_add(bitmap, 0x305, 0x306);
+    id_filter_add(bitmap, 0x0A0, 0x0AF);
+    id_filter_add(bitmap, 0x1D4, 0x1D4);
+    uint16_t wanted = 0;
+    for (uint16_t id = 0; id <= 0x7FF; id++) {
+        wanted += id_filter_has(bitmap, id) != 0;
+    }
+
+    IdFilterCover cover;
+    clock_t start = clock();
+    id_filter_cover(bitmap, &cover);
+    double coverMs = (clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+    IdFilterCover common;
+    commonBits(bitmap, &common);
+    IdFilterCover open = { 0, { 0 }, 2048 };
+    printf("%u wanted IDs; id_filter_cover() took %.2f ms here\n", wanted, coverMs);
+    printCover("cover", &cover);
+    printCover("common bits", &common);
+    ok &= checkCover(bitmap, &cover);
+
+    // Random bitmaps of a few blocks each must always be covered
+    srand(1);
+    uint32_t extra = 0;
+    for (int round = 0; round < 200; round++) {
+        uint8_t random[ID_FILTER_SIZE];
+        memset(random, 0, sizeof(random));
+        int blocks = 1 + rand() % 10;
+        for (int i = 0; i < blocks; i++) {
+            uint16_t first = rand() % 0x800;
+            id_filter_add(random, first, first + rand() % 16);
+        }
+        IdFilterCover randomCover;
+        id_filter_cover(random, &randomCover);
+        ok &= checkCover(random, &randomCover);
+        uint16_t count = 0;
+        for (uint16_t id = 0; id <= 0x7FF; id++) {
+            count += id_filter_has(random, id) != 0;
+        }
+        extra += randomCover.accepted - count;
+    }
+    printf("200 random bitmaps: %s, %.1f extra IDs through the hardware on average\n",
+           ok ? "all covered" : "NOT COVERED", extra / 200.0);
+
+    // A bus where 30% of the frames are wanted and the rest are spread over every other ID
+    uint16_t wantedIds[2048];
+    uint16_t wantedCount = 0;
+    for (uint16_t id = 0; id <= 0x7FF; id++) {
+        if (id_filter_has(bitmap, id)) {
+            wantedIds[wantedCount++] = id;
+        }
+    }
+    const IdFilterCover *covers[] = { &open, &common, &cover };
+    const char *names[] = { "filters off", "common bits", "cover" };
+    uint32_t handled = 0;
+    for (int c = 0; c < 3; c++) {
+        uint32_t interrupts = 0;
+        uint32_t accepted = 0;
+        uint64_t spiBytes = 0;
+        srand(2);
+        for (uint32_t i = 0; i < frames; i++) {
+            uint16_t id = rand() % 10 < 3 ? wantedIds[rand() % wantedCount] : rand() % 0x800;
+            if (c > 0 && !hardwareAccepts(covers[c], id)) {
+                continue;
+            }
+            interrupts++;
+            if (id_filter_has(bitmap, id)) {
+                accepted++;
+                spiBytes += SPI_ACCEPTED;
+            } else {
+                spiBytes += SPI_REJECTED;
+            }
+        }
+        if (c == 0) {
+            handled = accepted;
+        }
+        ok &= accepted == handled;
+        printf("%-12s %5.1f%% of frames interrupt the AVR, %5.1f%% of those dropped by the bitmap, %.2f SPI bytes a bus frame\n",
+               names[c], 100.0 * interrupts / frames, interrupts ? 100.0 * (interrupts - accepted) / interrupts : 0,
+               (double)spiBytes / frames);
+    }
+    return ok ? 0 : 1;
+}
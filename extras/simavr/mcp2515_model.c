@@ -0,0 +1,439 @@
+// An MCP2515 on simavr's SPI, for running the AVR builds without a board - by corbin dunn
+// www.corbinstreehouse.com
+
+#include <string.h>
+
+#include "sim_avr.h"
+#include "sim_io.h"
+#include "sim_time.h"
+#include "sim_cycle_timers.h"
+#include "avr_spi.h"
+#include "avr_ioport.h"
+
+#include "mcp2515_defs.h"
+#include "mcp2515_model.h"
+
+#define OSCILLATOR 16000000UL // the crystal CNF1-3 are worked out for
+
+#define MODE_MASK 0xE0
+#define MODE_NORMAL 0x00
+#define MODE_SLEEP 0x20
+#define MODE_LOOPBACK 0x40
+#define MODE_LISTEN 0x60
+#define MODE_CONFIG 0x80
+
+#define BMS_REQUEST_ID 0x745
+#define BMS_RESPONSE_ID 0x74D
+#define BROADCAST_FIRST_ID 0x620
+#define BROADCASTS 9
+
+#define mode(chip) ((chip)->regs[CANSTAT] & MODE_MASK)
+
+static const uint8_t filter_addresses[6] = { RXF0SIDH, RXF1SIDH, RXF2SIDH, RXF3SIDH, RXF4SIDH, RXF5SIDH };
+
+static void start_transmission(mcp2515_t *chip);
+
+static void update_int(mcp2515_t *chip)
+{
+	uint8_t pending = (chip->regs[CANINTE] & chip->regs[CANINTF]) != 0;
+	avr_raise_irq(chip->irq + MCP2515_IRQ_INT, !pending);
+}
+
+// CANSTAT and CANCTRL show up at the end of every row of 16
+static uint8_t register_address(uint8_t address)
+{
+	address &= 0x7F;
+	if ((address & 0x0F) >= 0x0E) {
+		address &= 0x0F;
+	}
+	return address;
+}
+
+static uint16_t standard_id(const uint8_t *sidh)
+{
+	return ((uint16_t)sidh[0] << 3) | (sidh[1] >> 5);
+}
+
+// CNF1-3 as the number of AVR cycles a frame takes on the bus
+static avr_cycle_count_t frame_cycles(mcp2515_t *chip, uint8_t length)
+{
+	uint8_t brp = chip->regs[CNF1] & 0x3F;
+	uint8_t prseg = (chip->regs[CNF2] & 0x07) + 1;
+	uint8_t phseg1 = ((chip->regs[CNF2] >> 3) & 0x07) + 1;
+	uint8_t phseg2 = (chip->regs[CNF2] & 0x80) ? (chip->regs[CNF3] & 0x07) + 1 : (phseg1 > 2 ? phseg1 : 2);
+	uint64_t quanta = (uint64_t)(47 + 8 * length) * (1 + prseg + phseg1 + phseg2);
+	// each time quantum is 2 * (BRP + 1) oscillator periods
+	avr_cycle_count_t cycles = quanta * 2 * (brp + 1) * chip->avr->frequency / OSCILLATOR;
+	return cycles ? cycles : 1;
+}
+
+// ----------------------------------------------------------------------------
+// receiving
+
+static uint8_t filter_matches(mcp2515_t *chip, uint8_t mask_address, uint8_t filter, uint16_t id)
+{
+	uint16_t mask = standard_id(&chip->regs[mask_address]);
+	return ((id ^ standard_id(&chip->regs[filter_addresses[filter]])) & mask) == 0;
+}
+
+static void load_buffer(mcp2515_t *chip, uint8_t buffer, uint8_t filter_hit, const mcp2515_frame_t *frame)
+{
+	uint8_t *rx = &chip->regs[buffer ? RXB1CTRL : RXB0CTRL];
+	rx[1] = frame->id >> 3;
+	rx[2] = (frame->id << 5) & 0xE0;
+	rx[3] = 0;
+	rx[4] = 0;
+	rx[5] = frame->length;
+	memcpy(&rx[6], frame->data, 8);
+	rx[0] = (rx[0] & ~(buffer ? 0x07 : 0x01)) | filter_hit;
+	chip->regs[CANINTF] |= 1 << (buffer ? RX1IF : RX0IF);
+	chip->frames_received++;
+}
+
+// The acceptance flow from the datasheet: RXB0 first, rolling over into RXB1 if BUKT is set
+static void receive(mcp2515_t *chip, const mcp2515_frame_t *frame)
+{
+	uint8_t m = mode(chip);
+	if (m != MODE_NORMAL && m != MODE_LOOPBACK && m != MODE_LISTEN) {
+		return;
+	}
+	uint16_t id = frame->id;
+	uint8_t any0 = (chip->regs[RXB0CTRL] & ((1<<RXM1)|(1<<RXM0))) == ((1<<RXM1)|(1<<RXM0));
+	uint8_t any1 = (chip->regs[RXB1CTRL] & ((1<<RXM1)|(1<<RXM0))) == ((1<<RXM1)|(1<<RXM0));
+	int8_t hit0 = any0 ? 0 : filter_matches(chip, RXM0SIDH, 0, id) ? 0 : filter_matches(chip, RXM0SIDH, 1, id) ? 1 : -1;
+	int8_t hit1 = -1;
+	for (uint8_t f = 2; hit1 < 0 && f < 6; f++) {
+		if (any1 || filter_matches(chip, RXM1SIDH, f, id)) {
+			hit1 = f;
+		}
+	}
+	if (hit0 >= 0) {
+		if ((chip->regs[CANINTF] & (1<<RX0IF)) == 0) {
+			load_buffer(chip, 0, hit0, frame);
+		} else if ((chip->regs[RXB0CTRL] & (1<<BUKT)) && (chip->regs[CANINTF] & (1<<RX1IF)) == 0) {
+			load_buffer(chip, 1, hit0, frame);
+		} else {
+			chip->regs[EFLG] |= (chip->regs[RXB0CTRL] & (1<<BUKT)) ? (1<<RX1OVR) : (1<<RX0OVR);
+			chip->regs[CANINTF] |= (1<<ERRIF);
+			chip->overflows++;
+		}
+	} else if (hit1 >= 0) {
+		if ((chip->regs[CANINTF] & (1<<RX1IF)) == 0) {
+			load_buffer(chip, 1, hit1, frame);
+		} else {
+			chip->regs[EFLG] |= (1<<RX1OVR);
+			chip->regs[CANINTF] |= (1<<ERRIF);
+			chip->overflows++;
+		}
+	}
+	update_int(chip);
+}
+
+// ----------------------------------------------------------------------------
+// the rest of the bus
+
+static avr_cycle_count_t reply_due(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+	mcp2515_t *chip = (mcp2515_t *)param;
+	chip->pending_reply = 0;
+	receive(chip, &chip->reply);
+	return 0;
+}
+
+// What the BMS does with a frame we sent
+static void bus_frame(mcp2515_t *chip, const mcp2515_frame_t *frame)
+{
+	if (chip->reply_us == 0 || chip->pending_reply || frame->id != BMS_REQUEST_ID || frame->data[1] != 0x10) {
+		return;
+	}
+	chip->reply.id = BMS_RESPONSE_ID;
+	chip->reply.length = 8;
+	memset(chip->reply.data, 0, 8);
+	chip->reply.data[0] = 5;
+	chip->reply.data[1] = 0x50;
+	chip->reply.data[2] = frame->data[2];
+	chip->reply.data[3] = frame->data[3];
+	chip->reply.data[4] = frame->data[2]; // a value that is easy to spot
+	chip->pending_reply = 1;
+	avr_cycle_timer_register(chip->avr, avr_usec_to_cycles(chip->avr, chip->reply_us) + frame_cycles(chip, 8), reply_due, chip);
+}
+
+static avr_cycle_count_t broadcast_due(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+	mcp2515_t *chip = (mcp2515_t *)param;
+	mcp2515_frame_t frame;
+	frame.id = BROADCAST_FIRST_ID + chip->next_broadcast;
+	frame.length = 8;
+	for (uint8_t i = 0; i < 8; i++) {
+		frame.data[i] = chip->next_broadcast + i;
+	}
+	chip->next_broadcast = (chip->next_broadcast + 1) % BROADCASTS;
+	if (mode(chip) == MODE_NORMAL || mode(chip) == MODE_LISTEN) {
+		receive(chip, &frame);
+	}
+	return when + avr_usec_to_cycles(avr, chip->broadcast_us);
+}
+
+// ----------------------------------------------------------------------------
+// transmitting
+
+static avr_cycle_count_t transmit_done(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+	mcp2515_t *chip = (mcp2515_t *)param;
+	uint8_t buffer = chip->transmitting - 1;
+	uint8_t *tx = &chip->regs[TXB0CTRL + buffer * 0x10];
+	chip->transmitting = 0;
+	if (tx[0] & (1<<TXREQ)) {
+		mcp2515_frame_t frame;
+		frame.id = standard_id(&tx[1]);
+		frame.length = tx[5] & 0x0F;
+		if (frame.length > 8) {
+			frame.length = 8;
+		}
+		memcpy(frame.data, &tx[6], 8);
+		tx[0] &= ~(1<<TXREQ);
+		chip->regs[CANINTF] |= 1 << (TX0IF + buffer);
+		chip->frames_sent++;
+		if (mode(chip) == MODE_LOOPBACK) {
+			receive(chip, &frame);
+		} else {
+			bus_frame(chip, &frame);
+		}
+	}
+	update_int(chip);
+	start_transmission(chip);
+	return 0;
+}
+
+// The highest TXP priority goes first, and the higher buffer on a tie
+static void start_transmission(mcp2515_t *chip)
+{
+	if (chip->transmitting || (mode(chip) != MODE_NORMAL && mode(chip) != MODE_LOOPBACK)) {
+		return;
+	}
+	int8_t best = -1;
+	uint8_t best_priority = 0;
+	for (int8_t buffer = 2; buffer >= 0; buffer--) {
+		uint8_t control = chip->regs[TXB0CTRL + buffer * 0x10];
+		if ((control & (1<<TXREQ)) && (best < 0 || (control & 0x03) > best_priority)) {
+			best = buffer;
+			best_priority = control & 0x03;
+		}
+	}
+	if (best < 0) {
+		return;
+	}
+	chip->transmitting = best + 1;
+	uint8_t length = chip->regs[TXB0CTRL + best * 0x10 + 5] & 0x0F;
+	avr_cycle_timer_register(chip->avr, frame_cycles(chip, length > 8 ? 8 : length), transmit_done, chip);
+}
+
+// ----------------------------------------------------------------------------
+// registers
+
+static void reset(mcp2515_t *chip)
+{
+	avr_cycle_timer_cancel(chip->avr, transmit_done, chip);
+	avr_cycle_timer_cancel(chip->avr, reply_due, chip);
+	memset(chip->regs, 0, sizeof(chip->regs));
+	chip->regs[CANSTAT] = MODE_CONFIG;
+	chip->regs[CANCTRL] = 0x87;
+	chip->transmitting = 0;
+	chip->pending_reply = 0;
+	update_int(chip);
+}
+
+static void write_register(mcp2515_t *chip, uint8_t address, uint8_t value)
+{
+	address = register_address(address);
+	uint8_t config_only = address <= RXF2EID0 || (address >= RXF3SIDH && address <= RXF5EID0) ||
+		(address >= RXM0SIDH && address <= CNF1);
+	if (address == CANSTAT || address == TEC || address == REC || (config_only && mode(chip) != MODE_CONFIG)) {
+		return;
+	}
+	switch (address) {
+		case CANCTRL:
+			chip->regs[CANCTRL] = value;
+			if (value & (1<<ABAT)) {
+				for (uint8_t buffer = 0; buffer < 3; buffer++) {
+					if (chip->transmitting != buffer + 1) {
+						chip->regs[TXB0CTRL + buffer * 0x10] &= ~(1<<TXREQ);
+					}
+				}
+			}
+			// switches right away; a real one waits for the frame on the bus to end
+			chip->regs[CANSTAT] = (chip->regs[CANSTAT] & ~MODE_MASK) | (value & MODE_MASK);
+			start_transmission(chip);
+			break;
+		case EFLG:
+			chip->regs[EFLG] = (chip->regs[EFLG] & ~((1<<RX1OVR)|(1<<RX0OVR))) | (value & ((1<<RX1OVR)|(1<<RX0OVR)));
+			break;
+		case TXB0CTRL:
+		case TXB1CTRL:
+		case TXB2CTRL:
+			chip->regs[address] = (chip->regs[address] & ~0x0B) | (value & 0x0B); // TXREQ and TXP
+			start_transmission(chip);
+			break;
+		default:
+			chip->regs[address] = value;
+			break;
+	}
+	update_int(chip);
+}
+
+static uint8_t read_status(mcp2515_t *chip)
+{
+	uint8_t flags = chip->regs[CANINTF];
+	uint8_t status = flags & 0x03;
+	for (uint8_t buffer = 0; buffer < 3; buffer++) {
+		if (chip->regs[TXB0CTRL + buffer * 0x10] & (1<<TXREQ)) {
+			status |= 1 << (2 + 2 * buffer);
+		}
+		if (flags & (1 << (TX0IF + buffer))) {
+			status |= 1 << (3 + 2 * buffer);
+		}
+	}
+	return status;
+}
+
+static uint8_t rx_status(mcp2515_t *chip)
+{
+	uint8_t flags = chip->regs[CANINTF];
+	uint8_t status = ((flags & (1<<RX0IF)) ? 0x40 : 0) | ((flags & (1<<RX1IF)) ? 0x80 : 0);
+	if (flags & (1<<RX0IF)) {
+		status |= chip->regs[RXB0CTRL] & 0x01;
+	} else if (flags & (1<<RX1IF)) {
+		status |= chip->regs[RXB1CTRL] & 0x07;
+	}
+	return status; // standard data frames only
+}
+
+// ----------------------------------------------------------------------------
+// SPI
+
+static uint8_t spi_byte(mcp2515_t *chip, uint8_t in)
+{
+	uint8_t index = chip->count++;
+	chip->spi_bytes++;
+	if (index == 0) {
+		chip->instruction = in;
+		if (in == SPI_RESET) {
+			reset(chip);
+		} else if ((in & 0xF9) == SPI_READ_RX) {
+			// 0x90 RXB0SIDH, 0x92 RXB0D0, 0x94 RXB1SIDH, 0x96 RXB1D0
+			uint8_t buffer = (in >> 2) & 1;
+			chip->address = (buffer ? RXB1SIDH : RXB0SIDH) + ((in & 0x02) ? 5 : 0);
+			chip->read_rx = buffer + 1;
+		} else if ((in & 0xF8) == SPI_WRITE_TX) {
+			// 0x40 TXB0SIDH, 0x41 TXB0D0, 0x42 TXB1SIDH, ...
+			chip->address = TXB0CTRL + (in & 0x06) * 8 + 1 + ((in & 0x01) ? 5 : 0);
+		} else if ((in & 0xF8) == SPI_RTS) {
+			for (uint8_t buffer = 0; buffer < 3; buffer++) {
+				if (in & (1 << buffer)) {
+					chip->regs[TXB0CTRL + buffer * 0x10] |= (1<<TXREQ);
+				}
+			}
+			start_transmission(chip);
+		}
+		return 0xFF;
+	}
+	switch (chip->instruction) {
+		case SPI_READ:
+			if (index == 1) {
+				chip->address = in;
+				return 0xFF;
+			}
+			return chip->regs[register_address(chip->address++)];
+		case SPI_WRITE:
+			if (index == 1) {
+				chip->address = in;
+			} else {
+				write_register(chip, chip->address++, in);
+			}
+			return 0xFF;
+		case SPI_BIT_MODIFY:
+			if (index == 1) {
+				chip->address = in;
+			} else if (index == 2) {
+				chip->mask = in;
+			} else if (index == 3) {
+				uint8_t address = register_address(chip->address);
+				write_register(chip, address, (chip->regs[address] & ~chip->mask) | (in & chip->mask));
+			}
+			return 0xFF;
+		case SPI_READ_STATUS:
+			return read_status(chip);
+		case SPI_RX_STATUS:
+			return rx_status(chip);
+		default:
+			if (chip->read_rx) {
+				return chip->regs[chip->address++ & 0x7F];
+			}
+			if ((chip->instruction & 0xF8) == SPI_WRITE_TX) {
+				chip->regs[chip->address++ & 0x7F] = in;
+			}
+			return 0xFF;
+	}
+}
+
+static void mosi_in(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	mcp2515_t *chip = (mcp2515_t *)param;
+	if (!chip->selected) {
+		return;
+	}
+	avr_raise_irq(chip->irq + MCP2515_IRQ_MISO, spi_byte(chip, value));
+}
+
+static void cs_in(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	mcp2515_t *chip = (mcp2515_t *)param;
+	if (!value) {
+		chip->selected = 1;
+		chip->count = 0;
+		chip->read_rx = 0;
+		return;
+	}
+	if (chip->selected && chip->read_rx) {
+		// READ RX BUFFER frees the buffer when CS goes high
+		chip->regs[CANINTF] &= ~(1 << (chip->read_rx - 1));
+		update_int(chip);
+	}
+	chip->selected = 0;
+	chip->read_rx = 0;
+}
+
+// ----------------------------------------------------------------------------
+
+static const char *irq_names[MCP2515_IRQ_COUNT] = {
+	[MCP2515_IRQ_MOSI] = "8<mcp2515.mosi",
+	[MCP2515_IRQ_MISO] = "8>mcp2515.miso",
+	[MCP2515_IRQ_CS] = "<mcp2515.cs",
+	[MCP2515_IRQ_INT] = ">mcp2515.int",
+};
+
+void mcp2515_model_init(avr_t *avr, mcp2515_t *chip, uint32_t reply_us, uint32_t broadcast_us)
+{
+	memset(chip, 0, sizeof(*chip));
+	chip->avr = avr;
+	chip->irq = avr_alloc_irq(&avr->irq_pool, 0, MCP2515_IRQ_COUNT, irq_names);
+	chip->reply_us = reply_us;
+	chip->broadcast_us = broadcast_us;
+	avr_irq_register_notify(chip->irq + MCP2515_IRQ_MOSI, mosi_in, chip);
+	avr_irq_register_notify(chip->irq + MCP2515_IRQ_CS, cs_in, chip);
+	reset(chip);
+	if (broadcast_us) {
+		avr_cycle_timer_register_usec(avr, broadcast_us, broadcast_due, chip);
+	}
+}
+
+void mcp2515_model_connect(mcp2515_t *chip, char cs_port, uint8_t cs_pin, char int_port, uint8_t int_pin)
+{
+	avr_t *avr = chip->avr;
+	avr_connect_irq(avr_io_getirq(avr, AVR_IOCTL_SPI_GETIRQ(0), SPI_IRQ_OUTPUT), chip->irq + MCP2515_IRQ_MOSI);
+	avr_connect_irq(chip->irq + MCP2515_IRQ_MISO, avr_io_getirq(avr, AVR_IOCTL_SPI_GETIRQ(0), SPI_IRQ_INPUT));
+	avr_connect_irq(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ(cs_port), cs_pin), chip->irq + MCP2515_IRQ_CS);
+	avr_connect_irq(chip->irq + MCP2515_IRQ_INT, avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ(int_port), int_pin));
+	chip->selected = 0;
+	update_int(chip);
+}
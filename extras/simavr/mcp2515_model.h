@@ -0,0 +1,71 @@
+// An MCP2515 on simavr's SPI, for running the AVR builds without a board - by corbin dunn
+// www.corbinstreehouse.com
+//
+// Enough of the chip for the drivers in this repository: the register file, the SPI
+// instructions they use (RESET, READ, WRITE, BIT MODIFY, READ STATUS, RX STATUS, READ RX BUFFER,
+// LOAD TX BUFFER, RTS), the operating modes, both receive buffers with their masks, filters and
+// rollover, the three transmit buffers, and the INT pin. Frames take as long on the "bus" as
+// CNF1-3 say they would with a 16 MHz crystal (47 + 8 * length bits, without stuff bits).
+//
+// In loopback mode transmitted frames come straight back. In normal and listen only modes the
+// bus has:
+//   - an Elithion BMS answering requests on 0x745 with replies on 0x74D after reply_us;
+//   - broadcasts from 0x620 to 0x628, one every broadcast_us, round robin.
+// Error states, bus-off, extended IDs and one shot mode are not modelled.
+
+#ifndef MCP2515_MODEL_H
+#define MCP2515_MODEL_H
+
+#include <stdint.h>
+
+#include "sim_avr.h"
+#include "sim_irq.h"
+
+enum {
+	MCP2515_IRQ_MOSI = 0, // connected to the SPI's output
+	MCP2515_IRQ_MISO, // to the SPI's input
+	MCP2515_IRQ_CS, // from the chip select pin
+	MCP2515_IRQ_INT, // to the INT pin; low when an enabled interrupt is flagged
+	MCP2515_IRQ_COUNT
+};
+
+typedef struct {
+	uint32_t id;
+	uint8_t length;
+	uint8_t data[8];
+} mcp2515_frame_t;
+
+typedef struct mcp2515_t {
+	avr_t *avr;
+	avr_irq_t *irq;
+	uint8_t regs[128];
+
+	// the SPI instruction in progress
+	uint8_t selected;
+	uint8_t count; // bytes since CS went low
+	uint8_t instruction;
+	uint8_t address;
+	uint8_t mask; // BIT MODIFY
+	uint8_t read_rx; // 1 + the buffer a READ RX BUFFER was for, to clear its flag on CS high
+
+	// the bus
+	uint8_t transmitting; // 1 + the TX buffer on the bus
+	uint32_t reply_us; // 0 for no BMS
+	uint32_t broadcast_us; // 0 for no broadcasts
+	uint8_t next_broadcast;
+	uint8_t pending_reply;
+	mcp2515_frame_t reply;
+
+	// counters for the report
+	uint32_t spi_bytes;
+	uint32_t frames_sent;
+	uint32_t frames_received;
+	uint32_t overflows;
+} mcp2515_t;
+
+void mcp2515_model_init(avr_t *avr, mcp2515_t *chip, uint32_t reply_us, uint32_t broadcast_us);
+
+// Wires the model to the SPI, the chip select pin and the INT pin, ie: ('B', 2, 'D', 3)
+void mcp2515_model_connect(mcp2515_t *chip, char cs_port, uint8_t cs_pin, char int_port, uint8_t int_pin);
+
+#endif
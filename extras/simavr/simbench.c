@@ -0,0 +1,237 @@
+// Runs an AVR firmware image under simavr with the MCP2515 model attached, and reports the
+// cycles and stack use of the functions named on the command line - by corbin dunn
+// www.corbinstreehouse.com
+//
+//   simbench -m atmega8 -f 7372800 [-c cycles] [-r reply_us] [-b broadcast_us]
+//            [-p name=0xaddress ...] firmware.elf
+//
+// The UART output goes to stdout as it comes, and the run stops when the firmware prints "done",
+// sleeps with interrupts off, crashes, or reaches the cycle limit (60 simulated seconds by
+// default). The bench firmware's own timer 1 table counts simulated cycles here.
+//
+// Not run yet: this was written without simavr or avr-gcc to hand, so neither it nor the model
+// has been built, and there are no figures from it to compare against. Until it has been checked
+// against the bench table from a real board, read what it prints as a sketch, not a measurement.
+//
+// A probe (-p, the address from avr-nm; mcp2515_demo's "make sim" fills these in) starts when
+// the program counter reaches the function and ends when the stack pointer rises above where it
+// was then, which is the RET (or RETI, for an interrupt vector) taking the return address off.
+// So a call's cycles are its body and its RET, without the CALL; a probe on an interrupt vector
+// counts from its first instruction, without the 4+ cycles of getting there. Interrupts that
+// land inside a call are counted in it, as they would be on the device. The stack column is
+// the most the call went below its return address, including anything it called and any
+// interrupt inside it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_core.h"
+#include "sim_io.h"
+#include "avr_uart.h"
+
+#include "mcp2515_model.h"
+
+#define MAX_PROBES 32
+#define MAX_DEPTH 16
+
+typedef struct {
+	const char *name;
+	uint32_t address; // bytes, like the program counter
+	uint32_t calls;
+	avr_cycle_count_t total;
+	avr_cycle_count_t min;
+	avr_cycle_count_t max;
+	uint16_t stack; // deepest, in bytes below the return address
+} probe_t;
+
+typedef struct {
+	probe_t *probe;
+	avr_cycle_count_t start;
+	uint16_t sp;
+	uint16_t lowest;
+} active_t;
+
+static probe_t probes[MAX_PROBES];
+static int probe_count;
+static active_t active[MAX_DEPTH];
+static int depth;
+
+static char line[256];
+static int line_length;
+static int done;
+
+static void uart_out(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	putchar(value);
+	if (value == '\n') {
+		line[line_length] = 0;
+		if (strcmp(line, "done") == 0) {
+			done = 1;
+		}
+		line_length = 0;
+	} else if (line_length < (int)sizeof(line) - 1) {
+		line[line_length++] = value;
+	}
+}
+
+static uint16_t stack_pointer(avr_t *avr)
+{
+	return avr->data[R_SPL] | (avr->data[R_SPH] << 8);
+}
+
+// After every instruction
+static void trace(avr_t *avr, uint16_t sp)
+{
+	// returns first
+	while (depth > 0 && sp > active[depth - 1].sp) {
+		active_t *call = &active[--depth];
+		avr_cycle_count_t cycles = avr->cycle - call->start;
+		probe_t *probe = call->probe;
+		probe->calls++;
+		probe->total += cycles;
+		if (cycles < probe->min) {
+			probe->min = cycles;
+		}
+		if (cycles > probe->max) {
+			probe->max = cycles;
+		}
+		if (call->sp - call->lowest > probe->stack) {
+			probe->stack = call->sp - call->lowest;
+		}
+	}
+	for (int i = 0; i < depth; i++) {
+		if (sp < active[i].lowest) {
+			active[i].lowest = sp;
+		}
+	}
+	// a step that didn't move (ie: sleeping) isn't another call
+	static avr_flashaddr_t last_pc = ~(avr_flashaddr_t)0;
+	if (avr->pc == last_pc) {
+		return;
+	}
+	last_pc = avr->pc;
+	for (int i = 0; i < probe_count; i++) {
+		if (avr->pc == probes[i].address) {
+			if (depth < MAX_DEPTH) {
+				active[depth].probe = &probes[i];
+				active[depth].start = avr->cycle;
+				active[depth].sp = sp;
+				active[depth].lowest = sp;
+				depth++;
+			}
+			break;
+		}
+	}
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s -m mcu -f frequency [-c cycles] [-r reply_us] [-b broadcast_us] [-p name=0xaddress ...] firmware.elf\n", name);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	const char *mcu = NULL;
+	uint32_t frequency = 0;
+	avr_cycle_count_t limit = 0;
+	uint32_t reply_us = 500;
+	uint32_t broadcast_us = 1000;
+	int option;
+	while ((option = getopt(argc, argv, "m:f:c:r:b:p:")) != -1) {
+		switch (option) {
+			case 'm': mcu = optarg; break;
+			case 'f': frequency = strtoul(optarg, NULL, 0); break;
+			case 'c': limit = strtoull(optarg, NULL, 0); break;
+			case 'r': reply_us = strtoul(optarg, NULL, 0); break;
+			case 'b': broadcast_us = strtoul(optarg, NULL, 0); break;
+			case 'p': {
+				char *equals = strchr(optarg, '=');
+				if (equals == NULL || probe_count == MAX_PROBES) {
+					usage(argv[0]);
+				}
+				*equals = 0;
+				probes[probe_count].name = optarg;
+				probes[probe_count].address = strtoul(equals + 1, NULL, 16);
+				probes[probe_count].min = ~(avr_cycle_count_t)0;
+				probe_count++;
+				break;
+			}
+			default: usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || mcu == NULL || frequency == 0) {
+		usage(argv[0]);
+	}
+
+	elf_firmware_t firmware;
+	memset(&firmware, 0, sizeof(firmware));
+	if (elf_read_firmware(argv[optind], &firmware) != 0) {
+		fprintf(stderr, "%s: can't read %s\n", argv[0], argv[optind]);
+		return 1;
+	}
+	strncpy(firmware.mmcu, mcu, sizeof(firmware.mmcu) - 1);
+	firmware.frequency = frequency;
+	avr_t *avr = avr_make_mcu_by_name(firmware.mmcu);
+	if (avr == NULL) {
+		fprintf(stderr, "%s: simavr doesn't know the %s\n", argv[0], mcu);
+		return 1;
+	}
+	avr_init(avr);
+	avr_load_firmware(avr, &firmware);
+	if (limit == 0) {
+		limit = (avr_cycle_count_t)frequency * 60;
+	}
+
+	// The UART straight to stdout, not through simavr's own line logging
+	uint32_t flags = 0;
+	avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('0'), &flags);
+	flags &= ~AVR_UART_FLAG_STDIO;
+	avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('0'), &flags);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUTPUT), uart_out, NULL);
+
+	// mcp2515_demo/defaults.h: CS on PB2, INT on PD3
+	static mcp2515_t chip;
+	mcp2515_model_init(avr, &chip, reply_us, broadcast_us);
+	mcp2515_model_connect(&chip, 'B', 2, 'D', 3);
+
+	// SP is 0 until the startup code sets it to RAMEND
+	uint16_t top = avr->ramend;
+	uint16_t lowest = top;
+	int state = cpu_Running;
+	while (!done && avr->cycle < limit && state != cpu_Done && state != cpu_Crashed) {
+		state = avr_run(avr);
+		uint16_t sp = stack_pointer(avr);
+		if (sp > avr->ioend && sp < lowest) {
+			lowest = sp;
+		}
+		trace(avr, sp);
+	}
+
+	fflush(stdout);
+	fprintf(stderr, "\nsimbench: %s at %lu Hz, %llu cycles (%.3f s), %s\n", mcu, (unsigned long)frequency,
+		(unsigned long long)avr->cycle, (double)avr->cycle / frequency,
+		done ? "done" : state == cpu_Crashed ? "crashed" : state == cpu_Done ? "stopped" : "cycle limit");
+	fprintf(stderr, "simbench: stack high water %u bytes below 0x%04X\n", top - lowest, top);
+	fprintf(stderr, "simbench: MCP2515 %lu SPI bytes, %lu frames sent, %lu received, %lu overflows\n",
+		(unsigned long)chip.spi_bytes, (unsigned long)chip.frames_sent, (unsigned long)chip.frames_received,
+		(unsigned long)chip.overflows);
+	if (probe_count) {
+		fprintf(stderr, "\n%-24s %8s %9s %9s %9s %6s\n", "function", "calls", "min cyc", "avg cyc", "max cyc", "stack");
+		for (int i = 0; i < probe_count; i++) {
+			probe_t *probe = &probes[i];
+			if (probe->calls == 0) {
+				fprintf(stderr, "%-24s %8u %9s %9s %9s %6s\n", probe->name, 0, "-", "-", "-", "-");
+				continue;
+			}
+			fprintf(stderr, "%-24s %8lu %9llu %9llu %9llu %6u\n", probe->name, (unsigned long)probe->calls,
+				(unsigned long long)probe->min, (unsigned long long)(probe->total / probe->calls),
+				(unsigned long long)probe->max, probe->stack);
+		}
+	}
+	return done ? 0 : 1;
+}
@@ -0,0 +1,84 @@
+// A software filter for all 2048 standard CAN IDs - by corbin dunn
+// www.corbinstreehouse.com
+
+#include "id_filter.h"
+
+#define ID_MASK 0x7FF
+
+// Whether any ID in the bitmap has value under mask
+static uint8_t any_under(const uint8_t *bitmap, uint16_t mask, uint16_t value)
+{
+	// Every combination of the bits the mask ignores
+	uint16_t ignored = ~mask & ID_MASK;
+	uint16_t bits = 0;
+	do {
+		if (id_filter_has(bitmap, value | bits)) {
+			return 1;
+		}
+		bits = (bits - ignored) & ignored;
+	} while (bits);
+	return 0;
+}
+
+// How many different id & mask values the IDs in the bitmap have; the first few go in values
+static uint16_t values_under(const uint8_t *bitmap, uint16_t mask, uint16_t *values, uint8_t size)
+{
+	uint16_t count = 0;
+	uint16_t value = 0;
+	do {
+		if (any_under(bitmap, mask, value)) {
+			if (count < size) {
+				values[count] = value;
+			}
+			count++;
+		}
+		value = (value - mask) & mask;
+	} while (value);
+	return count;
+}
+
+static uint8_t ignored_bits(uint16_t mask)
+{
+	uint8_t count = 0;
+	for (uint16_t bit = 1; bit <= ID_MASK; bit <<= 1) {
+		count += (mask & bit) == 0;
+	}
+	return count;
+}
+
+void id_filter_cover(const uint8_t *bitmap, IdFilterCover *cover)
+{
+	uint16_t mask = ID_MASK;
+	uint16_t count = values_under(bitmap, mask, cover->filters, ID_FILTER_HARDWARE_FILTERS);
+	while (count > ID_FILTER_HARDWARE_FILTERS) {
+		uint16_t bestMask = 0;
+		uint16_t bestCount = 0;
+		uint16_t bestAccepted = 0xFFFF;
+		for (uint16_t bit = 1; bit <= ID_MASK; bit <<= 1) {
+			if (mask & bit) {
+				uint16_t candidate = mask & ~bit;
+				uint16_t candidateCount = values_under(bitmap, candidate, 0, 0);
+				uint16_t accepted = candidateCount << ignored_bits(candidate);
+				if (accepted < bestAccepted || (accepted == bestAccepted && candidateCount < bestCount)) {
+					bestMask = candidate;
+					bestCount = candidateCount;
+					bestAccepted = accepted;
+				}
+			}
+		}
+		mask = bestMask;
+		count = bestCount;
+	}
+	if (count == 0) {
+		// Nothing wanted; the software filter drops it all, so don't open the hardware's
+		cover->filters[0] = 0;
+		count = 1;
+	} else {
+		values_under(bitmap, mask, cover->filters, ID_FILTER_HARDWARE_FILTERS);
+	}
+	for (uint8_t i = count; i < ID_FILTER_HARDWARE_FILTERS; i++) {
+		cover->filters[i] = cover->filters[count - 1];
+	}
+	cover->mask = mask;
+	cover->accepted = count << ignored_bits(mask);
+}
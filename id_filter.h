@@ -0,0 +1,57 @@
+#ifndef ID_FILTER_H
+#define ID_FILTER_H
+
+// A software filter for all 2048 standard CAN IDs - by corbin dunn
+// www.corbinstreehouse.com
+//
+// The MCP2515 has two masks and six filters: enough for the BMS replies, not for the BMS
+// broadcast block plus a charger, a motor controller and a DC-DC converter without opening the
+// masks so wide that the rest of the bus comes through too. This is the second stage: one bit
+// per ID (bit id & 7 of byte id >> 3), checked in constant time as soon as a frame's ID has been
+// read, so an unwanted frame is dropped before its length and data are clocked over the SPI.
+//
+// id_filter_cover() works out the hardware's half: the tightest mask (with up to six filter
+// values under it) that lets through every ID in the bitmap, so the MCP2515 still drops most of
+// the unwanted traffic without interrupting at all.
+
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define ID_FILTER_SIZE 256 // bytes in a bitmap
+#define ID_FILTER_HARDWARE_FILTERS 6
+
+typedef struct {
+	uint16_t mask; // the same for both receive buffers
+	uint16_t filters[ID_FILTER_HARDWARE_FILTERS]; // RXF0..5; repeats when fewer are needed
+	uint16_t accepted; // how many IDs the hardware lets through, >= those in the bitmap
+} IdFilterCover;
+
+static inline uint8_t id_filter_has(const uint8_t *bitmap, uint16_t id)
+{
+	return bitmap[(id >> 3) & 0xFF] & (1 << (id & 7));
+}
+
+// Adds the IDs from first to last (inclusive)
+static inline void id_filter_add(uint8_t *bitmap, uint16_t first, uint16_t last)
+{
+	for (uint16_t id = first; id <= last && id <= 0x7FF; id++) {
+		bitmap[id >> 3] |= 1 << (id & 7);
+	}
+}
+
+// Greedy: starting from an exact match, clears whichever mask bit lets through the fewest extra
+// IDs until at most six filter values are needed. An empty bitmap leaves the hardware matching
+// just ID 0.
+// About 2048 bitmap lookups per candidate mask, so a few hundred milliseconds on a 16 MHz AVR at
+// worst; call it once at setup.
+void id_filter_cover(const uint8_t *bitmap, IdFilterCover *cover);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	// ID_FILTER_H
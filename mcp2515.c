@@ -43,6 +43,38 @@
 
 
 #include "defaults.h"
+#include "spi_bus.h"
+#include "CanbusConfig.h"
+#include "id_filter.h"
+
+// F_CPU/16, as it always has been. The MCP2515 takes up to 10 MHz, so on short wires this can go
+// up to 10000000 (F_CPU/2 at 16 MHz).
+#ifndef MCP2515_SPI_CLOCK
+	#define MCP2515_SPI_CLOCK (F_CPU / 16)
+#endif
+
+static const SpiDevice mcp2515Spi = { MCP2515_SPI_CLOCK, MSBFIRST, 0 };
+
+// Every chip select holds the shared SPI bus, and so does every operation made of several of
+// them (the begins nest); see spi_bus.h. Nothing here may be called from an interrupt that isn't
+// registered with SPI.usingInterrupt(), except through spi_bus_defer().
+static inline void mcp2515_select(void)
+{
+	spi_bus_begin(&mcp2515Spi);
+	RESET(MCP2515_CS);
+}
+
+static inline void mcp2515_deselect(void)
+{
+	SET(MCP2515_CS);
+	spi_bus_end();
+}
+
+#if CANBUS_ENABLE_ID_FILTER
+// Set by mcp2515_set_id_filter(), and put back by every mcp2515_init()
+static const uint8_t *id_filter;
+static IdFilterCover id_filter_hardware;
+#endif
 
 // -------------------------------------------------------------------------
 // Schreibt/liest ein Byte ueber den Hardware SPI Bus
@@ -62,13 +94,13 @@ uint8_t spi_putc( uint8_t data )
 // -------------------------------------------------------------------------
 void mcp2515_write_register( uint8_t adress, uint8_t data )
 {
-	RESET(MCP2515_CS);
+	mcp2515_select();
 	
 	spi_putc(SPI_WRITE);
 	spi_putc(adress);
 	spi_putc(data);
 	
-	SET(MCP2515_CS);
+	mcp2515_deselect();
 }
 
 // -------------------------------------------------------------------------
@@ -76,14 +108,14 @@ uint8_t mcp2515_read_register(uint8_t adress)
 {
 	uint8_t data;
 	
-	RESET(MCP2515_CS);
+	mcp2515_select();
 	
 	spi_putc(SPI_READ);
 	spi_putc(adress);
 	
 	data = spi_putc(0xff);	
 	
-	SET(MCP2515_CS);
+	mcp2515_deselect();
 	
 	return data;
 }
@@ -91,14 +123,14 @@ uint8_t mcp2515_read_register(uint8_t adress)
 // -------------------------------------------------------------------------
 void mcp2515_bit_modify(uint8_t adress, uint8_t mask, uint8_t data)
 {
-	RESET(MCP2515_CS);
+	mcp2515_select();
 	
 	spi_putc(SPI_BIT_MODIFY);
 	spi_putc(adress);
 	spi_putc(mask);
 	spi_putc(data);
 	
-	SET(MCP2515_CS);
+	mcp2515_deselect();
 }
 
 // ----------------------------------------------------------------------------
@@ -106,18 +138,95 @@ uint8_t mcp2515_read_status(uint8_t type)
 {
 	uint8_t data;
 	
-	RESET(MCP2515_CS);
+	mcp2515_select();
 	
 	spi_putc(type);
 	data = spi_putc(0xff);
 	
-	SET(MCP2515_CS);
+	mcp2515_deselect();
 	
 	return data;
 }
 
+#if CANBUS_ENABLE_ID_FILTER
+// ----------------------------------------------------------------------------
+// a standard ID in the SIDH, SIDL, EID8, EID0 layout of the filters and masks
+static void mcp2515_put_id(uint16_t id)
+{
+	spi_putc(id >> 3);
+	spi_putc(id << 5);
+	spi_putc(0);
+	spi_putc(0);
+}
+
+// ----------------------------------------------------------------------------
+// only in configuration mode
+static void mcp2515_write_acceptance(void)
+{
+	if (id_filter == 0) {
+		// turn off filters => receive any message
+		mcp2515_write_register(RXB0CTRL, (1<<RXM1)|(1<<RXM0));
+		mcp2515_write_register(RXB1CTRL, (1<<RXM1)|(1<<RXM0));
+		return;
+	}
+	// RXF0..2, then RXF3..5 (CANSTAT and CANCTRL are in between), then both masks
+	uint8_t i = 0;
+	mcp2515_select();
+	spi_putc(SPI_WRITE);
+	spi_putc(RXF0SIDH);
+	for (; i < 3; i++) {
+		mcp2515_put_id(id_filter_hardware.filters[i]);
+	}
+	mcp2515_deselect();
+	mcp2515_select();
+	spi_putc(SPI_WRITE);
+	spi_putc(RXF3SIDH);
+	for (; i < ID_FILTER_HARDWARE_FILTERS; i++) {
+		mcp2515_put_id(id_filter_hardware.filters[i]);
+	}
+	mcp2515_deselect();
+	mcp2515_select();
+	spi_putc(SPI_WRITE);
+	spi_putc(RXM0SIDH);
+	mcp2515_put_id(id_filter_hardware.mask);
+	mcp2515_put_id(id_filter_hardware.mask);
+	mcp2515_deselect();
+	
+	// standard frames that match only
+	mcp2515_write_register(RXB0CTRL, 0);
+	mcp2515_write_register(RXB1CTRL, 0);
+}
+
+// ----------------------------------------------------------------------------
+uint8_t mcp2515_set_id_filter(const uint8_t *bitmap)
+{
+	id_filter = bitmap;
+	if (bitmap) {
+		id_filter_cover(bitmap, &id_filter_hardware);
+	}
+	
+	spi_bus_begin(&mcp2515Spi);
+	// the filters and masks can only be written in configuration mode
+	uint8_t mode = mcp2515_read_register(CANSTAT) & ((1<<OPMOD2)|(1<<OPMOD1)|(1<<OPMOD0));
+	mcp2515_bit_modify(CANCTRL, (1<<REQOP2)|(1<<REQOP1)|(1<<REQOP0), (1<<REQOP2));
+	uint8_t i;
+	for (i = 0; i < 100; i++) {
+		if ((mcp2515_read_register(CANSTAT) & ((1<<OPMOD2)|(1<<OPMOD1)|(1<<OPMOD0))) == (1<<OPMOD2)) {
+			break;
+		}
+		_delay_us(10);
+	}
+	if (i < 100) {
+		mcp2515_write_acceptance();
+	}
+	mcp2515_bit_modify(CANCTRL, (1<<REQOP2)|(1<<REQOP1)|(1<<REQOP0), mode);
+	spi_bus_end();
+	return i < 100;
+}
+#endif
+
 // -------------------------------------------------------------------------
-uint8_t mcp2515_init(uint8_t speed)
+static uint8_t mcp2515_init_held(uint8_t speed)
 {
 		
 	
@@ -135,21 +244,19 @@ uint8_t mcp2515_init(uint8_t speed)
 	SET_INPUT(MCP2515_INT);
 	SET(MCP2515_INT);
 	
-	// active SPI master interface
-	SPCR = (1<<SPE)|(1<<MSTR) | (0<<SPR1)|(1<<SPR0);
-	SPSR = 0;
+	// the SPI master interface is set up for each transaction, by spi_bus_begin()
 	
 	// reset MCP2515 by software reset.
 	// After this he is in configuration mode.
-	RESET(MCP2515_CS);
+	mcp2515_select();
 	spi_putc(SPI_RESET);
-	SET(MCP2515_CS);
+	mcp2515_deselect();
 	
 	// wait a little bit until the MCP2515 has restarted
 	_delay_us(10);
 	
 	// load CNF1..3 Register
-	RESET(MCP2515_CS);
+	mcp2515_select();
 	spi_putc(SPI_WRITE);
 	spi_putc(CNF3);
 	
@@ -167,9 +274,15 @@ uint8_t mcp2515_init(uint8_t speed)
 	//spi_putc(1<<BRP0);
     spi_putc(speed);
 
-	// activate interrupts
+#if CANBUS_ENABLE_ERROR_RECOVERY
+	// activate interrupts; errors too so a bus-off doesn't go unnoticed
+	spi_putc((1<<MERRE)|(1<<ERRIE)|(1<<RX1IE)|(1<<RX0IE));
+#else
+	// activate interrupts; only for received frames, as nothing would clear the error flags
+	// and INT would stay low
 	spi_putc((1<<RX1IE)|(1<<RX0IE));
-	SET(MCP2515_CS);
+#endif
+	mcp2515_deselect();
 	
 	// test if we could read back the value => is the chip accessible?
 	if (mcp2515_read_register(CNF1) != speed) {
@@ -184,9 +297,13 @@ uint8_t mcp2515_init(uint8_t speed)
 	// set TXnRTS as inputs
 	mcp2515_write_register(TXRTSCTRL, 0);
 	
+#if CANBUS_ENABLE_ID_FILTER
+	mcp2515_write_acceptance();
+#else
 	// turn off filters => receive any message
 	mcp2515_write_register(RXB0CTRL, (1<<RXM1)|(1<<RXM0));
 	mcp2515_write_register(RXB1CTRL, (1<<RXM1)|(1<<RXM0));
+#endif
 	
 	// reset device to normal mode
 	mcp2515_write_register(CANCTRL, 0);
@@ -194,6 +311,16 @@ uint8_t mcp2515_init(uint8_t speed)
 	return true;
 }
 
+// ----------------------------------------------------------------------------
+uint8_t mcp2515_init(uint8_t speed)
+{
+	spi_bus_init();
+	spi_bus_begin(&mcp2515Spi);
+	uint8_t result = mcp2515_init_held(speed);
+	spi_bus_end();
+	return result;
+}
+
 // ----------------------------------------------------------------------------
 // check if there are any new messages waiting
 
@@ -217,12 +344,16 @@ uint8_t mcp2515_check_free_buffer(void)
 }
 
 // ----------------------------------------------------------------------------
-uint8_t mcp2515_get_message(tCAN *message)
+static uint8_t mcp2515_get_message_held(tCAN *message)
 {
-	// read status
-	uint8_t status = mcp2515_read_status(SPI_RX_STATUS);
+	uint8_t status;
 	uint8_t addr;
 	uint8_t t;
+#if CANBUS_ENABLE_ID_FILTER
+again:
+#endif
+	// read status
+	status = mcp2515_read_status(SPI_RX_STATUS);
 	if (bit_is_set(status,6)) {
 		// message in buffer 0
 		addr = SPI_READ_RX;
@@ -236,12 +367,22 @@ uint8_t mcp2515_get_message(tCAN *message)
 		return 0;
 	}
 
-	RESET(MCP2515_CS);
+	mcp2515_select();
 	spi_putc(addr);
 	
 	// read id
-	message->id  = (uint16_t) spi_putc(0xff) << 3;
-	message->id |=            spi_putc(0xff) >> 5;
+	uint16_t id = (uint16_t) spi_putc(0xff) << 3;
+	id |=                    spi_putc(0xff) >> 5;
+	
+#if CANBUS_ENABLE_ID_FILTER
+	if (id_filter && !id_filter_has(id_filter, id)) {
+		// not wanted: skip the rest of it, and see if the other buffer has something
+		mcp2515_deselect();
+		mcp2515_bit_modify(CANINTF, bit_is_set(status, 6) ? (1<<RX0IF) : (1<<RX1IF), 0);
+		goto again;
+	}
+#endif
+	message->id = id;
 	
 	spi_putc(0xff);
 	spi_putc(0xff);
@@ -256,7 +397,7 @@ uint8_t mcp2515_get_message(tCAN *message)
 	for (t=0;t<length;t++) {
 		message->data[t] = spi_putc(0xff);
 	}
-	SET(MCP2515_CS);
+	mcp2515_deselect();
 	
 	// clear interrupt flag
 	if (bit_is_set(status, 6)) {
@@ -270,7 +411,17 @@ uint8_t mcp2515_get_message(tCAN *message)
 }
 
 // ----------------------------------------------------------------------------
-uint8_t mcp2515_send_message(tCAN *message)
+uint8_t mcp2515_get_message(tCAN *message)
+{
+	// the status read and the buffer it names, with no other device in between
+	spi_bus_begin(&mcp2515Spi);
+	uint8_t result = mcp2515_get_message_held(message);
+	spi_bus_end();
+	return result;
+}
+
+// ----------------------------------------------------------------------------
+static uint8_t mcp2515_send_message_held(tCAN *message)
 {
 	uint8_t status = mcp2515_read_status(SPI_READ_STATUS);
 	
@@ -298,7 +449,7 @@ uint8_t mcp2515_send_message(tCAN *message)
 		return 0;
 	}
 	
-	RESET(MCP2515_CS);
+	mcp2515_select();
 	spi_putc(SPI_WRITE_TX | address);
 	
 	spi_putc(message->id >> 3);
@@ -322,15 +473,66 @@ uint8_t mcp2515_send_message(tCAN *message)
 			spi_putc(message->data[t]);
 		}
 	}
-	SET(MCP2515_CS);
+	mcp2515_deselect();
 	
 	_delay_us(1);
 	
 	// send message
-	RESET(MCP2515_CS);
+	mcp2515_select();
 	address = (address == 0) ? 1 : address;
 	spi_putc(SPI_RTS | address);
-	SET(MCP2515_CS);
+	mcp2515_deselect();
 	
 	return address;
 }
+
+// ----------------------------------------------------------------------------
+uint8_t mcp2515_send_message(tCAN *message)
+{
+	spi_bus_begin(&mcp2515Spi);
+	uint8_t result = mcp2515_send_message_held(message);
+	spi_bus_end();
+	return result;
+}
+
+// ----------------------------------------------------------------------------
+void mcp2515_sleep(void)
+{
+	// wake on bus activity
+	spi_bus_begin(&mcp2515Spi);
+	mcp2515_bit_modify(CANINTF, (1<<WAKIF), 0);
+	mcp2515_bit_modify(CANINTE, (1<<WAKIE), (1<<WAKIE));
+	
+	mcp2515_bit_modify(CANCTRL, (1<<REQOP2)|(1<<REQOP1)|(1<<REQOP0), (1<<REQOP0));
+	spi_bus_end();
+}
+
+// ----------------------------------------------------------------------------
+static uint8_t mcp2515_wakeup_held(void)
+{
+	// Setting WAKIF over SPI wakes it up the same as bus activity does. Either
+	// way it comes up in listen only mode, and the frame that woke it is lost.
+	mcp2515_bit_modify(CANINTF, (1<<WAKIF), (1<<WAKIF));
+	mcp2515_bit_modify(CANINTE, (1<<WAKIE), 0);
+	mcp2515_bit_modify(CANINTF, (1<<WAKIF), 0);
+	
+	mcp2515_bit_modify(CANCTRL, (1<<REQOP2)|(1<<REQOP1)|(1<<REQOP0), 0);
+	
+	// the oscillator needs 128 cycles to start; give it plenty
+	for (uint8_t i = 0; i < 100; i++) {
+		if ((mcp2515_read_register(CANSTAT) & ((1<<OPMOD2)|(1<<OPMOD1)|(1<<OPMOD0))) == 0) {
+			return true;
+		}
+		_delay_us(10);
+	}
+	return false;
+}
+
+// ----------------------------------------------------------------------------
+uint8_t mcp2515_wakeup(void)
+{
+	spi_bus_begin(&mcp2515Spi);
+	uint8_t result = mcp2515_wakeup_held();
+	spi_bus_end();
+	return result;
+}
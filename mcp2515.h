@@ -79,11 +79,26 @@ uint8_t mcp2515_check_message(void);
 uint8_t mcp2515_check_free_buffer(void);
 
 // ----------------------------------------------------------------------------
+// 0 if nothing is waiting, including when all that was waiting was dropped by
+// the ID filter
 uint8_t mcp2515_get_message(tCAN *message);
 
 // ----------------------------------------------------------------------------
 uint8_t mcp2515_send_message(tCAN *message);
 
+// ----------------------------------------------------------------------------
+// put the MCP2515 to sleep; any bus activity wakes it again and pulls INT low
+void mcp2515_sleep(void);
+
+// ----------------------------------------------------------------------------
+// wake up (if it isn't already) and go back to normal mode
+uint8_t mcp2515_wakeup(void);
+
+// ----------------------------------------------------------------------------
+// receive only the IDs in bitmap (see id_filter.h), or everything for 0; the
+// bitmap is used from then on, not copied. With CANBUS_ENABLE_ID_FILTER only.
+uint8_t mcp2515_set_id_filter(const uint8_t *bitmap);
+
 
 #ifdef __cplusplus
 }
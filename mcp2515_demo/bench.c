@@ -0,0 +1,521 @@
+// On-device benchmark for the MCP2515 driver - by corbin dunn
+// www.corbinstreehouse.com
+//
+//   make bench            builds bench.hex instead of main.hex
+//   make program TARGET=bench
+//
+// Everything is timed with timer 1 counting F_CPU directly (extended to 32 bits by its overflow
+// interrupt), so the cycle counts are exact apart from the interrupts that land inside a
+// measurement; the call overhead of reading the timer is measured first and taken off. Results
+// go to the UART at 9600 baud as one table:
+//
+//   spi     what one driver call costs over SPI, in loopback mode so no bus is needed
+//   conv    the float and percentage conversions CanbusClass applies to every value it returns,
+//           with no hardware FPU
+//   rtt     the CanbusClass getters themselves (../Canbus.cpp, built in by bench_getters.cpp), so
+//           the request, the wait, the reply matching and the decoding are all counted; needs a
+//           BMS (or something answering like one) on the bus at the speed mcp2515_init() sets
+//   rx      frames drained from a live bus for one second, and whether the MCP2515 overflowed
+//   stress  loopback at 1 Mbps with all three TX buffers kept full and both RX buffers drained;
+//           every frame carries a sequence number and a pattern, so loss, duplicates, reordering
+//           and corruption are counted. This is the driver's own ceiling, without a bus or BMS.
+//
+// Compare runs across driver changes and boards at the same F_CPU and SPI clock.
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+
+#include <util/delay.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "uart.h"
+#include "mcp2515.h"
+#include "bench_getters.h"
+#include "global.h"
+#include "defaults.h"
+
+// ----------------------------------------------------------------------------
+
+#define	PRINT(string, ...)		printf_P(PSTR(string), ##__VA_ARGS__)
+
+#define SPI_REPEATS 100
+#define CONV_REPEATS 100
+#define RTT_REPEATS 20
+#define RX_WINDOW_MS 1000
+#define STRESS_ROUNDS 8
+#define STRESS_FRAMES 1024 // per round; one bit each to spot duplicates
+
+#if defined(TIMSK1)
+	#define TIMER1_INTERRUPTS TIMSK1
+	#define TIMER1_FLAGS TIFR1
+#else
+	#define TIMER1_INTERRUPTS TIMSK // atmega8
+	#define TIMER1_FLAGS TIFR
+#endif
+
+static int putchar__(char c, FILE *stream) {
+	uart_putc(c);
+	return 0;
+}
+
+static FILE mystdout = FDEV_SETUP_STREAM(putchar__, 0, _FDEV_SETUP_WRITE);
+
+// ----------------------------------------------------------------------------
+// Cycle counter
+
+static volatile uint16_t timerOverflows;
+static uint16_t timerOverhead;
+
+ISR(TIMER1_OVF_vect)
+{
+	timerOverflows++;
+}
+
+static void timer_init(void)
+{
+	TCCR1A = 0;
+	TCCR1B = (1<<CS10); // no prescaler
+	TIMER1_INTERRUPTS |= (1<<TOIE1);
+}
+
+static uint32_t cycles(void)
+{
+	uint8_t sreg = SREG;
+	cli();
+	uint16_t low = TCNT1;
+	uint16_t high = timerOverflows;
+	if ((TIMER1_FLAGS & (1<<TOV1)) && low < 0x8000) {
+		high++; // it wrapped after cli() and the interrupt hasn't run yet
+	}
+	SREG = sreg;
+	return ((uint32_t)high << 16) | low;
+}
+
+static uint32_t cycles_since(uint32_t start)
+{
+	uint32_t elapsed = cycles() - start;
+	return elapsed > timerOverhead ? elapsed - timerOverhead : 0;
+}
+
+static uint32_t cycles_to_us(uint32_t c)
+{
+	return c * 1000 / (F_CPU / 1000);
+}
+
+uint32_t bench_millis(void)
+{
+	return cycles() / (F_CPU / 1000);
+}
+
+// ----------------------------------------------------------------------------
+// Results
+
+typedef struct {
+	uint32_t min;
+	uint32_t max;
+	uint32_t total;
+	uint16_t count;
+	uint16_t failures;
+} Stats;
+
+static void stats_reset(Stats *stats)
+{
+	stats->min = 0xFFFFFFFF;
+	stats->max = 0;
+	stats->total = 0;
+	stats->count = 0;
+	stats->failures = 0;
+}
+
+static void stats_add(Stats *stats, uint32_t c)
+{
+	if (c < stats->min) stats->min = c;
+	if (c > stats->max) stats->max = c;
+	stats->total += c;
+	stats->count++;
+}
+
+static void print_header(void)
+{
+	PRINT("\ngroup  what            n   min cyc   avg cyc   max cyc    avg us  fail\n");
+}
+
+static void print_row(const char *group, const char *what, const Stats *stats)
+{
+	PRINT("%-6s %-14S %3u", group, what, stats->count);
+	if (stats->count) {
+		uint32_t avg = stats->total / stats->count;
+		PRINT(" %9lu %9lu %9lu %9lu", stats->min, avg, stats->max, cycles_to_us(avg));
+	} else {
+		PRINT("         -         -         -         -");
+	}
+	PRINT(" %5u\n", stats->failures);
+}
+
+// ----------------------------------------------------------------------------
+// Helpers
+
+static void set_mode(uint8_t mode)
+{
+	mcp2515_bit_modify(CANCTRL, (1<<REQOP2)|(1<<REQOP1)|(1<<REQOP0), mode);
+	while ((mcp2515_read_register(CANSTAT) & ((1<<OPMOD2)|(1<<OPMOD1)|(1<<OPMOD0))) != mode)
+		;
+}
+
+// waits for INT with a timeout in ms; true if it went low
+static bool wait_for_message(uint16_t timeoutMs)
+{
+	uint32_t start = cycles();
+	uint32_t limit = (uint32_t)timeoutMs * (F_CPU / 1000);
+	while (!mcp2515_check_message()) {
+		if (cycles() - start > limit) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void make_frame(tCAN *message, uint16_t id, uint8_t length)
+{
+	message->id = id;
+	message->header.rtr = 0;
+	message->header.length = length;
+	for (uint8_t i = 0; i < 8; i++) {
+		message->data[i] = 0;
+	}
+}
+
+// ----------------------------------------------------------------------------
+// spi: register read, frame send, frame read
+
+static void bench_spi(void)
+{
+	Stats stats;
+	tCAN message;
+	uint32_t start;
+
+	stats_reset(&stats);
+	for (uint8_t i = 0; i < SPI_REPEATS; i++) {
+		start = cycles();
+		mcp2515_read_register(CANSTAT);
+		stats_add(&stats, cycles_since(start));
+	}
+	print_row("spi", PSTR("read register"), &stats);
+
+	set_mode(1<<REQOP1); // loopback
+	Stats sends, reads;
+	stats_reset(&sends);
+	stats_reset(&reads);
+	for (uint8_t i = 0; i < SPI_REPEATS; i++) {
+		make_frame(&message, 0x123, 8);
+		message.data[0] = i;
+		start = cycles();
+		uint8_t sent = mcp2515_send_message(&message);
+		uint32_t c = cycles_since(start);
+		if (!sent) {
+			sends.failures++;
+			continue;
+		}
+		stats_add(&sends, c);
+		if (!wait_for_message(10)) {
+			reads.failures++;
+			continue;
+		}
+		start = cycles();
+		uint8_t got = mcp2515_get_message(&message);
+		c = cycles_since(start);
+		if (got && message.data[0] == i) {
+			stats_add(&reads, c);
+		} else {
+			reads.failures++;
+		}
+	}
+	set_mode(0);
+	print_row("spi", PSTR("send frame"), &sends);
+	print_row("spi", PSTR("read frame"), &reads);
+}
+
+// ----------------------------------------------------------------------------
+// conv: the per value conversions, as written in Canbus.cpp; kept out of line like the library's
+// helpers so the call is part of the cost
+
+__attribute__((noinline)) static float CONVERT_ENCODED_MVOLT_TO_VOLT(float v)
+{
+	return 2.0 + (v)*10.0/1000.0;
+}
+
+__attribute__((noinline)) static float milliValueToNormalValue(int v)
+{
+	return v * 100.0 / 1000.0;
+}
+
+#define ROUND_255_AS_PERCENTAGE(v) ((200*(uint16_t)(v) + 255) / 510)
+
+__attribute__((noinline)) static int8_t limitPercentage(uint8_t v)
+{
+	return ROUND_255_AS_PERCENTAGE(v);
+}
+
+static volatile float floatResult;
+static volatile int8_t percentResult;
+
+static void bench_conv(void)
+{
+	Stats stats;
+	uint32_t start;
+
+	stats_reset(&stats);
+	for (uint8_t i = 0; i < CONV_REPEATS; i++) {
+		start = cycles();
+		floatResult = CONVERT_ENCODED_MVOLT_TO_VOLT(i);
+		stats_add(&stats, cycles_since(start));
+	}
+	print_row("conv", PSTR("cell volts"), &stats);
+
+	stats_reset(&stats);
+	for (uint8_t i = 0; i < CONV_REPEATS; i++) {
+		start = cycles();
+		floatResult = milliValueToNormalValue(i * 300 - 15000); // both signs, as pack currents come
+		stats_add(&stats, cycles_since(start));
+	}
+	print_row("conv", PSTR("milli to unit"), &stats);
+
+	stats_reset(&stats);
+	for (uint8_t i = 0; i < CONV_REPEATS; i++) {
+		start = cycles();
+		percentResult = limitPercentage(i * 2 + 55);
+		stats_add(&stats, cycles_since(start));
+	}
+	print_row("conv", PSTR("255 as percent"), &stats);
+}
+
+// ----------------------------------------------------------------------------
+// rtt: a CanbusClass getter, from the request it sends to the value it returns
+
+typedef struct {
+	uint8_t pid;
+	const char *name;
+} Getter;
+
+static const char soc_name[] PROGMEM = "getStateOfChrg";
+static const char pack_name[] PROGMEM = "getPackVoltage";
+static const char min_name[] PROGMEM = "getMinVoltage";
+static const char current_name[] PROGMEM = "getPackCurrent";
+static const char faults_name[] PROGMEM = "getFaults";
+
+static const Getter getters[] = {
+	{ 0x50, soc_name },
+	{ 0x46, pack_name },
+	{ 0x43, min_name },
+	{ 0x68, current_name },
+	{ 0x62, faults_name },
+};
+
+static void bench_rtt(void)
+{
+	Stats stats;
+
+	bench_getters_init();
+	for (uint8_t g = 0; g < sizeof(getters) / sizeof(getters[0]); g++) {
+		stats_reset(&stats);
+		for (uint8_t i = 0; i < RTT_REPEATS; i++) {
+			uint32_t start = cycles();
+			uint8_t answered = bench_getter(getters[g].pid);
+			uint32_t c = cycles_since(start);
+			if (answered) {
+				stats_add(&stats, c);
+			} else {
+				stats.failures++;
+			}
+			_delay_ms(2); // leave the BMS alone between requests
+		}
+		print_row("rtt", getters[g].name, &stats);
+	}
+}
+
+// ----------------------------------------------------------------------------
+// rx: drain whatever the bus carries for RX_WINDOW_MS
+
+static void bench_rx(void)
+{
+	tCAN message;
+	Stats stats;
+	uint16_t overflows = 0;
+
+	stats_reset(&stats);
+	mcp2515_bit_modify(EFLG, (1<<RX1OVR)|(1<<RX0OVR), 0);
+	uint32_t start = cycles();
+	uint32_t window = (uint32_t)RX_WINDOW_MS * (F_CPU / 1000);
+	while (cycles() - start < window) {
+		if (mcp2515_check_message()) {
+			uint32_t readStart = cycles();
+			if (mcp2515_get_message(&message)) {
+				stats_add(&stats, cycles_since(readStart));
+			} else {
+				// INT low without a frame: a receive overflow
+				uint8_t flags = mcp2515_read_register(EFLG);
+				if (flags & ((1<<RX1OVR)|(1<<RX0OVR))) {
+					overflows++;
+					mcp2515_bit_modify(EFLG, (1<<RX1OVR)|(1<<RX0OVR), 0);
+				}
+				// Clear only the flags that were read, and never RXnIF: a frame that came in
+				// since the status read has its flag set, and mcp2515_get_message() clears it
+				uint8_t interrupts = mcp2515_read_register(CANINTF) & ~((1<<RX1IF)|(1<<RX0IF));
+				if (interrupts) {
+					mcp2515_bit_modify(CANINTF, interrupts, 0);
+				}
+			}
+		}
+	}
+	if (mcp2515_read_register(EFLG) & ((1<<RX1OVR)|(1<<RX0OVR))) {
+		overflows++;
+	}
+	stats.failures = overflows;
+	print_row("rx", PSTR("frames in 1s"), &stats);
+	if (stats.count) {
+		uint32_t perFrame = stats.total / stats.count;
+		PRINT("rx: %u frames/s received, drain ceiling %lu frames/s, %u overflows\n",
+			stats.count, perFrame ? F_CPU / perFrame : 0, overflows);
+	}
+}
+
+// ----------------------------------------------------------------------------
+// stress: the loopback ceiling
+
+static uint8_t seen[STRESS_FRAMES / 8];
+
+static uint8_t stress_pattern(uint16_t sequence, uint8_t i)
+{
+	return (uint8_t)(sequence * 7 + i * 31);
+}
+
+static void bench_stress(void)
+{
+	tCAN message;
+	uint32_t frames = 0, missing = 0, duplicates = 0, reordered = 0, corrupt = 0;
+	uint32_t overflows = 0, spiBytes = 0, busy = 0;
+
+	// Config mode, then the fastest bit rate (BRP 0, 1 Mbps with the 16 MHz crystal) so the
+	// frames themselves take as little time as possible
+	set_mode(1<<REQOP2);
+	uint8_t cnf1 = mcp2515_read_register(CNF1);
+	mcp2515_write_register(CNF1, 0);
+	mcp2515_bit_modify(RXB0CTRL, (1<<BUKT), (1<<BUKT)); // roll over into RXB1 when RXB0 is full
+	set_mode(1<<REQOP1);
+
+	uint32_t start = cycles();
+	for (uint8_t round = 0; round < STRESS_ROUNDS; round++) {
+		for (uint8_t i = 0; i < sizeof(seen); i++) {
+			seen[i] = 0;
+		}
+		uint16_t next = 0; // to send
+		uint16_t received = 0;
+		int32_t last = -1;
+		uint32_t idleSince = cycles();
+		while (received < STRESS_FRAMES && cycles() - idleSince < F_CPU / 100) {
+			uint32_t work = cycles();
+#if MCP2515_COUNT_SPI_BYTES
+			uint16_t bytes = mcp2515_spi_bytes;
+#endif
+			bool didSomething = false;
+			if (mcp2515_check_message()) {
+				if (mcp2515_get_message(&message)) {
+					uint16_t sequence = message.data[0] | (message.data[1] << 8);
+					bool intact = message.id == (0x100 | (sequence & 0xFF)) && message.header.length == 8 && sequence < STRESS_FRAMES;
+					for (uint8_t i = 2; intact && i < 8; i++) {
+						intact = message.data[i] == stress_pattern(sequence, i);
+					}
+					if (!intact) {
+						corrupt++;
+					} else if (seen[sequence / 8] & (1 << (sequence % 8))) {
+						duplicates++;
+					} else {
+						seen[sequence / 8] |= 1 << (sequence % 8);
+						if ((int32_t)sequence < last) {
+							reordered++;
+						}
+						last = sequence;
+					}
+					received++;
+				} else if (mcp2515_read_register(EFLG) & ((1<<RX1OVR)|(1<<RX0OVR))) {
+					overflows++;
+					mcp2515_bit_modify(EFLG, (1<<RX1OVR)|(1<<RX0OVR), 0);
+				}
+				didSomething = true;
+			} else if (next < STRESS_FRAMES) {
+				make_frame(&message, 0x100 | (next & 0xFF), 8);
+				message.data[0] = next;
+				message.data[1] = next >> 8;
+				for (uint8_t i = 2; i < 8; i++) {
+					message.data[i] = stress_pattern(next, i);
+				}
+				if (mcp2515_send_message(&message)) {
+					next++;
+					didSomething = true;
+				}
+			}
+			if (didSomething) {
+				busy += cycles_since(work);
+#if MCP2515_COUNT_SPI_BYTES
+				spiBytes += (uint16_t)(mcp2515_spi_bytes - bytes);
+#endif
+				idleSince = cycles();
+			}
+		}
+		for (uint16_t sequence = 0; sequence < next; sequence++) {
+			if ((seen[sequence / 8] & (1 << (sequence % 8))) == 0) {
+				missing++;
+			}
+		}
+		frames += next;
+	}
+	uint32_t elapsed = cycles_since(start);
+
+	set_mode(1<<REQOP2);
+	mcp2515_write_register(CNF1, cnf1);
+	mcp2515_bit_modify(RXB0CTRL, (1<<BUKT), 0);
+	set_mode(0);
+
+	uint32_t ms = elapsed / (F_CPU / 1000);
+	uint32_t perFrame = frames ? busy / frames : 0;
+	PRINT("stress: %lu frames in %lu ms, %lu frames/s; driver %lu cycles/frame (ceiling %lu frames/s)\n",
+		frames, ms, ms ? frames * 1000 / ms : 0, perFrame, perFrame ? F_CPU / perFrame : 0);
+#if MCP2515_COUNT_SPI_BYTES
+	PRINT("stress: %lu SPI bytes/frame (send and receive)\n", frames ? spiBytes / frames : 0);
+#endif
+	PRINT("stress: %lu missing, %lu duplicated, %lu reordered, %lu corrupt, %lu overflows\n",
+		missing, duplicates, reordered, corrupt, overflows);
+}
+
+// ----------------------------------------------------------------------------
+
+int main(void)
+{
+	uart_init(UART_BAUD_SELECT(9600UL, F_CPU));
+	timer_init();
+	sei();
+	stdout = &mystdout;
+
+	// What reading the timer itself costs
+	uint32_t start = cycles();
+	timerOverhead = cycles() - start;
+
+	if (!mcp2515_init()) {
+		PRINT("error: no MCP2515\n");
+		for (;;);
+	}
+	PRINT("bench: F_CPU %lu, timer overhead %u cycles\n", (uint32_t)F_CPU, timerOverhead);
+
+	print_header();
+	bench_spi();
+	bench_conv();
+	bench_rtt();
+	bench_rx();
+	bench_stress();
+	PRINT("done\n");
+
+	for (;;);
+	return 0;
+}
@@ -0,0 +1,83 @@
+// The rtt rows of bench.c: the library's own getters, on this demo's driver - by corbin dunn
+// www.corbinstreehouse.com
+//
+// ../Canbus.cpp is built without ARDUINO, as for the host tools, so CanbusClass takes its
+// driver from the table below: this demo's mcp2515.c, which bench.c has already set up, and
+// timer 1 for millis(). A getter then sends the request, waits for and matches the reply and
+// decodes it exactly as it does in a sketch; only the driver underneath is the demo's.
+
+#include "../Canbus.h"
+#include "../elithion_defs.h"
+
+#include "bench_getters.h"
+
+static volatile float floatValue;
+static volatile uint8_t byteValue;
+
+// The getters don't say whether they were answered, so the driver watches for the reply
+static uint8_t expectedPid;
+static bool answered;
+
+static uint8_t benchInit(uint8_t /* speed */)
+{
+	return 1; // bench.c's mcp2515_init() did it, at the demo's own bit rate
+}
+
+static uint8_t benchGetMessage(tCAN *message)
+{
+	uint8_t got = mcp2515_get_message(message);
+	if (got && message->id == ELITHION_PID_RESPONSE && message->data[2] == expectedPid) {
+		answered = true;
+	}
+	return got;
+}
+
+static unsigned long benchMillis(void)
+{
+	return bench_millis();
+}
+
+static const CanbusDriver benchDriver = {
+	benchInit,
+	mcp2515_check_message,
+	benchGetMessage,
+	mcp2515_send_message,
+	mcp2515_bit_modify,
+	benchMillis,
+	mcp2515_read_register,
+};
+
+static CanbusClass canbus;
+
+void bench_getters_init(void)
+{
+	canbus.setDriver(&benchDriver);
+	canbus.init(CanSpeed500);
+}
+
+uint8_t bench_getter(uint8_t pid)
+{
+	expectedPid = pid;
+	answered = false;
+	switch (pid) {
+		case ELITHION_PID_PACK_SOC:
+			byteValue = canbus.getStateOfCharge();
+			break;
+		case 0x46:
+			floatValue = canbus.getPackVoltage();
+			break;
+		case 0x43:
+			floatValue = canbus.getMinVoltage();
+			break;
+		case 0x68:
+			floatValue = canbus.getPackCurrent();
+			break;
+		case ELITHION_PID_FAULT: {
+			FaultKindOptions present, warnings;
+			StoredFaultKind stored;
+			canbus.getFaults(&present, &stored, &warnings);
+			break;
+		}
+	}
+	return answered;
+}
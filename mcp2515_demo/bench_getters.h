@@ -0,0 +1,30 @@
+#ifndef	BENCH_GETTERS_H
+#define	BENCH_GETTERS_H
+
+// ----------------------------------------------------------------------------
+// The library's CanbusClass getters for bench.c's rtt rows (bench_getters.cpp)
+
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// ----------------------------------------------------------------------------
+// hands this demo's driver, already initialized, to a CanbusClass
+void bench_getters_init(void);
+
+// ----------------------------------------------------------------------------
+// calls the getter that asks for pid; true if the BMS answered it
+uint8_t bench_getter(uint8_t pid);
+
+// ----------------------------------------------------------------------------
+// for the library's timeouts; bench.c provides it from timer 1
+uint32_t bench_millis(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	// BENCH_GETTERS_H
@@ -2,6 +2,7 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
+#include <avr/sleep.h>
 
 #include <util/delay.h>
 #include <stdio.h>
@@ -42,6 +43,15 @@ void print_can_message(tCAN *message)
 	}
 }
 
+// ----------------------------------------------------------------------------
+// weckt uns, wenn der MCP2515 eine Nachricht hat (INT an PD3 = INT1)
+
+ISR(INT1_vect)
+{
+	// Low-Level Interrupt, wuerde sonst dauernd ausloesen
+	GICR &= ~(1<<INT1);
+}
+
 // ----------------------------------------------------------------------------
 // Hauptprogram
 
@@ -124,7 +134,21 @@ int main(void)
 	
 	PRINT("Warte auf den Empfang von Nachrichten\n\n");
 	
+	// IDLE, damit der UART noch fertig senden kann
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	
 	while (1) {
+		// schlafen statt den INT Pin abzufragen
+		cli();
+		if (!mcp2515_check_message()) {
+			GICR |= (1<<INT1);		// ISC11/ISC10 = 0 => Low-Level
+			sleep_enable();
+			sei();
+			sleep_cpu();
+			sleep_disable();
+		}
+		sei();
+		
 		// warten bis wir eine Nachricht empfangen
 		if (mcp2515_check_message()) {
 			PRINT("Nachricht empfangen!\n");
@@ -38,11 +38,20 @@
 // -------------------------------------------------------------------------
 // Schreibt/liest ein Byte ueber den Hardware SPI Bus
 
+#if MCP2515_COUNT_SPI_BYTES
+uint16_t mcp2515_spi_bytes;
+#endif
+
 uint8_t spi_putc( uint8_t data )
 {
 	// put byte in send-buffer
 	SPDR = data;
 	
+#if MCP2515_COUNT_SPI_BYTES
+	// while the byte shifts out, so counting costs no time
+	mcp2515_spi_bytes++;
+#endif
+	
 	// wait until byte was send
 	while( !( SPSR & (1<<SPIF) ) )
 		;
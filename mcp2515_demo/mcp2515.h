@@ -48,6 +48,11 @@ typedef struct
 // ----------------------------------------------------------------------------
 uint8_t spi_putc( uint8_t data );
 
+#if MCP2515_COUNT_SPI_BYTES
+// every byte through spi_putc(); the bench build turns this on
+extern uint16_t mcp2515_spi_bytes;
+#endif
+
 // ----------------------------------------------------------------------------
 void mcp2515_write_register( uint8_t adress, uint8_t data );
 
@@ -0,0 +1,120 @@
+// Sharing the AVR's SPI peripheral between devices - by corbin dunn
+// www.corbinstreehouse.com
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#if ARDUINO>=100
+#include <Arduino.h> // Arduino 1.0
+#else
+#include <Wprogram.h> // Arduino 0022
+#endif
+#include <SPI.h>
+
+#include "spi_bus.h"
+
+static volatile uint8_t depth; // spi_bus_begin()s not yet ended; only the outermost pair touches the SPI
+static volatile uint8_t working; // deferred work is running, between its own transactions
+static volatile SpiBusWork deferred;
+#ifndef SPI_HAS_TRANSACTION
+static uint8_t savedSpcr;
+static uint8_t savedSpsr;
+#endif
+
+// Runs work with working set, then whatever was deferred while it ran, until nothing is left
+static void spi_bus_work(SpiBusWork work)
+{
+	while (work) {
+		work();
+		uint8_t sreg = SREG;
+		cli();
+		work = deferred;
+		deferred = 0;
+		working = work != 0;
+		SREG = sreg;
+	}
+}
+
+void spi_bus_init(void)
+{
+#ifdef SPI_HAS_TRANSACTION
+	SPI.begin();
+#endif
+}
+
+void spi_bus_begin(const SpiDevice *device)
+{
+	// Counted first, so an interrupt that lands in between defers its work instead of taking the
+	// bus from under us
+	uint8_t outermost = ++depth == 1;
+	if (!outermost) {
+		return;
+	}
+#ifdef SPI_HAS_TRANSACTION
+	// Also masks the interrupts registered with SPI.usingInterrupt() until spi_bus_end()
+	SPI.beginTransaction(SPISettings(device->clock, device->bitOrder, device->dataMode));
+#else
+	// What SPISettings does: the fastest divider that doesn't go over the device's clock
+	uint8_t divider = 0; // F_CPU/2, /4, ... /128
+	while (divider < 6 && (F_CPU / 2 >> divider) > device->clock) {
+		divider++;
+	}
+	if (divider == 6) {
+		divider = 7; // F_CPU/128 is SPR1:0 = 3 without SPI2X, the same as F_CPU/64 with it
+	}
+	savedSpcr = SPCR;
+	savedSpsr = SPSR & (1<<SPI2X);
+	SPCR = (1<<SPE) | (1<<MSTR) | (device->bitOrder == LSBFIRST ? (1<<DORD) : 0) |
+		(device->dataMode & ((1<<CPOL)|(1<<CPHA))) | ((divider >> 1) & ((1<<SPR1)|(1<<SPR0)));
+	SPSR = (divider & 1) ? 0 : (1<<SPI2X);
+#endif
+}
+
+void spi_bus_end(void)
+{
+	if (depth > 1) {
+		depth--;
+		return;
+	}
+#ifdef SPI_HAS_TRANSACTION
+	SPI.endTransaction();
+#else
+	SPCR = savedSpcr;
+	SPSR = savedSpsr;
+#endif
+	uint8_t sreg = SREG;
+	cli();
+	depth = 0;
+	// Anything an interrupt handed over while we had the bus; it takes the bus itself. The ends
+	// inside it come back here with working set, and leave what was deferred meanwhile to the
+	// loop in spi_bus_work().
+	SpiBusWork work = 0;
+	if (!working) {
+		work = deferred;
+		deferred = 0;
+		working = work != 0;
+	}
+	SREG = sreg;
+	spi_bus_work(work);
+}
+
+uint8_t spi_bus_defer(SpiBusWork work)
+{
+	uint8_t sreg = SREG;
+	cli();
+	// The bus is free between the transactions of deferred work too, but the work isn't done
+	uint8_t runNow = depth == 0 && !working;
+	uint8_t accepted = 1;
+	if (runNow) {
+		working = 1;
+	} else if (deferred && deferred != work) {
+		accepted = 0;
+	} else {
+		deferred = work;
+	}
+	SREG = sreg;
+	if (runNow) {
+		spi_bus_work(work); // nothing else can take the bus until this interrupt returns
+	}
+	return accepted;
+}
@@ -0,0 +1,56 @@
+#ifndef SPI_BUS_H
+#define SPI_BUS_H
+
+// Sharing the AVR's SPI peripheral between devices - by corbin dunn
+// www.corbinstreehouse.com
+//
+// Each device has its own clock, bit order and mode, so an MCP2515 can share the bus with an SD
+// card being initialized at 250 kHz and a TFT in another SPI mode. Wrap every driver operation
+// in spi_bus_begin()/spi_bus_end(). They nest, and only the outermost pair is a transaction, so
+// a sequence of chip selects (ie: a status read and then the buffer it points at) holds the bus
+// from start to end.
+//
+// On Arduino 1.6 and later a transaction is SPI.beginTransaction()/SPI.endTransaction(), the
+// same as the SD, Ethernet and TFT libraries use, so they need no changes. An interrupt that
+// reads the MCP2515 should be registered with SPI.usingInterrupt(); every library's transactions
+// then hold it off. Older cores have no transactions: begin saves SPCR/SPSR and loads the
+// device's, and end puts them back.
+//
+// Interrupt code that isn't registered must not take the bus itself, because the transfer it
+// interrupted can't finish until it returns. Instead it hands its work to spi_bus_defer(),
+// which runs it right away if the bus is free and otherwise from spi_bus_end(), with interrupts
+// enabled, as soon as the bus is released. Deferred work is never entered twice: an interrupt
+// that lands between its transactions, while the bus is free but the work isn't finished, has
+// its work run afterwards.
+
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+typedef struct {
+	uint32_t clock; // Hz; the fastest the device (and its wiring) takes
+	uint8_t bitOrder; // MSBFIRST or LSBFIRST
+	uint8_t dataMode; // SPI_MODE0..3 from SPI.h; 0 is mode 0
+} SpiDevice;
+
+typedef void (*SpiBusWork)(void);
+
+// SPI.begin(): the pins, once, before the first transaction
+void spi_bus_init(void);
+
+// Not from an interrupt, unless it was registered with SPI.usingInterrupt(); see spi_bus_defer()
+void spi_bus_begin(const SpiDevice *device);
+void spi_bus_end(void);
+
+// Runs work now if the bus is free and no deferred work is running, otherwise once both are
+// done. There is one slot: returns 0 if different work is already waiting. Call from interrupts.
+uint8_t spi_bus_defer(SpiBusWork work);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	// SPI_BUS_H